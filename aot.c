@@ -0,0 +1,1045 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jsonpath.h"
+#include "compiler.h"
+#include "matcher.h"
+
+/*
+ * Compiles expressions known at build time to C. Every path becomes a
+ * function running its steps as nested loops over the json-c API, with
+ * the same callback contract as jp_match(). The code follows the program
+ * jp_compile() builds, so it selects exactly what the matcher would, in
+ * the same order, without parsing the expression or interpreting it.
+ *
+ * Sub-paths of filters become functions returning the first value they
+ * find, predicates become C expressions over them.
+ */
+
+struct aot_expr {
+	char *name;
+	char *expr;
+	struct jp_state *state;
+};
+
+/* state of the function being generated */
+struct aot_fn {
+	const struct jp_prog *prog;
+	const char *name;
+	FILE *out;
+	bool subpath;
+	bool jumps;
+	/* tested by every loop if a walk can stop the match */
+	const char *check;
+	int nvars;
+	int niters;
+	int nwalks;
+	int nlists;
+	int depth;
+};
+
+/* an operand of a predicate, as C expression */
+struct aot_operand {
+	char *expr;
+	bool value;
+};
+
+struct aot_jump {
+	char *expr;
+	int op;
+	int pc;
+};
+
+static bool aot_oom;
+
+static char *
+aot_printf(const char *fmt, ...)
+{
+	va_list ap;
+	char *s;
+
+	va_start(ap, fmt);
+
+	if (vasprintf(&s, fmt, ap) < 0)
+	{
+		s = NULL;
+		aot_oom = true;
+	}
+
+	va_end(ap);
+
+	return s;
+}
+
+/* a string literal, escaping everything that is not printable ascii */
+static char *
+aot_string(const char *s)
+{
+	size_t len;
+	FILE *out;
+	char *buf;
+
+	out = open_memstream(&buf, &len);
+
+	if (!out)
+	{
+		aot_oom = true;
+		return NULL;
+	}
+
+	fputc('"', out);
+
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if (*s < ' ' || *s > '~')
+			fprintf(out, "\\%03o", (unsigned char)*s);
+		else
+			fputc(*s, out);
+	}
+
+	fputc('"', out);
+
+	if (fclose(out))
+	{
+		aot_oom = true;
+		return NULL;
+	}
+
+	return buf;
+}
+
+static void
+aot_line(struct aot_fn *fn, const char *fmt, ...)
+{
+	va_list ap;
+	int i;
+
+	for (i = 0; *fmt && i < fn->depth; i++)
+		fputc('\t', fn->out);
+
+	va_start(ap, fmt);
+	vfprintf(fn->out, fmt, ap);
+	va_end(ap);
+
+	fputc('\n', fn->out);
+}
+
+static void
+aot_open(struct aot_fn *fn)
+{
+	aot_line(fn, "{");
+	fn->depth++;
+}
+
+static void
+aot_close(struct aot_fn *fn)
+{
+	fn->depth--;
+	aot_line(fn, "}");
+}
+
+static const char *
+aot_cmp_name(int cmp)
+{
+	switch (cmp)
+	{
+	case T_EQ: return "T_EQ";
+	case T_NE: return "T_NE";
+	case T_LT: return "T_LT";
+	case T_LE: return "T_LE";
+	case T_GT: return "T_GT";
+	default:   return "T_GE";
+	}
+}
+
+static char *
+aot_literal(const struct jp_value *val)
+{
+	char *str, *res;
+
+	switch (val->type)
+	{
+	case T_BOOL:
+		return aot_printf("jp_aot_bool(%d)", val->num);
+
+	case T_NUMBER:
+		return aot_printf("((struct jp_aot_value){ T_NUMBER, %d })", val->num);
+
+	default:
+		str = aot_string(val->str);
+		res = aot_printf("((struct jp_aot_value){ T_STRING, 0, %s })",
+		                 str ? str : "");
+		free(str);
+		return res;
+	}
+}
+
+/* an operand that looks at the document, as value or as truth */
+static char *
+aot_operand(struct aot_fn *fn, const struct jp_insn *insn, const char *cur,
+            bool value)
+{
+	const struct jp_test *test;
+	char *str, *res;
+
+	switch (insn->op)
+	{
+	case JP_OP_EXISTS:
+		return aot_printf(value ? "jp_aot_bool(%s_p%d(ctx, %s) != NULL)"
+		                        : "(%s_p%d(ctx, %s) != NULL)",
+		                  fn->name, insn->arg,
+		                  (insn->aux == T_ROOT) ? "ctx->root" : cur);
+
+	case JP_OP_RESOLVE:
+		return aot_printf(value ? "jp_aot_value(%s_p%d(ctx, %s))"
+		                        : "jp_aot_value(%s_p%d(ctx, %s)).num",
+		                  fn->name, insn->arg,
+		                  (insn->aux == T_ROOT) ? "ctx->root" : cur);
+
+	default:
+		test = &fn->prog->tests[insn->arg];
+		str = (test->type == json_type_string) ? aot_string(test->lit.str)
+		                                       : strdup("NULL");
+
+		if (!str)
+		{
+			aot_oom = true;
+			return NULL;
+		}
+
+		res = aot_printf(value ? "jp_aot_bool(jp_aot_test(%s_p%d(ctx, %s), %s, %s, %d, %s))"
+		                       : "jp_aot_test(%s_p%d(ctx, %s), %s, %s, %d, %s)",
+		                 fn->name, test->path,
+		                 (test->root == T_ROOT) ? "ctx->root" : cur,
+		                 (test->type == json_type_boolean) ? "json_type_boolean" :
+		                 (test->type == json_type_int) ? "json_type_int" :
+		                 "json_type_string",
+		                 aot_cmp_name(test->cmp), test->lit.num, str);
+		free(str);
+		return res;
+	}
+}
+
+/* converts an operand to the form its consumer expects */
+static char *
+aot_as(struct aot_operand *op, bool value)
+{
+	char *res;
+
+	if (op->value == value)
+		res = op->expr;
+	else if (value)
+		res = aot_printf("jp_aot_bool(%s)", op->expr);
+	else
+		res = aot_printf("(%s).num", op->expr);
+
+	if (res != op->expr)
+		free(op->expr);
+
+	op->expr = NULL;
+
+	return res;
+}
+
+/*
+ * Turns the predicate at pc back into an expression by running its
+ * instructions on a stack of C expressions. Short-circuit jumps all land
+ * past their last operand, so they are kept pending until then.
+ */
+static char *
+aot_pred(struct aot_fn *fn, int pc, const char *cur, const char *key,
+         const char *idx)
+{
+	const struct jp_prog *prog = fn->prog;
+	const struct jp_insn *insn;
+	struct aot_operand stack[JP_STACK_MAX + 1], *sp = stack;
+	struct aot_jump jumps[prog->ncode], *jp = jumps;
+	char *a, *b, *str;
+	int hoist;
+
+	for (;; pc++)
+	{
+		while (jp > jumps && jp[-1].pc == pc)
+		{
+			jp--;
+			b = aot_as(&sp[-1], false);
+			sp[-1].expr = aot_printf("(%s %s %s)", jp->expr,
+			                         (jp->op == JP_OP_AND) ? "&&" : "||",
+			                         b ? b : "");
+			sp[-1].value = false;
+			free(jp->expr);
+			free(b);
+		}
+
+		insn = &prog->code[pc];
+
+		switch (insn->op)
+		{
+		case JP_OP_TRUE:
+		case JP_OP_FALSE:
+			sp->expr = strdup((insn->op == JP_OP_TRUE) ? "1" : "0");
+			(sp++)->value = false;
+			break;
+
+		case JP_OP_IS_KEY:
+			str = aot_string(prog->consts[insn->arg].str);
+			sp->expr = aot_printf("(%s && !strcmp(%s, %s))", key, key,
+			                      str ? str : "");
+			(sp++)->value = false;
+			free(str);
+			break;
+
+		case JP_OP_IS_INDEX:
+			sp->expr = aot_printf("(%s == %d)", idx, insn->arg);
+			(sp++)->value = false;
+			break;
+
+		case JP_OP_EXISTS:
+		case JP_OP_RESOLVE:
+		case JP_OP_TEST:
+			sp->expr = aot_operand(fn, insn, cur, insn->op == JP_OP_RESOLVE);
+			sp->value = (insn->op == JP_OP_RESOLVE);
+			sp++;
+			break;
+
+		case JP_OP_HOIST:
+			/* evaluated on first use, then reused until the match ends */
+			hoist = insn->arg;
+			a = aot_operand(fn, &prog->hoists[hoist], cur, true);
+			sp->expr = aot_printf("(ctx->hoisted[%d].type != JP_AOT_UNRESOLVED"
+			                      " ? ctx->hoisted[%d] : (ctx->hoisted[%d] = %s))",
+			                      hoist, hoist, hoist, a ? a : "");
+			(sp++)->value = true;
+			free(a);
+			break;
+
+		case JP_OP_NOT:
+			a = aot_as(&sp[-1], false);
+			sp[-1].expr = aot_printf("!%s", a ? a : "");
+			sp[-1].value = false;
+			free(a);
+			break;
+
+		case JP_OP_AND:
+		case JP_OP_OR:
+			jp->expr = aot_as(&sp[-1], false);
+			jp->op = insn->op;
+			jp->pc = insn->arg;
+
+			if (!(jp++)->expr)
+				aot_oom = true;
+
+			sp--;
+			continue;
+
+		case JP_OP_LOAD:
+			sp->expr = aot_literal(&prog->consts[insn->arg]);
+			(sp++)->value = true;
+			break;
+
+		case JP_OP_CMP:
+			b = aot_as(&sp[-1], true);
+			a = aot_as(&sp[-2], true);
+			sp--;
+			sp[-1].expr = aot_printf("jp_aot_cmp(%s, %s, %s)",
+			                         aot_cmp_name(insn->aux),
+			                         a ? a : "", b ? b : "");
+			sp[-1].value = false;
+			free(a);
+			free(b);
+			break;
+
+		default:
+			return aot_as(&sp[-1], false);
+		}
+
+		if (!sp[-1].expr)
+			aot_oom = true;
+	}
+}
+
+static int
+aot_var(struct aot_fn *fn)
+{
+	return fn->nvars++;
+}
+
+/* emits the steps from pc on, applied to the value in variable v */
+static void
+aot_path(struct aot_fn *fn, int pc, int v)
+{
+	const struct jp_prog *prog = fn->prog;
+	const struct jp_insn *insn = &prog->code[pc];
+	const struct jp_value *list;
+	char *str, *pred, cur[16], key[24], idx[24];
+	int i, n, it;
+
+	switch (insn->op)
+	{
+	case JP_OP_KEY:
+		n = aot_var(fn);
+		str = aot_string(prog->consts[insn->arg].str);
+		aot_line(fn, "if (json_object_object_get_ex(v%d, %s, &v%d))",
+		         v, str ? str : "", n);
+		free(str);
+		aot_open(fn);
+		aot_path(fn, pc + 1, n);
+		aot_close(fn);
+		break;
+
+	case JP_OP_INDEX:
+		n = aot_var(fn);
+		aot_line(fn, "if ((v%d = jp_aot_index(v%d, %d)) != NULL)",
+		         n, v, insn->arg);
+		aot_open(fn);
+		aot_path(fn, pc + 1, n);
+		aot_close(fn);
+		break;
+
+	case JP_OP_SCAN:
+		n = aot_var(fn);
+		it = fn->niters++;
+		aot_line(fn, "for (jp_aot_scan(&i%d, v%d); %sjp_aot_next(&i%d, &v%d); )",
+		         it, v, fn->check, it, n);
+		aot_open(fn);
+
+		if (prog->code[insn->arg].op != JP_OP_TRUE ||
+		    prog->code[insn->arg + 1].op != JP_OP_RET)
+		{
+			snprintf(cur, sizeof(cur), "v%d", n);
+			snprintf(key, sizeof(key), "i%d.key", it);
+			snprintf(idx, sizeof(idx), "i%d.idx", it);
+			pred = aot_pred(fn, insn->arg, cur, key, idx);
+			aot_line(fn, "if (!%s)", pred ? pred : "");
+			aot_line(fn, "\tcontinue;");
+			aot_line(fn, "");
+			free(pred);
+		}
+
+		aot_path(fn, pc + 1, n);
+		aot_close(fn);
+		break;
+
+	case JP_OP_SLICE:
+		list = &prog->consts[insn->arg];
+
+		/* a zero step selects nothing */
+		if (jp_slice_step(list) == 0)
+			break;
+
+		n = aot_var(fn);
+		it = fn->niters++;
+		aot_line(fn, "for (jp_aot_slice(&i%d, v%d, %d, %d, %d, %d, %d); "
+		             "%sjp_aot_next(&i%d, &v%d); )",
+		         it, v,
+		         list[0].type == T_NUMBER, (list[0].type == T_NUMBER) ? list[0].num : 0,
+		         list[1].type == T_NUMBER, (list[1].type == T_NUMBER) ? list[1].num : 0,
+		         jp_slice_step(list), fn->check, it, n);
+		aot_open(fn);
+		aot_path(fn, pc + 1, n);
+		aot_close(fn);
+		break;
+
+	case JP_OP_KEYS:
+		list = &prog->consts[insn->arg];
+		n = aot_var(fn);
+		it = fn->niters++;
+		i = fn->nlists++;
+		aot_line(fn, "static const char *const l%d[] = {", i);
+
+		for (i = 1; i <= list->num; i++)
+		{
+			str = aot_string(list[i].str);
+			aot_line(fn, "\t%s,", str ? str : "");
+			free(str);
+		}
+
+		aot_line(fn, "};");
+		aot_line(fn, "struct lh_entry *e%d[%d];", it, list->num);
+		aot_line(fn, "");
+		aot_line(fn, "for (jp_aot_keys(&i%d, v%d, l%d, %d, e%d); "
+		             "%sjp_aot_next(&i%d, &v%d); )",
+		         it, v, fn->nlists - 1, list->num, it, fn->check, it, n);
+		aot_open(fn);
+		aot_path(fn, pc + 1, n);
+		aot_close(fn);
+		break;
+
+	case JP_OP_INDEXES:
+		list = &prog->consts[insn->arg];
+		n = aot_var(fn);
+		it = fn->niters++;
+		aot_line(fn, "static const int l%d[] = {", fn->nlists);
+
+		for (i = 1; i <= list->num; i++)
+			aot_line(fn, "\t%d,", list[i].num);
+
+		aot_line(fn, "};");
+		aot_line(fn, "");
+
+		/* listing -1 selects all members of an object */
+		for (i = 1; i <= list->num && list[i].num < -1; i++)
+			;
+
+		aot_line(fn, "for (jp_aot_indexes(&i%d, v%d, l%d, %d, %d); "
+		             "%sjp_aot_next(&i%d, &v%d); )",
+		         it, v, fn->nlists++, list->num,
+		         i <= list->num && list[i].num == -1, fn->check, it, n);
+		aot_open(fn);
+		aot_path(fn, pc + 1, n);
+		aot_close(fn);
+		break;
+
+	case JP_OP_DESCEND:
+		n = aot_var(fn);
+		it = fn->nwalks++;
+		aot_line(fn, "for (jp_aot_walk_start(&w%d, v%d); "
+		             "%sjp_aot_walk_next(ctx, &w%d, &v%d); )",
+		         it, v, fn->check, it, n);
+		aot_open(fn);
+		aot_path(fn, pc + 1, n);
+		aot_close(fn);
+		break;
+
+	default:
+		if (fn->subpath)
+		{
+			aot_line(fn, "if (v%d)", v);
+			aot_open(fn);
+			aot_line(fn, "res = v%d;", v);
+			aot_line(fn, "goto out;");
+			aot_close(fn);
+			fn->jumps = true;
+		}
+		else
+		{
+			aot_line(fn, "jp_aot_emit(ctx, v%d);", v);
+		}
+
+		break;
+	}
+}
+
+/* a walk can run out of memory, which has to end all loops of the match */
+static bool
+aot_has_walks(const struct jp_prog *prog)
+{
+	int i;
+
+	for (i = 0; i < prog->ncode; i++)
+		if (prog->code[i].op == JP_OP_DESCEND)
+			return true;
+
+	return false;
+}
+
+/*
+ * Emits the function running the path at pc. Sub-paths return their first
+ * value, the path of the expression reports all of them.
+ */
+static bool
+aot_function(FILE *out, const struct jp_prog *prog, const char *name, int pc)
+{
+	struct aot_fn fn = { .prog = prog, .name = name, .depth = 1,
+	                     .subpath = (pc > 0), .nvars = 1,
+	                     .check = aot_has_walks(prog) ? "!ctx->stop && " : "" };
+	size_t len;
+	char *body;
+	int i;
+
+	fn.out = open_memstream(&body, &len);
+
+	if (!fn.out)
+		return false;
+
+	aot_path(&fn, pc, 0);
+
+	if (fclose(fn.out) || aot_oom)
+		return false;
+
+	fprintf(out, "\nstatic struct json_object *\n");
+	fprintf(out, "%s_p%d(struct jp_aot_ctx *ctx, struct json_object *v0)\n{\n",
+	        name, pc);
+
+	for (i = 1; i < fn.nvars; i++)
+		fprintf(out, "\tstruct json_object *v%d;\n", i);
+
+	for (i = 0; i < fn.niters; i++)
+		fprintf(out, "\tstruct jp_aot_iter i%d;\n", i);
+
+	for (i = 0; i < fn.nwalks; i++)
+		fprintf(out, "\tstruct jp_aot_walk w%d;\n", i);
+
+	if (fn.subpath)
+		fprintf(out, "\tstruct json_object *res = NULL;\n");
+
+	if (fn.nwalks)
+		fputc('\n', out);
+
+	/* positions of walks are set up on first use and reused after */
+	for (i = 0; i < fn.nwalks; i++)
+		fprintf(out, "\tw%d.pos = NULL;\n", i);
+
+	fprintf(out, "\n%s", body);
+	free(body);
+
+	fputc('\n', out);
+
+	if (fn.jumps)
+		fprintf(out, "out:\n");
+
+	for (i = 0; i < fn.nwalks; i++)
+		fprintf(out, "\tjp_aot_walk_free(&w%d);\n", i);
+
+	fprintf(out, fn.subpath ? "\treturn res;\n}\n" : "\treturn ctx->res;\n}\n");
+
+	return true;
+}
+
+/* sub-paths are those operands refer to, the path itself is at 0 */
+static bool
+aot_is_subpath(const struct jp_prog *prog, int pc)
+{
+	const struct jp_insn *insn;
+	int i;
+
+	for (i = 0; i < prog->ncode + prog->nhoists; i++)
+	{
+		insn = (i < prog->ncode) ? &prog->code[i]
+		                         : &prog->hoists[i - prog->ncode];
+
+		switch (insn->op)
+		{
+		case JP_OP_EXISTS:
+		case JP_OP_RESOLVE:
+			if (insn->arg == pc)
+				return true;
+
+			break;
+
+		case JP_OP_TEST:
+			if (prog->tests[insn->arg].path == pc)
+				return true;
+
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return false;
+}
+
+static bool
+aot_expr(FILE *out, const struct aot_expr *e)
+{
+	const struct jp_prog *prog = e->state->path->prog;
+	char *comment = strdup(e->expr);
+	int pc;
+
+	if (!comment)
+		return false;
+
+	/* a comment must not end early */
+	for (pc = 0; comment[pc]; pc++)
+		if (comment[pc] == '*' && comment[pc + 1] == '/')
+			comment[pc + 1] = '|';
+
+	fprintf(out, "\n/* %s */\n", comment);
+	free(comment);
+
+	for (pc = 1; pc < prog->ncode; pc++)
+		if (aot_is_subpath(prog, pc))
+			fprintf(out, "static struct json_object *"
+			             "%s_p%d(struct jp_aot_ctx *ctx, struct json_object *v0);\n",
+			        e->name, pc);
+
+	for (pc = 0; pc < prog->ncode; pc++)
+		if ((pc == 0 || aot_is_subpath(prog, pc)) &&
+		    !aot_function(out, prog, e->name, pc))
+			return false;
+
+	fprintf(out, "\nstruct json_object *\n");
+	fprintf(out, "%s(struct json_object *input, jp_match_cb_t cb, void *userdata)\n{\n",
+	        e->name);
+
+	if (prog->nhoists)
+	{
+		fprintf(out, "\tstruct jp_aot_value hoisted[%d];\n", prog->nhoists);
+		fprintf(out, "\tstruct jp_aot_ctx ctx = { .root = input, .cb = cb, "
+		             ".priv = userdata,\n\t                          "
+		             ".hoisted = hoisted };\n");
+		fprintf(out, "\tint i;\n\n");
+		fprintf(out, "\tfor (i = 0; i < %d; i++)\n", prog->nhoists);
+		fprintf(out, "\t\thoisted[i].type = JP_AOT_UNRESOLVED;\n\n");
+	}
+	else
+	{
+		fprintf(out, "\tstruct jp_aot_ctx ctx = { .root = input, .cb = cb, "
+		             ".priv = userdata };\n\n");
+	}
+
+	fprintf(out, "\treturn %s_p0(&ctx, input);\n}\n", e->name);
+
+	return true;
+}
+
+static void
+aot_prototypes(FILE *out, const struct aot_expr *exprs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		fprintf(out, "struct json_object *%s(struct json_object *input, "
+		             "jp_match_cb_t cb, void *userdata);\n",
+		        exprs[i].name);
+}
+
+static bool
+aot_write_source(FILE *out, const char *header, const struct aot_expr *exprs,
+                 int n)
+{
+	int i;
+
+	fprintf(out, "/* Generated by jsonpath_aot, do not edit. */\n\n");
+
+	if (header)
+		fprintf(out, "#include \"%s\"\n", header);
+	else
+		fprintf(out, "#include <jsonpath_aot.h>\n\n");
+
+	if (!header)
+		aot_prototypes(out, exprs, n);
+
+	for (i = 0; i < n; i++)
+		if (!aot_expr(out, &exprs[i]))
+			return false;
+
+	return !ferror(out);
+}
+
+static bool
+aot_write_header(FILE *out, const char *guard, const struct aot_expr *exprs,
+                 int n)
+{
+	fprintf(out, "/* Generated by jsonpath_aot, do not edit. */\n\n");
+	fprintf(out, "#ifndef %s\n#define %s\n\n", guard, guard);
+	fprintf(out, "#include <jsonpath_aot.h>\n\n");
+	aot_prototypes(out, exprs, n);
+	fprintf(out, "\n#endif /* %s */\n", guard);
+
+	return !ferror(out);
+}
+
+/* the include guard of a header, derived from its file name */
+static char *
+aot_guard(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	char *guard, *p;
+
+	guard = aot_printf("__%s_", base ? base + 1 : path);
+
+	for (p = guard; p && *p; p++)
+		*p = (*p >= 'a' && *p <= 'z') ? *p - 'a' + 'A' :
+		     ((*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')) ? *p : '_';
+
+	return guard;
+}
+
+static bool
+aot_is_ident(const char *s)
+{
+	if (!*s || (*s >= '0' && *s <= '9'))
+		return false;
+
+	for (; *s; s++)
+		if (*s != '_' && !(*s >= '0' && *s <= '9') &&
+		    !(*s >= 'a' && *s <= 'z') && !(*s >= 'A' && *s <= 'Z'))
+			return false;
+
+	return true;
+}
+
+static void
+print_error(struct jp_state *state, const char *expr)
+{
+	int i;
+	bool first = true;
+
+	fprintf(stderr, "Syntax error: ");
+
+	switch (state->error_code)
+	{
+	case -4:
+	case -3:
+	case -2:
+	case -1:
+		fprintf(stderr, "%s\n", jp_error_to_string(state->error_code));
+		break;
+
+	default:
+		for (i = 0; i < sizeof(state->error_code) * 8; i++)
+		{
+			if (state->error_code & (1 << i))
+			{
+				fprintf(stderr,
+				        first ? "Expecting %s" : " or %s", jp_tokennames[i]);
+
+				first = false;
+			}
+		}
+
+		fprintf(stderr, "\n");
+		break;
+	}
+
+	fprintf(stderr, "In expression %s\n", expr);
+	fprintf(stderr, "Near here ----");
+
+	for (i = 0; i < state->error_pos; i++)
+		fprintf(stderr, "-");
+
+	fprintf(stderr, "^\n");
+}
+
+/*
+ * Reads expressions, one per line. A label names the function of the
+ * expression, otherwise it is numbered. Empty lines and lines starting
+ * with # are skipped.
+ */
+static int
+aot_read(FILE *in, const char *prefix, struct aot_expr **exprs, int *n)
+{
+	struct aot_expr *e;
+	struct jp_opcode *path;
+	char *line = NULL, *p;
+	size_t size = 0;
+	ssize_t len;
+	int i, rv = 0;
+
+	while ((len = getline(&line, &size, in)) > 0)
+	{
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+
+		if (!*p || *p == '#')
+			continue;
+
+		e = realloc(*exprs, (*n + 1) * sizeof(**exprs));
+
+		if (!e)
+		{
+			rv = 127;
+			break;
+		}
+
+		*exprs = e;
+		e = &e[*n];
+		memset(e, 0, sizeof(*e));
+		e->expr = strdup(p);
+		e->state = e->expr ? jp_parse(e->expr) : NULL;
+		(*n)++;
+
+		if (!e->state)
+		{
+			rv = 127;
+			break;
+		}
+
+		if (e->state->error_code)
+		{
+			print_error(e->state, e->expr);
+			rv = 1;
+			continue;
+		}
+
+		path = e->state->path;
+
+		if (!path->prog)
+		{
+			rv = 127;
+			break;
+		}
+
+		if (path->type == T_LABEL && !aot_is_ident(path->str))
+		{
+			fprintf(stderr, "Label %s of %s is no C identifier\n",
+			        path->str, e->expr);
+			rv = 1;
+			continue;
+		}
+
+		if (path->type == T_LABEL)
+			e->name = aot_printf("%s%s", prefix, path->str);
+		else
+			e->name = aot_printf("%spath%d", prefix, *n);
+
+		if (!e->name)
+		{
+			rv = 127;
+			break;
+		}
+
+		for (i = 0; i < *n - 1; i++)
+		{
+			if ((*exprs)[i].name && !strcmp((*exprs)[i].name, e->name))
+			{
+				fprintf(stderr, "Function %s of %s is defined twice\n",
+				        e->name, e->expr);
+				rv = 1;
+				break;
+			}
+		}
+	}
+
+	free(line);
+
+	return rv;
+}
+
+static void
+print_usage(char *app)
+{
+	printf(
+	"== Usage ==\n\n"
+	"  # %s [-o <file.c>] [-H <file.h>] [-p prefix] [file]\n"
+	"  -h		Print this help\n"
+	"  -o file.c	Write the generated code to file.c instead of stdout\n"
+	"  -H file.h	Also write a header declaring the functions\n"
+	"  -p prefix	Prefix the names of all functions\n\n"
+	"  Reads one expression per line from file, or stdin. Each becomes\n"
+	"  a function matching it like jp_match(), named after the label\n"
+	"  of the expression, as in NAME=@.path, or numbered otherwise:\n\n"
+	"  struct json_object *NAME(struct json_object *input,\n"
+	"                           jp_match_cb_t cb, void *userdata);\n\n"
+	"  The code includes jsonpath_aot.h and only needs json-c to link.\n",
+		app);
+}
+
+int main(int argc, char **argv)
+{
+	const char *output = NULL, *header = NULL, *prefix = "", *base;
+	struct aot_expr *exprs = NULL;
+	FILE *in = stdin, *out;
+	char *guard;
+	int opt, i, n = 0, rv = 0;
+
+	while ((opt = getopt(argc, argv, "ho:H:p:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'H':
+			header = optarg;
+			break;
+
+		case 'p':
+			prefix = optarg;
+			break;
+
+		default:
+			print_usage(argv[0]);
+			return 0;
+		}
+	}
+
+	if (optind < argc && !(in = fopen(argv[optind], "r")))
+	{
+		fprintf(stderr, "Failed to open %s\n", argv[optind]);
+		return 125;
+	}
+
+	rv = aot_read(in, prefix, &exprs, &n);
+
+	if (in != stdin)
+		fclose(in);
+
+	if (rv)
+		goto out;
+
+	if (header)
+	{
+		out = fopen(header, "w");
+		guard = aot_guard(header);
+
+		if (!out || !guard || !aot_write_header(out, guard, exprs, n))
+		{
+			fprintf(stderr, "Failed to write %s\n", header);
+			rv = 1;
+		}
+
+		if (out)
+			fclose(out);
+
+		free(guard);
+
+		if (rv)
+			goto out;
+	}
+
+	out = output ? fopen(output, "w") : stdout;
+	base = header ? strrchr(header, '/') : NULL;
+
+	if (!out || !aot_write_source(out, base ? base + 1 : header, exprs, n))
+	{
+		if (aot_oom)
+		{
+			rv = 127;
+		}
+		else
+		{
+			fprintf(stderr, "Failed to write %s\n", output ? output : "stdout");
+			rv = 1;
+		}
+	}
+
+	if (out && out != stdout)
+		fclose(out);
+
+out:
+	if (rv == 127)
+		fprintf(stderr, "Out of memory\n");
+
+	for (i = 0; i < n; i++)
+	{
+		if (exprs[i].state)
+			jp_free(exprs[i].state);
+
+		free(exprs[i].expr);
+		free(exprs[i].name);
+	}
+
+	free(exprs);
+
+	return rv;
+}
@@ -16,25 +16,86 @@
 
 #include "ast.h"
 #include "lexer.h"
+#include "compiler.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 
+/* large enough for the state and the opcodes of a typical expression */
+#define JP_CHUNK_SIZE 1024
+
+#define JP_ALIGN(n) \
+	(((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+static struct jp_chunk *
+jp_alloc_chunk(size_t size)
+{
+	struct jp_chunk *c;
+
+	if (size < JP_CHUNK_SIZE)
+		size = JP_CHUNK_SIZE;
+
+	c = malloc(JP_ALIGN(sizeof(*c)) + size);
+
+	if (!c)
+		return NULL;
+
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+
+	return c;
+}
+
+void *
+jp_alloc(struct jp_state *s, size_t size)
+{
+	struct jp_chunk *c = s->pool;
+	void *ptr;
+
+	size = JP_ALIGN(size);
+
+	if (c->used + size > c->size)
+	{
+		/* grow geometrically so long expressions need few chunks */
+		c = jp_alloc_chunk((size > c->size * 2) ? size : c->size * 2);
+
+		if (!c)
+			return NULL;
+
+		c->next = s->pool;
+		s->pool = c;
+	}
+
+	ptr = (char *)c + JP_ALIGN(sizeof(*c)) + c->used;
+	c->used += size;
+
+	return memset(ptr, 0, size);
+}
+
+char *
+jp_alloc_str(struct jp_state *s, const char *str, size_t len)
+{
+	char *ptr = jp_alloc(s, len + 1);
+
+	if (!ptr)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(127);
+	}
+
+	return memcpy(ptr, str, len);
+}
+
 struct jp_opcode *
 jp_alloc_op(struct jp_state *s, int type, int num, char *str, ...)
 {
 	va_list ap;
-	char *ptr;
 	struct jp_opcode *newop, *child;
 
-	if (str) {
-		newop = calloc(1, sizeof(*newop) + strlen(str) + 1);
-		ptr = (char *)newop + sizeof(*newop);
-	} else {
-		newop = calloc(1, sizeof(*newop));
-	}
+	newop = jp_alloc(s, sizeof(*newop));
 
 	if (!newop)
 	{
@@ -44,9 +105,7 @@ jp_alloc_op(struct jp_state *s, int type, int num, char *str, ...)
 
 	newop->type = type;
 	newop->num = num;
-
-	if (str)
-		newop->str = strcpy(ptr, str);
+	newop->str = str;
 
 	va_start(ap, str);
 
@@ -58,50 +117,70 @@ jp_alloc_op(struct jp_state *s, int type, int num, char *str, ...)
 
 	va_end(ap);
 
-	newop->next = s->pool;
-	s->pool = newop;
-
 	return newop;
 }
 
 void
 jp_free(struct jp_state *s)
 {
-	struct jp_opcode *op, *tmp;
+	struct jp_chunk *c, *tmp;
 
-	for (op = s->pool; op;)
+	if (__atomic_sub_fetch(&s->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	/* the state lives in the oldest chunk, which is freed last */
+	for (c = s->pool; c;)
 	{
-		tmp = op->next;
-		free(op);
-		op = tmp;
+		tmp = c->next;
+		free(c);
+		c = tmp;
 	}
+}
+
+struct jp_state *
+jp_ref(struct jp_state *s)
+{
+	__atomic_add_fetch(&s->refcount, 1, __ATOMIC_RELAXED);
 
-	free(s);
+	return s;
 }
 
 struct jp_state *
 jp_parse(const char *expr)
+{
+	return jp_parse_n(expr, strlen(expr));
+}
+
+struct jp_state *
+jp_parse_n(const char *expr, size_t len)
 {
 	struct jp_state *s;
 	struct jp_opcode *op;
 	const char *ptr = expr;
 	void *pParser;
-	int len = strlen(expr);
 	int mlen = 0;
+	struct jp_chunk *c = jp_alloc_chunk(0);
 
-	s = calloc(1, sizeof(*s));
-
-	if (!s)
+	if (!c)
 		return NULL;
 
+	s = (struct jp_state *)((char *)c + JP_ALIGN(sizeof(*c)));
+	c->used = JP_ALIGN(sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	s->pool = c;
+	s->refcount = 1;
+
 	pParser = ParseAlloc(malloc);
 
 	if (!pParser)
+	{
+		jp_free(s);
 		return NULL;
+	}
 
 	while (len > 0)
 	{
-		op = jp_get_token(s, ptr, &mlen);
+		op = jp_get_token(s, ptr, len, &mlen);
 
 		if (mlen < 0)
 		{
@@ -120,6 +199,9 @@ jp_parse(const char *expr)
 
 	Parse(pParser, 0, NULL, s);
 
+	if (!s->error_code && s->path)
+		s->path->prog = jp_compile(s, s->path);
+
 out:
 	ParseFree(pParser, free);
 
@@ -34,8 +34,49 @@ append_op(struct jp_opcode *a, struct jp_opcode *b)
 	return a;
 }
 
+/*
+ * Long sibling lists are built back to front while parsing, so adding an
+ * item does not walk the list, and put in order once complete.
+ */
+static inline struct jp_opcode *
+prepend_op(struct jp_opcode *a, struct jp_opcode *b)
+{
+	b->sibling = a;
+
+	return b;
+}
+
+static inline struct jp_opcode *
+reverse_op(struct jp_opcode *a)
+{
+	struct jp_opcode *prev = NULL, *next;
+
+	for (; a; a = next)
+	{
+		next = a->sibling;
+		a->sibling = prev;
+		prev = a;
+	}
+
+	return prev;
+}
+
+/*
+ * Every allocation belonging to a parsed expression - the state itself, its
+ * opcodes, literals and compiled program - is carved from a chain of chunks
+ * owned by the state, so jp_free() releases them all at once.
+ */
+struct jp_chunk {
+	struct jp_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+void *jp_alloc(struct jp_state *s, size_t size);
+char *jp_alloc_str(struct jp_state *s, const char *str, size_t len);
 struct jp_opcode *jp_alloc_op(struct jp_state *s, int type, int num, char *str, ...);
 struct jp_state *jp_parse(const char *expr);
+struct jp_state *jp_parse_n(const char *expr, size_t len);
 void jp_free(struct jp_state *s);
 
 void *ParseAlloc(void *(*mfunc)(size_t));
@@ -0,0 +1,1001 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <json.h>
+
+#include "jsonpath.h"
+
+/*
+ * Times jp_parse(), jp_match() and jp_free() over a fixed corpus of
+ * expressions against synthetic documents. Documents only depend on the
+ * options and the seed, so numbers taken from different builds of the
+ * library compare.
+ */
+
+enum bench_doc {
+	BENCH_UBUS,
+	BENCH_TREE,
+};
+
+enum bench_fmt {
+	BENCH_TEXT,
+	BENCH_TSV,
+	BENCH_JSON,
+};
+
+struct bench_opts {
+	int count;
+	int depth;
+	int fanout;
+	int keylen;
+	uint32_t seed;
+	int maxparts;
+	long mintime;
+	enum bench_fmt fmt;
+};
+
+struct bench_expr {
+	const char *name;
+	enum bench_doc doc;
+	const char *expr;
+};
+
+/*
+ * The ubus document is an interface dump as "ubus call network.interface
+ * dump" prints it, with count interfaces. The tree document nests objects
+ * fanout wide and depth deep, member n of each is named key(n), every
+ * object also has an "id" and a "name" and the innermost level holds
+ * arrays of objects.
+ */
+static const struct bench_expr corpus[] = {
+	{ "label",          BENCH_UBUS, "@.interface[7].l3_device" },
+	{ "label-miss",     BENCH_UBUS, "@.interface[7].nonexistent" },
+	{ "label-deep",     BENCH_UBUS, "@.interface[-1]['ipv4-address'][0].address" },
+	{ "wildcard",       BENCH_UBUS, "@.interface[*].interface" },
+	{ "wildcard-2",     BENCH_UBUS, "@.interface[*].route[*].target" },
+	{ "slice",          BENCH_UBUS, "@.interface[10:200:3].uptime" },
+	{ "slice-step-max", BENCH_UBUS, "@.interface[1::2147483647].uptime" },
+	{ "slice-step-min", BENCH_UBUS, "@.interface[::-2147483648].uptime" },
+	{ "union-index",    BENCH_UBUS, "@.interface[0,3,5,7].proto" },
+	{ "union-key",      BENCH_UBUS, "@.interface[*]['up','uptime','proto']" },
+	{ "filter-eq",      BENCH_UBUS, "@.interface[@.proto='dhcp'].interface" },
+	{ "filter-cmp",     BENCH_UBUS, "@.interface[@.uptime>50000].l3_device" },
+	{ "filter-and",     BENCH_UBUS, "@.interface[@.up=true && @.metric<10].interface" },
+	{ "filter-or",      BENCH_UBUS, "@.interface[@.proto='static' || @.proto='pppoe'].device" },
+	{ "filter-exists",  BENCH_UBUS, "@.interface[@.route[0]].interface" },
+	{ "filter-nested",  BENCH_UBUS, "@.interface[*].route[@.mask=0].nexthop" },
+	{ "filter-root",    BENCH_UBUS, "@.interface[@.interface=$.interface[3].interface].up" },
+	{ "descend",        BENCH_UBUS, "@..address" },
+	{ "tree-label",     BENCH_TREE, "@.%s.%s.id" },
+	{ "tree-wildcard",  BENCH_TREE, "@[*][*].name" },
+	{ "tree-union",     BENCH_TREE, "@['%s','%s'][*].id" },
+	{ "tree-filter",    BENCH_TREE, "@[*][*][@.id>100].name" },
+	{ "tree-descend",   BENCH_TREE, "@..id" },
+	{ "tree-descend-f", BENCH_TREE, "@..[@.id<64].name" },
+};
+
+struct bench_result {
+	double parse_ns;
+	double match_ns;
+	double free_ns;
+	double parse_allocs;
+	double match_allocs;
+	double matches;
+};
+
+/*
+ * Allocations are counted by replacing malloc(), which glibc supports for
+ * the library and json-c alike. Elsewhere they are not counted.
+ */
+#ifdef __GLIBC__
+#define BENCH_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long nallocs;
+
+void *
+malloc(size_t size)
+{
+	nallocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	nallocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	nallocs++;
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#else
+#define BENCH_ALLOCS 0
+
+static unsigned long nallocs;
+#endif
+
+static uint32_t
+bench_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return (*state = x);
+}
+
+static int64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* member n of tree objects, keylen characters long */
+static void
+bench_key(char *buf, int n, int keylen)
+{
+	uint32_t x = n * 2654435761u + 1;
+	int i;
+
+	buf[0] = 'a' + n % 26;
+
+	for (i = 1; i < keylen; i++)
+		buf[i] = 'a' + bench_rand(&x) % 26;
+
+	buf[keylen > 0 ? keylen : 1] = 0;
+}
+
+static void
+bench_add(struct json_object *obj, const char *key, struct json_object *val)
+{
+	json_object_object_add(obj, key, val);
+}
+
+static struct json_object *
+bench_addr(const char *fmt, uint32_t *seed, int mask)
+{
+	struct json_object *obj = json_object_new_object();
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), fmt,
+	         bench_rand(seed) % 256, bench_rand(seed) % 256);
+
+	bench_add(obj, "address", json_object_new_string(buf));
+	bench_add(obj, "mask", json_object_new_int(mask));
+
+	return obj;
+}
+
+static struct json_object *
+bench_ubus_iface(int n, uint32_t *seed)
+{
+	static const char *protos[] = { "static", "dhcp", "dhcpv6", "pppoe", "none" };
+	struct json_object *obj, *list;
+	char buf[32];
+	int i, nroutes;
+
+	obj = json_object_new_object();
+
+	snprintf(buf, sizeof(buf), "if%d", n);
+	bench_add(obj, "interface", json_object_new_string(buf));
+	bench_add(obj, "up", json_object_new_boolean(bench_rand(seed) % 4 != 0));
+	bench_add(obj, "pending", json_object_new_boolean(false));
+	bench_add(obj, "available", json_object_new_boolean(true));
+	bench_add(obj, "autostart", json_object_new_boolean(true));
+	bench_add(obj, "dynamic", json_object_new_boolean(false));
+	bench_add(obj, "uptime", json_object_new_int(bench_rand(seed) % 100000));
+
+	snprintf(buf, sizeof(buf), "eth%d.%d", n % 4, n);
+	bench_add(obj, "l3_device", json_object_new_string(buf));
+	bench_add(obj, "proto", json_object_new_string(protos[bench_rand(seed) % 5]));
+	bench_add(obj, "device", json_object_new_string(buf));
+	bench_add(obj, "metric", json_object_new_int(bench_rand(seed) % 20));
+	bench_add(obj, "delegation", json_object_new_boolean(true));
+
+	list = json_object_new_array();
+	json_object_array_add(list, bench_addr("10.%u.%u.1", seed, 24));
+	bench_add(obj, "ipv4-address", list);
+
+	list = json_object_new_array();
+	if (bench_rand(seed) % 2)
+		json_object_array_add(list, bench_addr("fd00:%x:%x::1", seed, 64));
+	bench_add(obj, "ipv6-address", list);
+
+	list = json_object_new_array();
+	nroutes = bench_rand(seed) % 4;
+
+	for (i = 0; i < nroutes; i++)
+	{
+		struct json_object *route = bench_addr("10.%u.%u.0", seed, i ? 24 : 0);
+
+		bench_add(route, "target",
+		          json_object_get(json_object_object_get(route, "address")));
+		bench_add(route, "nexthop", json_object_new_string("10.0.0.1"));
+		bench_add(route, "source", json_object_new_string("0.0.0.0/0"));
+		json_object_array_add(list, route);
+	}
+
+	bench_add(obj, "route", list);
+
+	list = json_object_new_array();
+	json_object_array_add(list, json_object_new_string("10.0.0.53"));
+	bench_add(obj, "dns-server", list);
+	bench_add(obj, "dns-search", json_object_new_array());
+	bench_add(obj, "inactive", json_object_new_object());
+	bench_add(obj, "data", json_object_new_object());
+
+	return obj;
+}
+
+static struct json_object *
+bench_ubus(const struct bench_opts *o)
+{
+	struct json_object *root, *list;
+	uint32_t seed = o->seed;
+	int i;
+
+	root = json_object_new_object();
+	list = json_object_new_array();
+
+	for (i = 0; i < o->count; i++)
+		json_object_array_add(list, bench_ubus_iface(i, &seed));
+
+	bench_add(root, "interface", list);
+
+	return root;
+}
+
+static struct json_object *
+bench_tree_level(const struct bench_opts *o, int depth, int *id,
+                 uint32_t *seed)
+{
+	struct json_object *obj, *list, *item;
+	char key[o->keylen + 2], name[32];
+	int i;
+
+	obj = json_object_new_object();
+
+	snprintf(name, sizeof(name), "node%d", *id);
+	bench_add(obj, "id", json_object_new_int((*id)++));
+	bench_add(obj, "name", json_object_new_string(name));
+
+	for (i = 0; i < o->fanout; i++)
+	{
+		bench_key(key, i, o->keylen);
+
+		if (depth > 1)
+		{
+			bench_add(obj, key, bench_tree_level(o, depth - 1, id, seed));
+			continue;
+		}
+
+		/* the innermost level holds arrays of small objects */
+		list = json_object_new_array();
+
+		while (json_object_array_length(list) < o->fanout)
+		{
+			item = json_object_new_object();
+			snprintf(name, sizeof(name), "leaf%d", *id);
+			bench_add(item, "id", json_object_new_int((*id)++));
+			bench_add(item, "name", json_object_new_string(name));
+			bench_add(item, "value",
+			          json_object_new_int(bench_rand(seed) % 1000));
+			json_object_array_add(list, item);
+		}
+
+		bench_add(obj, key, list);
+	}
+
+	return obj;
+}
+
+static struct json_object *
+bench_tree(const struct bench_opts *o)
+{
+	uint32_t seed = o->seed;
+	int id = 0;
+
+	return bench_tree_level(o, o->depth, &id, &seed);
+}
+
+static void
+bench_count(struct json_object *res, void *priv)
+{
+	(*(long *)priv)++;
+}
+
+static bool
+bench_parse(const struct bench_opts *o, const char *expr,
+            struct bench_result *r)
+{
+	struct jp_state **states;
+	unsigned long allocs;
+	int64_t t, tparse = 0, tfree = 0;
+	long i, n = 0, batch = 1;
+
+	/* states are made and freed in batches so both are timed apart */
+	while (tparse + tfree < o->mintime)
+	{
+		states = malloc(batch * sizeof(*states));
+
+		if (!states)
+			return false;
+
+		allocs = nallocs;
+		t = bench_now();
+
+		for (i = 0; i < batch; i++)
+			states[i] = jp_parse(expr);
+
+		tparse += bench_now() - t;
+		allocs = nallocs - allocs;
+
+		for (i = 0; i < batch; i++)
+			if (!states[i] || states[i]->error_code)
+				break;
+
+		if (i < batch)
+		{
+			while (batch > 0)
+				if (states[--batch])
+					jp_free(states[batch]);
+
+			free(states);
+			return false;
+		}
+
+		t = bench_now();
+
+		for (i = 0; i < batch; i++)
+			jp_free(states[i]);
+
+		tfree += bench_now() - t;
+		free(states);
+
+		n += batch;
+		r->parse_allocs = (double)allocs / batch;
+
+		if (batch < 65536)
+			batch *= 2;
+	}
+
+	r->parse_ns = (double)tparse / n;
+	r->free_ns = (double)tfree / n;
+
+	return true;
+}
+
+static void
+bench_match(const struct bench_opts *o, struct jp_state *s,
+            struct json_object *doc, struct bench_result *r)
+{
+	unsigned long allocs;
+	long i, n, matches = 0;
+	int64_t t;
+
+	jp_match(s->path, doc, bench_count, &matches);
+	r->matches = matches;
+
+	allocs = nallocs;
+	jp_match(s->path, doc, bench_count, &matches);
+	r->match_allocs = nallocs - allocs;
+
+	/* doubles the repetitions until they took long enough */
+	for (n = 1; ; n *= 2)
+	{
+		t = bench_now();
+
+		for (i = 0; i < n; i++)
+			jp_match(s->path, doc, bench_count, &matches);
+
+		t = bench_now() - t;
+
+		if (t >= o->mintime)
+			break;
+	}
+
+	r->match_ns = (double)t / n;
+}
+
+static void
+bench_header(const struct bench_opts *o)
+{
+	switch (o->fmt)
+	{
+	case BENCH_TEXT:
+		printf("%-16s %10s %10s %10s %8s %8s %10s %14s\n",
+		       "name", "parse ns", "free ns", "match ns", "p.alloc",
+		       "m.alloc", "matches", "matches/s");
+		break;
+
+	case BENCH_TSV:
+		printf("name\tdoc\tcount\tdepth\tfanout\tkeylen\tseed\texpr\t"
+		       "parse_ns\tfree_ns\tmatch_ns\tparse_allocs\t"
+		       "match_allocs\tmatches\tmatches_per_s\n");
+		break;
+
+	case BENCH_JSON:
+		break;
+	}
+}
+
+static void
+bench_print(const struct bench_opts *o, const char *name, enum bench_doc doc,
+            const char *expr, const struct bench_result *r)
+{
+	double rate = r->match_ns ? r->matches * 1e9 / r->match_ns : 0;
+	const char *dname = (doc == BENCH_UBUS) ? "ubus" : "tree";
+	const char *c;
+
+	switch (o->fmt)
+	{
+	case BENCH_TEXT:
+		printf("%-16s %10.0f %10.0f %10.0f", name,
+		       r->parse_ns, r->free_ns, r->match_ns);
+
+		if (BENCH_ALLOCS)
+			printf(" %8.1f %8.1f", r->parse_allocs, r->match_allocs);
+		else
+			printf(" %8s %8s", "-", "-");
+
+		printf(" %10.0f %14.0f\n", r->matches, rate);
+		break;
+
+	case BENCH_TSV:
+		printf("%s\t%s\t%d\t%d\t%d\t%d\t%u\t%s\t%.1f\t%.1f\t%.1f\t",
+		       name, dname, o->count, o->depth, o->fanout, o->keylen,
+		       o->seed, expr, r->parse_ns, r->free_ns, r->match_ns);
+
+		if (BENCH_ALLOCS)
+			printf("%.1f\t%.1f", r->parse_allocs, r->match_allocs);
+		else
+			printf("-\t-");
+
+		printf("\t%.0f\t%.0f\n", r->matches, rate);
+		break;
+
+	case BENCH_JSON:
+		printf("{\"name\":\"%s\",\"doc\":\"%s\",\"count\":%d,\"depth\":%d,"
+		       "\"fanout\":%d,\"keylen\":%d,\"seed\":%u,\"expr\":\"",
+		       name, dname, o->count, o->depth, o->fanout, o->keylen,
+		       o->seed);
+
+		for (c = expr; *c; c++)
+		{
+			if (*c == '"' || *c == '\\')
+				putchar('\\');
+
+			putchar(*c);
+		}
+
+		printf("\",\"parse_ns\":%.1f,\"free_ns\":%.1f,\"match_ns\":%.1f,",
+		       r->parse_ns, r->free_ns, r->match_ns);
+
+		if (BENCH_ALLOCS)
+			printf("\"parse_allocs\":%.1f,\"match_allocs\":%.1f,",
+			       r->parse_allocs, r->match_allocs);
+		else
+			printf("\"parse_allocs\":null,\"match_allocs\":null,");
+
+		printf("\"matches\":%.0f,\"matches_per_s\":%.0f}\n",
+		       r->matches, rate);
+		break;
+	}
+}
+
+static bool
+bench_run(const struct bench_opts *o, const char *name, enum bench_doc doc,
+          const char *expr, struct json_object *jsobj)
+{
+	struct bench_result r = { 0 };
+	struct jp_state *s;
+
+	s = jp_parse(expr);
+
+	if (!s || s->error_code)
+	{
+		fprintf(stderr, "Cannot parse %s: %s\n", name, expr);
+
+		if (s)
+			jp_free(s);
+
+		return false;
+	}
+
+	if (!bench_parse(o, expr, &r))
+	{
+		fprintf(stderr, "Out of memory\n");
+		jp_free(s);
+		return false;
+	}
+
+	bench_match(o, s, jsobj, &r);
+	bench_print(o, name, doc, expr, &r);
+	jp_free(s);
+
+	return true;
+}
+
+/*
+ * Parser benchmark. Each family builds expressions of one kind with n
+ * repeated parts, n doubling up to the -N limit, and records the time per
+ * byte of expression. Parsing is expected to be linear, so a family whose
+ * time per byte keeps growing with n is reported as super-linear.
+ */
+struct bench_family {
+	const char *name;
+	const char *head;
+	const char *part;
+	const char *sep;
+	const char *inner;
+	const char *close;
+	const char *tail;
+};
+
+/* head, n parts apart by sep, inner, n times close and tail */
+static const struct bench_family families[] = {
+	{ "labels",      "@",      ".k%d",      "",     "",      "",  ""   },
+	{ "indexes",     "@",      "[%d]",      "",     "",      "",  ""   },
+	{ "key-union",   "@[",     "'k%d'",     ",",    "]",     "",  ""   },
+	{ "index-union", "@[",     "%d",        ",",    "]",     "",  ""   },
+	{ "filter-and",  "@[",     "@.k%d='v'", " && ", "]",     "",  ""   },
+	{ "filter-or",   "@[?(",   "@.a=%d",    " || ", ")]",    "",  ""   },
+	{ "nested",      "@",      "[@.a",      "",     "=1",    "]", ""   },
+	{ "parens",      "@[",     "(",         "",     "@.a=1", ")", "]"  },
+	{ "literal",     "@['",    "x",         "",     "']",    "",  ""   },
+};
+
+static const char *short_exprs[] = {
+	"$.a",
+	"@.a.b",
+	"@[0]",
+	"@[*].name",
+	"@['ipv4-address'][0].address",
+	"@[@.up=true].interface",
+	"$..id",
+};
+
+/* expression of family f with n parts, NULL if out of memory */
+static char *
+bench_family_expr(const struct bench_family *f, int n)
+{
+	size_t size = strlen(f->head) + strlen(f->inner) + strlen(f->tail) + 1 +
+	              n * (strlen(f->part) + strlen(f->sep) +
+	                   strlen(f->close) + 10);
+	char *buf = malloc(size), *p = buf;
+	int i;
+
+	if (!buf)
+		return NULL;
+
+	p += sprintf(p, "%s", f->head);
+
+	for (i = 0; i < n; i++)
+	{
+		if (i)
+			p += sprintf(p, "%s", f->sep);
+
+		p += sprintf(p, f->part, i);
+	}
+
+	p += sprintf(p, "%s", f->inner);
+
+	for (i = 0; *f->close && i < n; i++)
+		p += sprintf(p, "%s", f->close);
+
+	p += sprintf(p, "%s", f->tail);
+
+	return buf;
+}
+
+static void
+bench_parse_header(const struct bench_opts *o)
+{
+	switch (o->fmt)
+	{
+	case BENCH_TEXT:
+		printf("%-28s %6s %8s %10s %12s %8s %8s\n",
+		       "family", "n", "bytes", "parse ns", "exprs/s",
+		       "ns/byte", "allocs");
+		break;
+
+	case BENCH_TSV:
+		printf("family\tn\tbytes\tparse_ns\tfree_ns\texprs_per_s\t"
+		       "ns_per_byte\tparse_allocs\tverdict\n");
+		break;
+
+	case BENCH_JSON:
+		break;
+	}
+}
+
+static void
+bench_parse_print(const struct bench_opts *o, const char *name, int n,
+                  size_t len, const struct bench_result *r)
+{
+	double rate = r->parse_ns ? 1e9 / r->parse_ns : 0;
+
+	switch (o->fmt)
+	{
+	case BENCH_TEXT:
+		printf("%-28s %6d %8zu %10.0f %12.0f %8.2f", name, n, len,
+		       r->parse_ns, rate, r->parse_ns / len);
+
+		if (BENCH_ALLOCS)
+			printf(" %8.1f\n", r->parse_allocs);
+		else
+			printf(" %8s\n", "-");
+
+		break;
+
+	case BENCH_TSV:
+		printf("%s\t%d\t%zu\t%.1f\t%.1f\t%.0f\t%.3f\t", name, n, len,
+		       r->parse_ns, r->free_ns, rate, r->parse_ns / len);
+
+		if (BENCH_ALLOCS)
+			printf("%.1f\t\n", r->parse_allocs);
+		else
+			printf("-\t\n");
+
+		break;
+
+	case BENCH_JSON:
+		printf("{\"family\":\"%s\",\"n\":%d,\"bytes\":%zu,"
+		       "\"parse_ns\":%.1f,\"free_ns\":%.1f,\"exprs_per_s\":%.0f,"
+		       "\"ns_per_byte\":%.3f,", name, n, len,
+		       r->parse_ns, r->free_ns, rate, r->parse_ns / len);
+
+		if (BENCH_ALLOCS)
+			printf("\"parse_allocs\":%.1f}\n", r->parse_allocs);
+		else
+			printf("\"parse_allocs\":null}\n");
+
+		break;
+	}
+}
+
+static void
+bench_parse_verdict(const struct bench_opts *o, const char *name, int limit,
+                    double growth, bool superlinear)
+{
+	const char *verdict = superlinear ? "superlinear" : "linear";
+
+	switch (o->fmt)
+	{
+	case BENCH_TEXT:
+		printf("%-28s %s, time per byte x%.2f", name,
+		       superlinear ? "SUPER-LINEAR" : "linear", growth);
+
+		if (limit)
+			printf(", rejected from n = %d", limit);
+
+		printf("\n\n");
+		break;
+
+	case BENCH_TSV:
+		printf("%s\t%d\t\t\t\t\t%.3f\t\t%s\n", name, limit, growth,
+		       verdict);
+		break;
+
+	case BENCH_JSON:
+		printf("{\"family\":\"%s\",\"verdict\":\"%s\",\"growth\":%.3f,"
+		       "\"rejected_from\":%d}\n", name, verdict, growth, limit);
+		break;
+	}
+}
+
+/*
+ * Time per byte is compared between the first expression of at least
+ * 64 bytes, where the fixed cost of a parse no longer dominates, and the
+ * largest one. Twice the time per byte over a 16 fold growth in length
+ * is more than noise.
+ */
+#define BENCH_SCALE_MIN		64
+#define BENCH_SCALE_SPAN	16
+#define BENCH_SCALE_LIMIT	2.0
+
+/* returns 0 if the family scaled linearly, 1 if not, -1 if out of memory */
+static int
+bench_family(const struct bench_opts *o, const struct bench_family *f)
+{
+	struct bench_result r;
+	struct jp_state *s;
+	bool superlinear;
+	double base = 0, growth = 1;
+	size_t len, baselen = 0, lastlen = 0;
+	int n, limit = 0;
+	char *expr;
+
+	for (n = 1; n <= o->maxparts; n *= 2)
+	{
+		expr = bench_family_expr(f, n);
+
+		if (!expr)
+			return -1;
+
+		/* the parser may reject deep nesting */
+		s = jp_parse(expr);
+
+		if (!s || s->error_code)
+		{
+			limit = n;
+
+			if (s)
+				jp_free(s);
+
+			free(expr);
+			break;
+		}
+
+		jp_free(s);
+		memset(&r, 0, sizeof(r));
+
+		if (!bench_parse(o, expr, &r))
+		{
+			free(expr);
+			return -1;
+		}
+
+		len = strlen(expr);
+		bench_parse_print(o, f->name, n, len, &r);
+		free(expr);
+
+		if (!base && len >= BENCH_SCALE_MIN)
+		{
+			base = r.parse_ns / len;
+			baselen = len;
+		}
+
+		if (base)
+			growth = (r.parse_ns / len) / base;
+
+		lastlen = len;
+	}
+
+	superlinear = base && lastlen >= baselen * BENCH_SCALE_SPAN &&
+	              growth > BENCH_SCALE_LIMIT;
+
+	bench_parse_verdict(o, f->name, limit, growth, superlinear);
+
+	return superlinear;
+}
+
+/* returns 0, 1 if a family scaled super-linearly or 127 if out of memory */
+static int
+bench_parser(const struct bench_opts *o)
+{
+	struct bench_result r;
+	int i, rv = 0;
+
+	bench_parse_header(o);
+
+	for (i = 0; i < sizeof(short_exprs) / sizeof(short_exprs[0]); i++)
+	{
+		memset(&r, 0, sizeof(r));
+
+		if (!bench_parse(o, short_exprs[i], &r))
+			return 127;
+
+		bench_parse_print(o, short_exprs[i], 1, strlen(short_exprs[i]), &r);
+	}
+
+	if (o->fmt == BENCH_TEXT)
+		printf("\n");
+
+	for (i = 0; i < sizeof(families) / sizeof(families[0]); i++)
+	{
+		switch (bench_family(o, &families[i]))
+		{
+		case -1:
+			return 127;
+
+		case 1:
+			rv = 1;
+			break;
+		}
+	}
+
+	return rv;
+}
+
+static void
+print_usage(char *app)
+{
+	printf(
+	"== Usage ==\n\n"
+	"  # %s [options] [-e <pattern> ...]\n"
+	"  -h		Print this help\n"
+	"  -n count	Interfaces in the ubus document (default 256)\n"
+	"  -d depth	Nesting of the tree document (default 4)\n"
+	"  -f fanout	Members per tree object (default 8)\n"
+	"  -k keylen	Length of tree member names (default 8)\n"
+	"  -s seed	Seed of the generated documents (default 1)\n"
+	"  -m ms		Minimum time per measurement (default 200)\n"
+	"  -D doc	Document -e patterns run against, ubus or tree\n"
+	"  -e <pattern>	Benchmark pattern instead of the builtin corpus\n"
+	"  -F format	Output text, tsv or json, one object per line\n"
+	"  -l		List the builtin corpus\n"
+	"  -p		Benchmark the expression parser, exits with 1 if the\n"
+	"		parse time of a family grows super-linearly\n"
+	"  -N parts	Largest expressions of the parser benchmark, in\n"
+	"		repeated parts (default 256)\n\n",
+	app);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts o = {
+		.count = 256, .depth = 4, .fanout = 8, .keylen = 8, .seed = 1,
+		.maxparts = 256, .mintime = 200000000, .fmt = BENCH_TEXT
+	};
+	struct json_object *docs[2];
+	enum bench_doc doc = BENCH_UBUS;
+	char k0[64], k1[64], expr[256];
+	int opt, i, rv = 0, nexprs = 0;
+	bool parser = false;
+	char **exprs;
+
+	exprs = calloc(argc, sizeof(*exprs));
+
+	if (!exprs)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 127;
+	}
+
+	while ((opt = getopt(argc, argv, "hn:d:f:k:s:m:D:e:F:lpN:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			o.count = atoi(optarg);
+			break;
+
+		case 'd':
+			o.depth = atoi(optarg);
+			break;
+
+		case 'f':
+			o.fanout = atoi(optarg);
+			break;
+
+		case 'k':
+			o.keylen = atoi(optarg);
+			break;
+
+		case 's':
+			o.seed = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'm':
+			o.mintime = atol(optarg) * 1000000;
+			break;
+
+		case 'D':
+			doc = strcmp(optarg, "tree") ? BENCH_UBUS : BENCH_TREE;
+			break;
+
+		case 'e':
+			exprs[nexprs++] = optarg;
+			break;
+
+		case 'F':
+			if (!strcmp(optarg, "tsv"))
+				o.fmt = BENCH_TSV;
+			else if (!strcmp(optarg, "json"))
+				o.fmt = BENCH_JSON;
+			else
+				o.fmt = BENCH_TEXT;
+			break;
+
+		case 'p':
+			parser = true;
+			break;
+
+		case 'N':
+			o.maxparts = atoi(optarg);
+			break;
+
+		case 'l':
+			for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++)
+				printf("%-16s %s %s\n", corpus[i].name,
+				       corpus[i].doc == BENCH_UBUS ? "ubus" : "tree",
+				       corpus[i].expr);
+			goto out;
+
+		default:
+			print_usage(argv[0]);
+			goto out;
+		}
+	}
+
+	if (o.depth < 1 || o.fanout < 2 || o.keylen < 1 || o.keylen > 60 ||
+	    o.count < 8 || !o.seed)
+	{
+		fprintf(stderr, "Need -d >= 1, -f >= 2, 1 <= -k <= 60, -n >= 8 "
+		                "and a non-zero seed\n");
+		rv = 1;
+		goto out;
+	}
+
+	if (parser)
+	{
+		rv = bench_parser(&o);
+
+		if (rv == 127)
+			fprintf(stderr, "Out of memory\n");
+
+		goto out;
+	}
+
+	docs[BENCH_UBUS] = bench_ubus(&o);
+	docs[BENCH_TREE] = bench_tree(&o);
+
+	bench_key(k0, 0, o.keylen);
+	bench_key(k1, 1, o.keylen);
+	bench_header(&o);
+
+	for (i = 0; i < nexprs; i++)
+		if (!bench_run(&o, "custom", doc, exprs[i], docs[doc]))
+			rv = 1;
+
+	for (i = 0; !nexprs && i < sizeof(corpus) / sizeof(corpus[0]); i++)
+	{
+		/* tree expressions name the first two members */
+		snprintf(expr, sizeof(expr), corpus[i].expr, k0, k1);
+
+		if (!bench_run(&o, corpus[i].name, corpus[i].doc, expr,
+		               docs[corpus[i].doc]))
+			rv = 1;
+	}
+
+	json_object_put(docs[BENCH_UBUS]);
+	json_object_put(docs[BENCH_TREE]);
+
+out:
+	free(exprs);
+
+	return rv;
+}
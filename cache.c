@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "ast.h"
+
+struct jp_cache_entry {
+	struct jp_cache_entry *chain;
+	struct jp_state *state;
+	unsigned int hash;
+	bool referenced;
+	char key[];
+};
+
+/*
+ * Entries are found through a chained hash table and evicted with the
+ * CLOCK algorithm: the hand sweeps the slot ring, clearing the referenced
+ * bit of recently hit entries and evicting the first entry without it.
+ */
+struct jp_cache {
+	pthread_mutex_t lock;
+	struct jp_cache_entry **buckets;
+	struct jp_cache_entry **slots;
+	unsigned int nbuckets;
+	int size;
+	int hand;
+	struct jp_cache_stats stats;
+};
+
+static bool
+is_word(int c)
+{
+	return (c == '_' || c == '-' || isalnum((unsigned char)c));
+}
+
+static bool
+is_oper(int c)
+{
+	return (c && strchr("<>!=&|.", c));
+}
+
+/*
+ * Copies expr to key, dropping whitespace between tokens. A single blank
+ * is kept where removing it would make two tokens lex as one.
+ */
+static size_t
+jp_cache_key(const char *expr, char *key)
+{
+	const char *in = expr;
+	char *out = key, q;
+	bool space = false;
+
+	while (*in)
+	{
+		if (*in == ' ' || *in == '\t' || *in == '\n')
+		{
+			space = true;
+			in++;
+			continue;
+		}
+
+		if (space && out > key &&
+		    ((is_word(out[-1]) && is_word(*in)) ||
+		     (is_oper(out[-1]) && is_oper(*in))))
+			*out++ = ' ';
+
+		space = false;
+
+		if (*in == '\'' || *in == '"')
+		{
+			q = *in;
+			*out++ = *in++;
+
+			while (*in && *in != q)
+			{
+				if (*in == '\\' && in[1])
+					*out++ = *in++;
+
+				*out++ = *in++;
+			}
+
+			if (*in)
+				*out++ = *in++;
+
+			continue;
+		}
+
+		*out++ = *in++;
+	}
+
+	*out = 0;
+
+	return out - key;
+}
+
+static unsigned int
+jp_cache_hash(const char *key, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*key++) * 16777619u;
+
+	return h;
+}
+
+static struct jp_cache_entry *
+jp_cache_find(struct jp_cache *cache, const char *key, unsigned int hash)
+{
+	struct jp_cache_entry *e;
+
+	for (e = cache->buckets[hash & (cache->nbuckets - 1)]; e; e = e->chain)
+		if (e->hash == hash && !strcmp(e->key, key))
+			return e;
+
+	return NULL;
+}
+
+static void
+jp_cache_unlink(struct jp_cache *cache, struct jp_cache_entry *e)
+{
+	struct jp_cache_entry **p = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+
+	while (*p != e)
+		p = &(*p)->chain;
+
+	*p = e->chain;
+}
+
+/* returns the slot for a new entry, evicting one if the cache is full */
+static int
+jp_cache_slot(struct jp_cache *cache)
+{
+	struct jp_cache_entry *e;
+	int slot;
+
+	if (cache->stats.entries < cache->size)
+		return cache->stats.entries++;
+
+	for (;;)
+	{
+		slot = cache->hand;
+		cache->hand = (cache->hand + 1) % cache->size;
+		e = cache->slots[slot];
+
+		if (e->referenced)
+		{
+			e->referenced = false;
+			continue;
+		}
+
+		jp_cache_unlink(cache, e);
+		jp_free(e->state);
+		free(e);
+
+		cache->stats.evictions++;
+
+		return slot;
+	}
+}
+
+struct jp_cache *
+jp_cache_new(int size)
+{
+	struct jp_cache *cache;
+	unsigned int nbuckets = 1;
+
+	if (size <= 0)
+		return NULL;
+
+	while (nbuckets < size)
+		nbuckets <<= 1;
+
+	cache = calloc(1, sizeof(*cache));
+
+	if (!cache)
+		return NULL;
+
+	cache->buckets = calloc(nbuckets, sizeof(*cache->buckets));
+	cache->slots = calloc(size, sizeof(*cache->slots));
+
+	if (!cache->buckets || !cache->slots)
+	{
+		free(cache->buckets);
+		free(cache->slots);
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->nbuckets = nbuckets;
+	cache->size = size;
+
+	return cache;
+}
+
+void
+jp_cache_free(struct jp_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->stats.entries; i++)
+	{
+		jp_free(cache->slots[i]->state);
+		free(cache->slots[i]);
+	}
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache->slots);
+	free(cache);
+}
+
+struct jp_state *
+jp_cache_get(struct jp_cache *cache, const char *expr)
+{
+	struct jp_cache_entry *e;
+	struct jp_state *s = NULL;
+	char buf[256], *key = buf;
+	size_t len = strlen(expr);
+	unsigned int hash;
+	int slot;
+
+	if (len >= sizeof(buf))
+	{
+		key = malloc(len + 1);
+
+		if (!key)
+			return NULL;
+	}
+
+	len = jp_cache_key(expr, key);
+	hash = jp_cache_hash(key, len);
+
+	pthread_mutex_lock(&cache->lock);
+
+	e = jp_cache_find(cache, key, hash);
+
+	if (e)
+	{
+		e->referenced = true;
+		s = jp_ref(e->state);
+		cache->stats.hits++;
+	}
+	else
+	{
+		cache->stats.misses++;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	if (s)
+		goto out;
+
+	/* parse outside the lock so misses do not serialize each other, the
+	 * original spelling keeps error positions meaningful */
+	s = jp_parse(expr);
+
+	if (!s || s->error_code)
+		goto out;
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* another thread may have inserted the same key meanwhile */
+	if (!jp_cache_find(cache, key, hash))
+	{
+		e = malloc(sizeof(*e) + len + 1);
+
+		if (e)
+		{
+			slot = jp_cache_slot(cache);
+
+			memcpy(e->key, key, len + 1);
+			e->hash = hash;
+			e->state = jp_ref(s);
+
+			/* start unreferenced so one-off expressions go first */
+			e->referenced = false;
+
+			e->chain = cache->buckets[hash & (cache->nbuckets - 1)];
+			cache->buckets[hash & (cache->nbuckets - 1)] = e;
+			cache->slots[slot] = e;
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+out:
+	if (key != buf)
+		free(key);
+
+	return s;
+}
+
+void
+jp_cache_stats(struct jp_cache *cache, struct jp_cache_stats *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
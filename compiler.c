@@ -0,0 +1,629 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+
+/* a SCAN predicate or a sub-path operand whose code is emitted later */
+struct jp_fixup {
+	int pc;
+	struct jp_opcode *op;
+};
+
+/* scratch space on the stack, only spilled to the heap for huge paths */
+#define JP_SCRATCH 32
+
+struct jp_compiler {
+	struct jp_insn *code;
+	int ncode, acode;
+	struct jp_value *consts;
+	int nconsts, aconsts;
+	struct jp_test *tests;
+	int ntests, atests;
+	struct jp_insn *hoists;
+	int nhoists, ahoists;
+	struct jp_fixup *fixups;
+	int nfixups, afixups;
+	int nframes;
+	lh_hash_fn *hash_fn;
+	bool oom;
+	struct jp_insn code_buf[JP_SCRATCH * 2];
+	struct jp_value consts_buf[JP_SCRATCH];
+	struct jp_test tests_buf[JP_SCRATCH];
+	struct jp_insn hoists_buf[JP_SCRATCH];
+	struct jp_fixup fixups_buf[JP_SCRATCH];
+};
+
+static bool
+jp_grow(void **ptr, int *alloc, int want, size_t size, void *buf)
+{
+	void *tmp;
+	int n = *alloc;
+
+	if (want <= *alloc)
+		return true;
+
+	while (n < want)
+		n *= 2;
+
+	if (*ptr == buf)
+	{
+		tmp = malloc(n * size);
+
+		if (tmp)
+			memcpy(tmp, buf, *alloc * size);
+	}
+	else
+	{
+		tmp = realloc(*ptr, n * size);
+	}
+
+	if (!tmp)
+		return false;
+
+	*ptr = tmp;
+	*alloc = n;
+
+	return true;
+}
+
+static int
+jp_emit(struct jp_compiler *c, int op, int aux, int arg)
+{
+	struct jp_insn *insn;
+
+	if (!jp_grow((void **)&c->code, &c->acode, c->ncode + 1,
+	             sizeof(*c->code), c->code_buf))
+	{
+		c->oom = true;
+		return 0;
+	}
+
+	insn = &c->code[c->ncode];
+	insn->op = op;
+	insn->aux = aux;
+	insn->arg = arg;
+
+	return c->ncode++;
+}
+
+/* emits an operand instruction, moving it to hoists[] if rooted at $ */
+static int
+jp_emit_operand(struct jp_compiler *c, bool root, int op, int aux, int arg)
+{
+	struct jp_insn *insn;
+
+	if (!root)
+		return jp_emit(c, op, aux, arg);
+
+	if (!jp_grow((void **)&c->hoists, &c->ahoists, c->nhoists + 1,
+	             sizeof(*c->hoists), c->hoists_buf))
+	{
+		c->oom = true;
+		return 0;
+	}
+
+	insn = &c->hoists[c->nhoists];
+	insn->op = op;
+	insn->aux = aux;
+	insn->arg = arg;
+
+	return jp_emit(c, JP_OP_HOIST, 0, c->nhoists++);
+}
+
+/*
+ * The hash function of json-c's object tables. Member keys are hashed with
+ * it once when compiling, instead of on every lookup. Which function that
+ * is only shows on a table, so one is created the first time.
+ */
+static lh_hash_fn *
+jp_hash_fn(void)
+{
+	static lh_hash_fn *hash_fn;
+	lh_hash_fn *fn = __atomic_load_n(&hash_fn, __ATOMIC_RELAXED);
+	struct json_object *obj;
+
+	if (fn)
+		return fn;
+
+	obj = json_object_new_object();
+
+	if (!obj)
+		return NULL;
+
+	fn = json_object_get_object(obj)->hash_fn;
+	json_object_put(obj);
+
+	__atomic_store_n(&hash_fn, fn, __ATOMIC_RELAXED);
+
+	return fn;
+}
+
+static int
+jp_const(struct jp_compiler *c, struct jp_opcode *op)
+{
+	struct jp_value *val;
+
+	if (!jp_grow((void **)&c->consts, &c->aconsts, c->nconsts + 1,
+	             sizeof(*c->consts), c->consts_buf))
+	{
+		c->oom = true;
+		return 0;
+	}
+
+	val = &c->consts[c->nconsts];
+	val->type = op->type;
+	val->num = op->num;
+	val->str = op->str;
+	val->hash = 0;
+
+	if ((op->type == T_LABEL || op->type == T_STRING) && c->hash_fn)
+		val->hash = c->hash_fn(op->str);
+
+	return c->nconsts++;
+}
+
+static int
+jp_test(struct jp_compiler *c, int root, int cmp, struct jp_opcode *lit)
+{
+	struct jp_test *test;
+
+	if (!jp_grow((void **)&c->tests, &c->atests, c->ntests + 1,
+	             sizeof(*c->tests), c->tests_buf))
+	{
+		c->oom = true;
+		return 0;
+	}
+
+	test = &c->tests[c->ntests];
+	test->path = -1;
+	test->root = root;
+	test->cmp = cmp;
+	test->lit.type = lit->type;
+	test->lit.num = lit->num;
+	test->lit.str = lit->str;
+	test->lit.hash = 0;
+
+	switch (lit->type)
+	{
+	case T_BOOL:
+		test->type = json_type_boolean;
+		break;
+
+	case T_NUMBER:
+		test->type = json_type_int;
+		break;
+
+	default:
+		test->type = json_type_string;
+		break;
+	}
+
+	return c->ntests++;
+}
+
+static void
+jp_defer(struct jp_compiler *c, int pc, struct jp_opcode *op)
+{
+	if (!jp_grow((void **)&c->fixups, &c->afixups, c->nfixups + 1,
+	             sizeof(*c->fixups), c->fixups_buf))
+	{
+		c->oom = true;
+		return;
+	}
+
+	c->fixups[c->nfixups].pc = pc;
+	c->fixups[c->nfixups].op = op;
+	c->nfixups++;
+}
+
+static int
+jp_cmp_index(const void *a, const void *b)
+{
+	const struct jp_value *x = a, *y = b;
+
+	return (x->num > y->num) - (x->num < y->num);
+}
+
+static int
+jp_cmp_key(const void *a, const void *b)
+{
+	const struct jp_value *x = a, *y = b;
+
+	return strcmp(x->str, y->str);
+}
+
+/*
+ * Unions of only keys or only indexes are looked up directly instead of
+ * scanning every child. The list is stored as its length followed by the
+ * distinct literals in ascending order.
+ */
+static bool
+jp_compile_pick(struct jp_compiler *c, struct jp_opcode *seg)
+{
+	struct jp_opcode *op, count = { .type = T_NUMBER };
+	int (*cmp)(const void *, const void *);
+	int type = seg->down->type, start, i, n = 0;
+	struct jp_value *list;
+
+	if (type != T_STRING && type != T_NUMBER)
+		return false;
+
+	for (op = seg->down; op; op = op->sibling)
+		if (op->type != type)
+			return false;
+
+	start = jp_const(c, &count);
+
+	for (op = seg->down; op && !c->oom; op = op->sibling)
+		jp_const(c, op);
+
+	if (c->oom)
+		return true;
+
+	/* sorted, duplicates end up next to each other */
+	list = &c->consts[start + 1];
+	cmp = (type == T_STRING) ? jp_cmp_key : jp_cmp_index;
+	qsort(list, c->nconsts - start - 1, sizeof(*list), cmp);
+
+	for (i = 0; i < c->nconsts - start - 1; i++)
+		if (!n || cmp(&list[n - 1], &list[i]))
+			list[n++] = list[i];
+
+	c->nconsts = start + 1 + n;
+	c->consts[start].num = n;
+
+	jp_emit(c, (type == T_STRING) ? JP_OP_KEYS : JP_OP_INDEXES, 0, start);
+
+	return true;
+}
+
+/* emits a single step and returns the number of frames it needs */
+static int
+jp_compile_step(struct jp_compiler *c, struct jp_opcode *seg)
+{
+	struct jp_opcode wildcard = { .type = T_WILDCARD };
+
+	switch (seg->type)
+	{
+	case T_STRING:
+	case T_LABEL:
+		jp_emit(c, JP_OP_KEY, 0, jp_const(c, seg));
+		return 0;
+
+	case T_NUMBER:
+		jp_emit(c, JP_OP_INDEX, 0, seg->num);
+		return 0;
+
+	case T_DOTDOT:
+		jp_emit(c, JP_OP_DESCEND, 0, 0);
+		return 1 + jp_compile_step(c, seg->down);
+
+	case T_COLON:
+		/* start, end and step, unbounded ones are wildcards */
+		jp_emit(c, JP_OP_SLICE, 0, jp_const(c, seg->down));
+		jp_const(c, seg->down->sibling);
+		jp_const(c, seg->down->sibling->sibling
+		            ? seg->down->sibling->sibling : &wildcard);
+		return 1;
+
+	case T_UNION:
+		if (jp_compile_pick(c, seg))
+			return 1;
+
+		/* fall through */
+
+	default:
+		jp_defer(c, jp_emit(c, JP_OP_SCAN, 0, -1), seg);
+		return 1;
+	}
+}
+
+static void
+jp_compile_path(struct jp_compiler *c, struct jp_opcode *seg)
+{
+	int nframes = 0;
+
+	for (; seg; seg = seg->sibling)
+		nframes += jp_compile_step(c, seg);
+
+	jp_emit(c, JP_OP_EMIT, 0, 0);
+
+	if (nframes > c->nframes)
+		c->nframes = nframes;
+}
+
+static bool
+jp_is_operand(struct jp_opcode *op)
+{
+	switch (op->type)
+	{
+	case T_BOOL:
+	case T_NUMBER:
+	case T_STRING:
+	case T_ROOT:
+	case T_THIS:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static bool
+jp_is_literal(struct jp_opcode *op)
+{
+	return (op->type == T_BOOL || op->type == T_NUMBER ||
+	        op->type == T_STRING);
+}
+
+/* a sub-path only made of KEY and INDEX steps selects at most one value */
+static bool
+jp_is_chain(struct jp_opcode *op)
+{
+	struct jp_opcode *seg;
+
+	if (op->type != T_ROOT && op->type != T_THIS)
+		return false;
+
+	for (seg = op->down; seg; seg = seg->sibling)
+		if (seg->type != T_LABEL && seg->type != T_STRING &&
+		    seg->type != T_NUMBER)
+			return false;
+
+	return true;
+}
+
+/* the comparison seen from the other operand */
+static int
+jp_flip(int cmp)
+{
+	switch (cmp)
+	{
+	case T_LT: return T_GT;
+	case T_LE: return T_GE;
+	case T_GT: return T_LT;
+	case T_GE: return T_LE;
+	default:   return cmp;
+	}
+}
+
+static void
+jp_compile_operand(struct jp_compiler *c, struct jp_opcode *op)
+{
+	if (op->type == T_ROOT || op->type == T_THIS)
+		jp_defer(c, jp_emit_operand(c, op->type == T_ROOT,
+		                            JP_OP_RESOLVE, op->type, -1), op);
+	else
+		jp_emit(c, JP_OP_LOAD, 0, jp_const(c, op));
+}
+
+static void
+jp_compile_pred(struct jp_compiler *c, struct jp_opcode *op)
+{
+	struct jp_opcode *sop;
+	int pc, start, jump;
+
+	switch (op->type)
+	{
+	case T_WILDCARD:
+		jp_emit(c, JP_OP_TRUE, 0, 0);
+		break;
+
+	case T_EQ:
+	case T_NE:
+	case T_LT:
+	case T_LE:
+	case T_GT:
+	case T_GE:
+		/* operands that do not resolve to a value never compare */
+		if (!jp_is_operand(op->down) || !jp_is_operand(op->down->sibling))
+		{
+			jp_emit(c, JP_OP_FALSE, 0, 0);
+			break;
+		}
+
+		sop = op->down->sibling;
+
+		if (jp_is_chain(op->down) && jp_is_literal(sop))
+		{
+			jp_defer(c, jp_emit_operand(c, op->down->type == T_ROOT,
+			                            JP_OP_TEST, 0,
+			                            jp_test(c, op->down->type, op->type,
+			                                    sop)),
+			         op->down);
+			break;
+		}
+
+		if (jp_is_literal(op->down) && jp_is_chain(sop))
+		{
+			jp_defer(c, jp_emit_operand(c, sop->type == T_ROOT,
+			                            JP_OP_TEST, 0,
+			                            jp_test(c, sop->type, jp_flip(op->type),
+			                                    op->down)),
+			         sop);
+			break;
+		}
+
+		jp_compile_operand(c, op->down);
+		jp_compile_operand(c, sop);
+		jp_emit(c, JP_OP_CMP, op->type, 0);
+		break;
+
+	case T_ROOT:
+	case T_THIS:
+		jp_defer(c, jp_emit_operand(c, op->type == T_ROOT,
+		                            JP_OP_EXISTS, op->type, -1), op);
+		break;
+
+	case T_NOT:
+		jp_compile_pred(c, op->down);
+		jp_emit(c, JP_OP_NOT, 0, 0);
+		break;
+
+	case T_AND:
+	case T_OR:
+	case T_UNION:
+		jump = (op->type == T_AND) ? JP_OP_AND : JP_OP_OR;
+		start = c->ncode;
+
+		for (sop = op->down; sop; sop = sop->sibling)
+		{
+			jp_compile_pred(c, sop);
+
+			if (sop->sibling)
+				jp_emit(c, jump, 0, -1);
+		}
+
+		/* all short-circuit jumps land past the last operand */
+		for (pc = start; pc < c->ncode && !c->oom; pc++)
+			if (c->code[pc].op == jump && c->code[pc].arg == -1)
+				c->code[pc].arg = c->ncode;
+
+		break;
+
+	case T_STRING:
+		jp_emit(c, JP_OP_IS_KEY, 0, jp_const(c, op));
+		break;
+
+	case T_NUMBER:
+		jp_emit(c, JP_OP_IS_INDEX, 0, op->num);
+		break;
+
+	default:
+		jp_emit(c, JP_OP_FALSE, 0, 0);
+		break;
+	}
+}
+
+/*
+ * Compiles the given path. With a state the program is allocated from its
+ * pool and released by jp_free(), otherwise it must be released with
+ * jp_prog_free().
+ */
+struct jp_prog *
+jp_compile(struct jp_state *s, struct jp_opcode *path)
+{
+	struct jp_compiler c = { 0 };
+	struct jp_prog *prog = NULL;
+	struct jp_fixup fix;
+	struct jp_insn *insn;
+	size_t size;
+	int i;
+
+	c.code = c.code_buf;
+	c.acode = ARRAY_SIZE(c.code_buf);
+	c.consts = c.consts_buf;
+	c.aconsts = ARRAY_SIZE(c.consts_buf);
+	c.tests = c.tests_buf;
+	c.atests = ARRAY_SIZE(c.tests_buf);
+	c.hoists = c.hoists_buf;
+	c.ahoists = ARRAY_SIZE(c.hoists_buf);
+	c.fixups = c.fixups_buf;
+	c.afixups = ARRAY_SIZE(c.fixups_buf);
+	c.hash_fn = jp_hash_fn();
+
+	if (path->type == T_LABEL)
+		path = path->down;
+
+	jp_compile_path(&c, path->down);
+
+	/* predicates and sub-paths go after the path that uses them, which
+	 * keeps each path's steps contiguous */
+	for (i = 0; i < c.nfixups && !c.oom; i++)
+	{
+		fix = c.fixups[i];
+		insn = &c.code[fix.pc];
+
+		if (insn->op == JP_OP_HOIST)
+			insn = &c.hoists[insn->arg];
+
+		if (insn->op == JP_OP_TEST)
+			c.tests[insn->arg].path = c.ncode;
+		else
+			insn->arg = c.ncode;
+
+		if (insn->op == JP_OP_SCAN)
+		{
+			jp_compile_pred(&c, fix.op);
+			jp_emit(&c, JP_OP_RET, 0, 0);
+		}
+		else
+		{
+			jp_compile_path(&c, fix.op->down);
+		}
+	}
+
+	if (c.oom)
+		goto out;
+
+	size = sizeof(*prog) +
+	       c.ncode * sizeof(*c.code) +
+	       c.nconsts * sizeof(*c.consts) +
+	       c.ntests * sizeof(*c.tests) +
+	       c.nhoists * sizeof(*c.hoists) +
+	       c.nconsts * sizeof(*prog->slots);
+
+	prog = s ? jp_alloc(s, size) : malloc(size);
+
+	if (!prog)
+		goto out;
+
+	prog->code = (struct jp_insn *)(prog + 1);
+	prog->consts = (struct jp_value *)(prog->code + c.ncode);
+	prog->tests = (struct jp_test *)(prog->consts + c.nconsts);
+	prog->hoists = (struct jp_insn *)(prog->tests + c.ntests);
+	prog->slots = (int *)(prog->hoists + c.nhoists);
+	prog->ncode = c.ncode;
+	prog->nconsts = c.nconsts;
+	prog->ntests = c.ntests;
+	prog->nhoists = c.nhoists;
+	prog->nframes = c.nframes;
+	prog->hash_fn = c.hash_fn;
+
+	memcpy(prog->code, c.code, c.ncode * sizeof(*c.code));
+	memcpy(prog->consts, c.consts, c.nconsts * sizeof(*c.consts));
+	memcpy(prog->tests, c.tests, c.ntests * sizeof(*c.tests));
+	memcpy(prog->hoists, c.hoists, c.nhoists * sizeof(*c.hoists));
+	memset(prog->slots, 0, c.nconsts * sizeof(*prog->slots));
+
+out:
+	if (c.code != c.code_buf)
+		free(c.code);
+
+	if (c.consts != c.consts_buf)
+		free(c.consts);
+
+	if (c.tests != c.tests_buf)
+		free(c.tests);
+
+	if (c.hoists != c.hoists_buf)
+		free(c.hoists);
+
+	if (c.fixups != c.fixups_buf)
+		free(c.fixups);
+
+	return prog;
+}
+
+void
+jp_prog_free(struct jp_prog *prog)
+{
+	free(prog);
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __COMPILER_H_
+#define __COMPILER_H_
+
+#include "ast.h"
+
+/*
+ * A compiled path is a flat array of instructions. Path steps move the
+ * current value down the document and end in JP_OP_EMIT, predicates are
+ * evaluated on a small value stack and end in JP_OP_RET. Sub-paths used
+ * inside predicates are ordinary path sequences elsewhere in the array.
+ *
+ * Operands rooted at $ give the same result for every value a predicate
+ * looks at. They are moved out of the code into hoists[], where they are
+ * evaluated on first use and then reused until the match ends.
+ */
+enum jp_insn_op {
+	/* path steps */
+	JP_OP_KEY,		/* descend into object member consts[arg] */
+	JP_OP_INDEX,	/* descend into array element arg, negative counts from end */
+	JP_OP_SCAN,		/* visit each child accepted by the predicate at arg */
+	JP_OP_SLICE,	/* visit the elements in range consts[arg .. arg + 2] */
+	JP_OP_KEYS,		/* visit the members named by the list at consts[arg] */
+	JP_OP_INDEXES,	/* visit the elements listed at consts[arg] */
+	JP_OP_DESCEND,	/* run the next step on the value and each descendant */
+	JP_OP_EMIT,		/* report the current value and backtrack */
+
+	/* predicates */
+	JP_OP_TRUE,
+	JP_OP_FALSE,
+	JP_OP_IS_KEY,	/* member key equals consts[arg] */
+	JP_OP_IS_INDEX,	/* element index equals arg */
+	JP_OP_EXISTS,	/* sub-path at arg, rooted at aux, yields a value */
+	JP_OP_NOT,
+	JP_OP_AND,		/* if top is false jump to arg, else pop */
+	JP_OP_OR,		/* if top is true jump to arg, else pop */
+	JP_OP_LOAD,		/* push consts[arg] */
+	JP_OP_RESOLVE,	/* push first value of sub-path at arg, rooted at aux */
+	JP_OP_CMP,		/* pop two operands, push result of comparison aux */
+	JP_OP_TEST,		/* push result of the typed comparison tests[arg] */
+	JP_OP_HOIST,	/* push result of hoists[arg], evaluated once per match */
+	JP_OP_RET,
+};
+
+struct jp_insn {
+	unsigned char op;
+	unsigned char aux;
+	int arg;
+};
+
+struct jp_value {
+	int type;
+	int num;
+	const char *str;
+	unsigned long hash;		/* of str, for looking up members by key */
+};
+
+/*
+ * A comparison of a plain KEY/INDEX sub-path with a literal, the most
+ * common filter. Everything but the value found is resolved when compiling,
+ * so only a value of the literal's json type is ever compared.
+ */
+struct jp_test {
+	int path;				/* pc of the sub-path */
+	int root;				/* T_ROOT or T_THIS */
+	int cmp;				/* T_EQ ... T_GE, sub-path on the left */
+	enum json_type type;
+	struct jp_value lit;
+};
+
+/* operands are always literals or sub-paths, so a comparison is the
+ * deepest thing a predicate ever puts on the stack */
+#define JP_STACK_MAX 2
+
+struct jp_prog {
+	struct jp_insn *code;
+	struct jp_value *consts;
+	struct jp_test *tests;
+	struct jp_insn *hoists;
+	int ncode;
+	int nconsts;
+	int ntests;
+	int nhoists;
+	int nframes;
+	lh_hash_fn *hash_fn;	/* the keys in consts were hashed with */
+	int *slots;				/* table slots keys were last found in */
+};
+
+struct jp_prog *jp_compile(struct jp_state *s, struct jp_opcode *path);
+void jp_prog_free(struct jp_prog *prog);
+
+#endif /* __COMPILER_H_ */
@@ -0,0 +1,621 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "jsonpath.h"
+
+/*
+ * Describes what the matcher does with a parsed expression, following the
+ * choices jp_compile() makes: literal keys, indexes and unions of only
+ * those are looked up directly, everything else visits every child and
+ * tests it, operands rooted at $ are evaluated once per match.
+ *
+ * The cost is estimated as a power of n, the size of the document. A path
+ * visiting children is linear, however many scans it has, as together
+ * they visit no value twice, and so are the sub-paths of a filter, which
+ * stay within the child tested. Values found by a descent may nest, so
+ * each further descent, or a filter sub-path visiting children below a
+ * descent, may visit the same values once per enclosing value.
+ */
+
+struct jp_explain {
+	FILE *out;
+	int once;
+	int step;
+};
+
+static int jp_explain_path_cost(struct jp_explain *e, struct jp_opcode *op);
+
+static void
+jp_explain_str(FILE *out, const char *s)
+{
+	fputc('"', out);
+
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fputc('\\', out);
+
+		fputc(*s, out);
+	}
+
+	fputc('"', out);
+}
+
+/* keys the lexer reads back as a label after a dot */
+static bool
+jp_explain_is_label(const char *s)
+{
+	if (!strcmp(s, "true") || !strcmp(s, "false"))
+		return false;
+
+	if (!isalpha((unsigned char)*s) && *s != '_')
+		return false;
+
+	for (s++; *s; s++)
+		if (!isalnum((unsigned char)*s) && *s != '_')
+			return false;
+
+	return true;
+}
+
+static bool
+jp_explain_is_pick(struct jp_opcode *op)
+{
+	struct jp_opcode *sop;
+
+	if (op->type != T_UNION)
+		return false;
+
+	for (sop = op->down; sop; sop = sop->sibling)
+		if (sop->type != op->down->type ||
+		    (sop->type != T_STRING && sop->type != T_NUMBER))
+			return false;
+
+	return true;
+}
+
+/* a path of KEY and INDEX steps only, resolved without visiting children */
+static bool
+jp_explain_is_chain(struct jp_opcode *op)
+{
+	struct jp_opcode *seg;
+
+	for (seg = op->down; seg; seg = seg->sibling)
+		if (seg->type != T_LABEL && seg->type != T_STRING &&
+		    seg->type != T_NUMBER)
+			return false;
+
+	return true;
+}
+
+static const char *
+jp_explain_cmp(int type)
+{
+	switch (type)
+	{
+	case T_EQ: return "==";
+	case T_NE: return "!=";
+	case T_LT: return "<";
+	case T_LE: return "<=";
+	case T_GT: return ">";
+	case T_GE: return ">=";
+	default:   return "?";
+	}
+}
+
+static void jp_explain_expr(FILE *out, struct jp_opcode *op, int prec);
+
+static void
+jp_explain_seg(FILE *out, struct jp_opcode *seg)
+{
+	struct jp_opcode *sop;
+
+	switch (seg->type)
+	{
+	case T_DOTDOT:
+		fputs("..", out);
+		sop = seg->down;
+
+		if (sop->type == T_LABEL || sop->type == T_WILDCARD)
+		{
+			fputs(sop->type == T_LABEL ? sop->str : "*", out);
+			break;
+		}
+
+		jp_explain_seg(out, sop);
+		break;
+
+	case T_LABEL:
+	case T_STRING:
+		if (jp_explain_is_label(seg->str))
+		{
+			fprintf(out, ".%s", seg->str);
+			break;
+		}
+
+		fputc('[', out);
+		jp_explain_str(out, seg->str);
+		fputc(']', out);
+		break;
+
+	case T_NUMBER:
+		fprintf(out, "[%d]", seg->num);
+		break;
+
+	case T_WILDCARD:
+		fputs("[*]", out);
+		break;
+
+	case T_COLON:
+		fputc('[', out);
+
+		for (sop = seg->down; sop; sop = sop->sibling)
+		{
+			if (sop != seg->down)
+				fputc(':', out);
+
+			if (sop->type == T_NUMBER)
+				fprintf(out, "%d", sop->num);
+		}
+
+		fputc(']', out);
+		break;
+
+	case T_UNION:
+		if (jp_explain_is_pick(seg))
+		{
+			fputc('[', out);
+
+			for (sop = seg->down; sop; sop = sop->sibling)
+			{
+				if (sop != seg->down)
+					fputs(", ", out);
+
+				jp_explain_expr(out, sop, 0);
+			}
+
+			fputc(']', out);
+			break;
+		}
+
+		/* fall through */
+
+	default:
+		fputs("[?(", out);
+		jp_explain_expr(out, seg, 0);
+		fputs(")]", out);
+		break;
+	}
+}
+
+static void
+jp_explain_path(FILE *out, struct jp_opcode *op)
+{
+	struct jp_opcode *seg;
+
+	fputc(op->type == T_ROOT ? '$' : '@', out);
+
+	for (seg = op->down; seg; seg = seg->sibling)
+		jp_explain_seg(out, seg);
+}
+
+/* infix form, parenthesized where precedence requires it */
+static void
+jp_explain_expr(FILE *out, struct jp_opcode *op, int prec)
+{
+	struct jp_opcode *sop;
+	const char *sep;
+	int p;
+
+	switch (op->type)
+	{
+	case T_ROOT:
+	case T_THIS:
+		jp_explain_path(out, op);
+		break;
+
+	case T_STRING:
+		jp_explain_str(out, op->str);
+		break;
+
+	case T_NUMBER:
+		fprintf(out, "%d", op->num);
+		break;
+
+	case T_BOOL:
+		fputs(op->num ? "true" : "false", out);
+		break;
+
+	case T_WILDCARD:
+		fputc('*', out);
+		break;
+
+	case T_NOT:
+		fputc('!', out);
+		jp_explain_expr(out, op->down, 5);
+		break;
+
+	case T_EQ:
+	case T_NE:
+	case T_LT:
+	case T_LE:
+	case T_GT:
+	case T_GE:
+		if (prec > 4)
+			fputc('(', out);
+
+		jp_explain_expr(out, op->down, 5);
+		fprintf(out, " %s ", jp_explain_cmp(op->type));
+		jp_explain_expr(out, op->down->sibling, 5);
+
+		if (prec > 4)
+			fputc(')', out);
+
+		break;
+
+	case T_UNION:
+	case T_OR:
+	case T_AND:
+		p = (op->type == T_AND) ? 3 : (op->type == T_OR) ? 2 : 1;
+		sep = (op->type == T_AND) ? " && " : (op->type == T_OR) ? " || " : ", ";
+
+		if (prec > p)
+			fputc('(', out);
+
+		for (sop = op->down; sop; sop = sop->sibling)
+		{
+			if (sop != op->down)
+				fputs(sep, out);
+
+			jp_explain_expr(out, sop, p + 1);
+		}
+
+		if (prec > p)
+			fputc(')', out);
+
+		break;
+
+	default:
+		fputc('?', out);
+		break;
+	}
+}
+
+/* cost of a predicate per child tested, operands rooted at $ count once */
+static int
+jp_explain_pred_cost(struct jp_explain *e, struct jp_opcode *op)
+{
+	struct jp_opcode *sop;
+	int cost = 0, c;
+
+	switch (op->type)
+	{
+	case T_ROOT:
+		c = jp_explain_path_cost(e, op);
+
+		if (c > e->once)
+			e->once = c;
+
+		return 0;
+
+	case T_THIS:
+		return jp_explain_path_cost(e, op);
+
+	case T_NOT:
+	case T_EQ:
+	case T_NE:
+	case T_LT:
+	case T_LE:
+	case T_GT:
+	case T_GE:
+	case T_UNION:
+	case T_OR:
+	case T_AND:
+		for (sop = op->down; sop; sop = sop->sibling)
+			if ((c = jp_explain_pred_cost(e, sop)) > cost)
+				cost = c;
+
+		return cost;
+
+	default:
+		return 0;
+	}
+}
+
+static bool
+jp_explain_is_lookup(struct jp_opcode *seg)
+{
+	return (seg->type == T_LABEL || seg->type == T_STRING ||
+	        seg->type == T_NUMBER || jp_explain_is_pick(seg));
+}
+
+/*
+ * A slice anchored at one end of the array visits a number of elements
+ * given by its bounds, however long the array is: [1:5] or [-5:] stepping
+ * forward, [5::-1] or [:-5:-1] stepping backward.
+ */
+static bool
+jp_explain_is_bounded(struct jp_opcode *seg)
+{
+	struct jp_opcode *start = seg->down, *end = start->sibling;
+	struct jp_opcode *step = end->sibling;
+	int dir = (step && step->type == T_NUMBER) ? step->num : 1;
+
+	if (dir == 0)
+		return true;
+
+	if (dir < 0)
+		return ((start->type == T_NUMBER && start->num >= 0) ||
+		        (end->type == T_NUMBER && end->num < 0));
+
+	return ((end->type == T_NUMBER && end->num >= 0) ||
+	        (start->type == T_NUMBER && start->num < 0));
+}
+
+/* cost of a step after descents, the step itself is passed for a descent */
+static int
+jp_explain_step_cost(struct jp_explain *e, struct jp_opcode *step,
+                     int descents)
+{
+	int pred;
+
+	if (jp_explain_is_lookup(step))
+		return descents;
+
+	if (step->type == T_COLON && jp_explain_is_bounded(step))
+		return descents;
+
+	if (step->type == T_COLON || step->type == T_WILDCARD)
+		pred = 0;
+	else
+		pred = jp_explain_pred_cost(e, step);
+
+	if (!descents)
+		return pred > 1 ? pred : 1;
+
+	return descents + pred;
+}
+
+static int
+jp_explain_path_cost(struct jp_explain *e, struct jp_opcode *op)
+{
+	struct jp_opcode *seg;
+	int descents = 0, cost = 0, c;
+
+	for (seg = op->down; seg; seg = seg->sibling)
+	{
+		if (seg->type == T_DOTDOT)
+			c = jp_explain_step_cost(e, seg->down, ++descents);
+		else
+			c = jp_explain_step_cost(e, seg, descents);
+
+		if (c > cost)
+			cost = c;
+	}
+
+	return cost;
+}
+
+static void
+jp_explain_class(FILE *out, int cost)
+{
+	if (cost == 0)
+		fputs("O(1)", out);
+	else if (cost == 1)
+		fputs("O(n)", out);
+	else
+		fprintf(out, "O(n^%d)", cost);
+}
+
+/* notes on the operands of a filter */
+static void
+jp_explain_operands(struct jp_explain *e, struct jp_opcode *op)
+{
+	struct jp_explain sub = { 0 };
+	struct jp_opcode *sop;
+	int cost;
+
+	switch (op->type)
+	{
+	case T_ROOT:
+	case T_THIS:
+		fputs("        ", e->out);
+		jp_explain_path(e->out, op);
+
+		cost = jp_explain_path_cost(&sub, op);
+
+		if (op->type == T_ROOT)
+			fputs(": loop-invariant, evaluated once per match", e->out);
+		else if (jp_explain_is_chain(op))
+			fputs(": direct lookups per child", e->out);
+		else
+			fputs(": sub-path per child, up to its first value", e->out);
+
+		if (cost)
+		{
+			fputs(", ", e->out);
+			jp_explain_class(e->out, cost);
+		}
+
+		fputc('\n', e->out);
+		break;
+
+	default:
+		for (sop = op->down; sop; sop = sop->sibling)
+			jp_explain_operands(e, sop);
+
+		break;
+	}
+}
+
+/* ends the line of a step, naming its cost if it is more than linear */
+static void
+jp_explain_step_class(FILE *out, int cost)
+{
+	if (cost > 1)
+	{
+		fputs(", ", out);
+		jp_explain_class(out, cost);
+	}
+
+	fputc('\n', out);
+}
+
+static int
+jp_explain_count(struct jp_opcode *op)
+{
+	int n = 0;
+
+	for (op = op->down; op; op = op->sibling)
+		n++;
+
+	return n;
+}
+
+static void
+jp_explain_step(struct jp_explain *e, struct jp_opcode *seg, int descents)
+{
+	struct jp_explain sub = { 0 };
+	FILE *out = e->out;
+	bool descend = (descents > 0);
+	int cost = jp_explain_step_cost(&sub, seg, descents);
+
+	switch (seg->type)
+	{
+	case T_LABEL:
+	case T_STRING:
+		fputs("member ", out);
+		jp_explain_str(out, seg->str);
+		fputs(descend ? ", looked up in each" : ", looked up", out);
+		break;
+
+	case T_NUMBER:
+		fprintf(out, "element %d%s", seg->num,
+		        descend ? ", looked up in each" : ", looked up");
+		break;
+
+	case T_WILDCARD:
+		fputs("every child", out);
+		break;
+
+	case T_COLON:
+		fputs("elements ", out);
+		jp_explain_seg(out, seg);
+		fputs(", in range", out);
+		break;
+
+	case T_UNION:
+		if (jp_explain_is_pick(seg))
+		{
+			fprintf(out, "%s ", seg->down->type == T_STRING
+			                    ? "members" : "elements");
+			jp_explain_seg(out, seg);
+			fprintf(out, ", %d lookups", jp_explain_count(seg));
+			break;
+		}
+
+		/* fall through */
+
+	default:
+		fputs("filter ", out);
+		jp_explain_seg(out, seg);
+		fputs(", tests every child", out);
+		jp_explain_step_class(out, cost);
+		jp_explain_operands(e, seg);
+		return;
+	}
+
+	jp_explain_step_class(out, cost);
+}
+
+static void
+jp_explain_steps(struct jp_explain *e, struct jp_opcode *op)
+{
+	struct jp_opcode *seg;
+	int descents = 0;
+
+	for (seg = op->down; seg; seg = seg->sibling)
+	{
+		fprintf(e->out, "  %2d. ", ++e->step);
+
+		if (seg->type != T_DOTDOT)
+		{
+			jp_explain_step(e, seg, descents);
+			continue;
+		}
+
+		fputs(descents++ ? "descend again below each value, " : "descend, ",
+		      e->out);
+		jp_explain_step(e, seg->down, descents);
+	}
+}
+
+char *
+jp_explain(struct jp_state *s)
+{
+	struct jp_explain e = { 0 };
+	struct jp_opcode *path;
+	char *buf = NULL;
+	size_t len;
+	int cost;
+
+	if (s->error_code || !s->path)
+		return NULL;
+
+	e.out = open_memstream(&buf, &len);
+
+	if (!e.out)
+		return NULL;
+
+	path = s->path;
+
+	if (path->type == T_LABEL)
+	{
+		fprintf(e.out, "%s = ", path->str);
+		path = path->down;
+	}
+
+	jp_explain_path(e.out, path);
+	fputc('\n', e.out);
+
+	cost = jp_explain_path_cost(&e, path);
+
+	fputs("cost ", e.out);
+	jp_explain_class(e.out, cost > e.once ? cost : e.once);
+
+	if (e.once)
+	{
+		fputs(", loop-invariant operands ", e.out);
+		jp_explain_class(e.out, e.once);
+	}
+
+	fputc('\n', e.out);
+	jp_explain_steps(&e, path);
+
+	if (fclose(e.out))
+	{
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
@@ -43,26 +43,36 @@ extern "C" {
 #define T_STRING                        20
 #define T_POPEN                         21
 #define T_PCLOSE                        22
+#define T_DOTDOT                        23
+#define T_FILTER                        24
+#define T_COLON                         25
+
+struct jp_prog;
+struct jp_chunk;
 
 struct jp_opcode {
 	int type;
-	struct jp_opcode *next;
 	struct jp_opcode *down;
 	struct jp_opcode *sibling;
 	char *str;
 	int num;
+	struct jp_prog *prog;
 };
 
 struct jp_state {
-	struct jp_opcode *pool;
+	struct jp_chunk *pool;
 	struct jp_opcode *path;
 	int error_pos;
 	int error_code;
 	int off;
+	int refcount;
 };
 
 
 typedef void (*jp_match_cb_t)(struct json_object *res, void *priv);
+
+/* like jp_match_cb_t, returning non-zero ends the search */
+typedef int (*jp_match_stop_cb_t)(struct json_object *res, void *priv);
 	
 /**
  * Parse a jsonpath expression.
@@ -72,16 +82,86 @@ typedef void (*jp_match_cb_t)(struct json_object *res, void *priv);
  */
 struct jp_state* jp_parse(const char *expr);
 
+/**
+ * Parse a jsonpath expression of the given length.
+ * The expression does not need to be NUL terminated, which allows parsing
+ * it straight out of a larger buffer.
+ * @param expr string jsonpath
+ * @param len length of expr in bytes
+ * @return jp_state structure suitable for use
+ */
+struct jp_state* jp_parse_n(const char *expr, size_t len);
+
 const char* jp_error_to_string(int error);
-extern const char *jp_tokennames[23];
+extern const char *jp_tokennames[26];
 
 
 /**
  * Free a parsed jsonpath expression
+ * States are reference counted, the expression is only released once the
+ * last reference, including any held by a jp_cache, is dropped.
  * @param filter
  */
 void jp_free(struct jp_state *filter);
 
+/**
+ * Describe how a parsed expression is matched: each step, whether it is
+ * looked up directly or visits every child, the predicates of filters,
+ * which operands are evaluated only once, and an estimate of the cost as
+ * a power of the document size.
+ * @param filter
+ * @return the description, to be released with free(), or NULL if the
+ * expression did not parse or out of memory
+ */
+char *jp_explain(struct jp_state *filter);
+
+/**
+ * Take an additional reference on a parsed jsonpath expression
+ * @param filter
+ * @return filter
+ */
+struct jp_state *jp_ref(struct jp_state *filter);
+
+struct jp_cache;
+
+struct jp_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	int entries;
+};
+
+/**
+ * Create a cache of parsed expressions, safe to share between threads.
+ * @param size maximum number of expressions kept
+ * @return the cache, or NULL if out of memory
+ */
+struct jp_cache *jp_cache_new(int size);
+
+/**
+ * Free a cache. States handed out by it stay valid until jp_free()d.
+ * @param cache
+ */
+void jp_cache_free(struct jp_cache *cache);
+
+/**
+ * Look up an expression, parsing and caching it on a miss.
+ * Whitespace between tokens is ignored when keying, so differently spaced
+ * spellings of one expression share an entry. Expressions failing to parse
+ * are not cached and report their error relative to expr.
+ * @param cache
+ * @param expr string jsonpath
+ * @return a referenced jp_state to be released with jp_free()
+ */
+struct jp_state *jp_cache_get(struct jp_cache *cache, const char *expr);
+
+/**
+ * Read the hit, miss and eviction counters of a cache.
+ * @param cache
+ * @param stats filled with a consistent snapshot of the counters
+ */
+void jp_cache_stats(struct jp_cache *cache, struct jp_cache_stats *stats);
+
 /**
  * Search a json_object for a jsonpath, invoking on a callback on each match.
  * @param path the parsed jsonpath to search for
@@ -93,7 +173,272 @@ void jp_free(struct jp_state *filter);
 struct json_object *
 jp_match(struct jp_opcode *path, struct json_object *input,
          jp_match_cb_t cb, void *userdata);
-	
+
+/**
+ * Search a json_object for a jsonpath, stopping as soon as the callback
+ * returns non-zero or max_results matches were reported. The rest of the
+ * document is not looked at. Running out of memory while descending into
+ * a deeply nested document ends the search as well.
+ * @param path the parsed jsonpath to search for
+ * @param input the parsed json_object to search
+ * @param cb called for each match
+ * @param userdata provided to the callback
+ * @param max_results stop after this many matches, negative for no limit
+ * @return the first matched object, if found
+ */
+struct json_object *
+jp_match_limit(struct jp_opcode *path, struct json_object *input,
+               jp_match_stop_cb_t cb, void *userdata, int max_results);
+
+/*
+ * Work done by one jp_match_stats() call, counting sub-paths evaluated by
+ * filters along with the path itself.
+ */
+struct jp_stats {
+	unsigned long nodes;	/* values the path moved to */
+	unsigned long keys;		/* object members and array elements looked at */
+	unsigned long compares;	/* comparisons evaluated by filters */
+	unsigned long subpaths;	/* sub-paths evaluated by filters */
+	unsigned long matches;	/* matches reported */
+	unsigned long depth;	/* most nested scans and descents at once */
+	unsigned long key_hits;	/* member lookups answered by the inline cache */
+	unsigned long key_misses;	/* member lookups that probed the table */
+};
+
+/**
+ * Like jp_match(), counting the work done in stats. The counters are
+ * only maintained by a library built with -DSTATS=ON, otherwise they
+ * are all zero.
+ * @param path the parsed jsonpath to search for
+ * @param input the parsed json_object to search
+ * @param cb called for each match
+ * @param userdata provided to the callback
+ * @param stats cleared, then filled in
+ * @return the first matched object, if found
+ */
+struct json_object *
+jp_match_stats(struct jp_opcode *path, struct json_object *input,
+               jp_match_cb_t cb, void *userdata, struct jp_stats *stats);
+
+/*
+ * Matches collected into one growable array. It may start out in a buffer
+ * supplied by the caller, which is copied to the heap once it is full.
+ */
+struct jp_results {
+	struct json_object **items;
+	int count;
+	int size;
+	int owned;
+	int failed;
+};
+
+/**
+ * Prepare an empty result set.
+ * @param res
+ * @param buf initial storage for size matches, may be NULL
+ * @param size
+ */
+void jp_results_init(struct jp_results *res, struct json_object **buf,
+                     int size);
+
+/**
+ * Append a match to a result set.
+ * @return 0 on success, -1 if out of memory, which also sets res->failed
+ */
+int jp_results_add(struct jp_results *res, struct json_object *obj);
+
+/**
+ * Callback appending each match to the jp_results passed as userdata,
+ * for use with jp_match_limit(), jp_set_add_limit() or
+ * jp_stream_new_limit(). It stops the match when out of memory. Streamed
+ * values are not referenced, see jp_stream_new().
+ */
+int jp_results_cb(struct json_object *obj, void *res);
+
+/**
+ * Empty a result set, keeping its storage for the next use.
+ * @param res
+ */
+void jp_results_reset(struct jp_results *res);
+
+/**
+ * Release the storage of a result set, leaving it empty.
+ * @param res
+ */
+void jp_results_free(struct jp_results *res);
+
+/**
+ * Search a json_object for a jsonpath and append the matches to a result
+ * set. The matches are owned by input.
+ * @param path the parsed jsonpath to search for
+ * @param input the parsed json_object to search
+ * @param res the result set to append to
+ * @param max_results stop after this many matches, negative for no limit
+ * @return the number of matches appended, -1 if out of memory
+ */
+int jp_match_collect(struct jp_opcode *path, struct json_object *input,
+                     struct jp_results *res, int max_results);
+
+struct jp_set;
+
+/**
+ * Create an empty set of paths to be matched together. The paths share
+ * their common leading steps and the document is traversed only once,
+ * no matter how many of them are added.
+ * @return the set, or NULL if out of memory
+ */
+struct jp_set *jp_set_new(void);
+
+/**
+ * Add a path to a set. The path must outlive the set.
+ * @param set
+ * @param path the parsed jsonpath to search for
+ * @param cb called for each match of this path
+ * @param userdata provided to the callback
+ * @return 0 on success, -1 if out of memory
+ */
+int jp_set_add(struct jp_set *set, struct jp_opcode *path,
+               jp_match_cb_t cb, void *userdata);
+
+/**
+ * Add a path to a set, reporting at most max_results matches of it and
+ * none after its callback returned non-zero. The traversal ends early
+ * once every path of the set stopped.
+ * @param set
+ * @param path the parsed jsonpath to search for
+ * @param cb called for each match of this path
+ * @param userdata provided to the callback
+ * @param max_results stop after this many matches, negative for no limit
+ * @return 0 on success, -1 if out of memory
+ */
+int jp_set_add_limit(struct jp_set *set, struct jp_opcode *path,
+                     jp_match_stop_cb_t cb, void *userdata, int max_results);
+
+/**
+ * Search a json_object for all paths of a set at once. Each path reports
+ * its matches in the same order as jp_match() would.
+ * @param set
+ * @param input the parsed json_object to search
+ */
+void jp_match_set(struct jp_set *set, struct json_object *input);
+
+void jp_set_free(struct jp_set *set);
+
+struct jp_stream;
+
+/**
+ * Create a streaming matcher, evaluating a path while the document is fed
+ * in chunks instead of building its json_object tree first.
+ * Only values the path selects, or which a filter needs to look at, are
+ * materialized. They are released once the callback returns, take a
+ * reference with json_object_get() to keep one. Memory use is bounded by
+ * the nesting depth plus the size of those values.
+ * Filters comparing against the document root ($) cannot be streamed.
+ * Matches below a recursive descent (..) are reported in document order.
+ * @param path the parsed jsonpath to search for
+ * @param cb called for each match
+ * @param userdata provided to the callback
+ * @return the stream, or NULL if out of memory or the path needs the root
+ */
+struct jp_stream *
+jp_stream_new(struct jp_opcode *path, jp_match_cb_t cb, void *userdata);
+
+/**
+ * Create a streaming matcher which stops once its callback returned
+ * non-zero or max_results matches were reported.
+ * @param path the parsed jsonpath to search for
+ * @param cb called for each match
+ * @param userdata provided to the callback
+ * @param max_results stop after this many matches, negative for no limit
+ * @return the stream, or NULL if out of memory or the path needs the root
+ */
+struct jp_stream *
+jp_stream_new_limit(struct jp_opcode *path, jp_match_stop_cb_t cb,
+                    void *userdata, int max_results);
+
+/**
+ * Feed the next chunk of the document, which may be split at any byte.
+ * @return 0 on success, -1 on malformed input, see jp_stream_error(),
+ * 1 once the match stopped and the rest of the document is not needed
+ */
+int jp_stream_feed(struct jp_stream *stream, const char *buf, size_t len);
+
+/**
+ * Signal the end of the document.
+ * @return 0 if exactly one complete value was fed or the match stopped
+ * early, -1 otherwise
+ */
+int jp_stream_end(struct jp_stream *stream);
+
+/**
+ * @return a description of the last error, NULL if there was none
+ */
+const char *jp_stream_error(struct jp_stream *stream);
+
+void jp_stream_free(struct jp_stream *stream);
+
+struct jp_pool;
+
+/* a task run by a jp_pool, worker is the index of the thread running it */
+typedef void (*jp_pool_fn_t)(void *arg, int worker);
+
+/**
+ * Create a work-stealing pool of threads. Each thread keeps a queue of
+ * its own and steals from the others once it runs dry.
+ * Matching only reads a parsed jp_state, one state may be used by all
+ * threads at once. Sets, streams and result sets are not shared, each
+ * thread needs its own.
+ * @param nworkers number of threads, 0 for one per online CPU
+ * @return the pool, or NULL if out of memory or no thread could be started
+ */
+struct jp_pool *jp_pool_new(int nworkers);
+
+/**
+ * @return the number of threads of a pool
+ */
+int jp_pool_size(struct jp_pool *pool);
+
+/**
+ * Queue a task. Tasks submitted from within a task go to the queue of the
+ * thread running it.
+ * @return 0 on success, -1 if out of memory
+ */
+int jp_pool_submit(struct jp_pool *pool, jp_pool_fn_t fn, void *arg);
+
+/**
+ * Wait until every task submitted so far, and the ones those submit,
+ * finished. Must not be called from within a task.
+ * @param pool
+ */
+void jp_pool_wait(struct jp_pool *pool);
+
+/**
+ * Wait for all tasks, then stop the threads and free the pool.
+ * @param pool
+ */
+void jp_pool_free(struct jp_pool *pool);
+
+/**
+ * Like jp_match_limit(), but the children of large arrays and objects the
+ * path scans or slices are split into ranges which are matched on the
+ * threads of pool. Matches are reported on the calling thread, in the
+ * same order jp_match_limit() reports them.
+ * The document is only read and no references are taken, it must not be
+ * changed until the call returns.
+ * @param path
+ * @param input
+ * @param pool
+ * @param cb
+ * @param userdata
+ * @param max_results
+ * @return the first match, as jp_match_limit()
+ */
+struct json_object *jp_match_parallel(struct jp_opcode *path,
+                                      struct json_object *input,
+                                      struct jp_pool *pool,
+                                      jp_match_stop_cb_t cb, void *userdata,
+                                      int max_results);
+
 #ifdef	__cplusplus
 }
 #endif
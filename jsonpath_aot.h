@@ -0,0 +1,562 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __JSONPATH_AOT_H_
+#define __JSONPATH_AOT_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <json.h>
+
+#include "jsonpath.h"
+
+/*
+ * Runtime of the C code jsonpath_aot generates from expressions. Each
+ * path becomes nested loops over the json-c API, these helpers are what
+ * the loops iterate with. Everything is inline, generated code only needs
+ * json-c to link.
+ */
+
+#define JP_AOT_UNRESOLVED -1
+
+struct jp_aot_value {
+	int type;
+	int num;
+	const char *str;
+};
+
+struct jp_aot_ctx {
+	struct json_object *root;
+	struct json_object *res;
+	jp_match_cb_t cb;
+	void *priv;
+	struct jp_aot_value *hoisted;
+
+	/* a walk ran out of memory, every loop ends and nothing is reported */
+	bool stop;
+};
+
+/*
+ * Iterates the children a step selects: the members of an object, either
+ * all of them or those found by key, or the elements of an array, either
+ * a range or a list of indexes. Members have the index -1.
+ */
+struct jp_aot_iter {
+	struct json_object *obj;
+	struct lh_entry *ent;
+	struct lh_entry **ents;
+	const int *list;
+	const char *key;
+	int idx, bound, step, pos, n;
+};
+
+#define JP_AOT_WALK_BUF 32
+
+/* preorder walk over the containers below a value, for descents */
+struct jp_aot_walk {
+	struct json_object *first;
+	struct jp_aot_iter *pos;
+	int npos, apos;
+	struct jp_aot_iter buf[JP_AOT_WALK_BUF];
+};
+
+static inline void
+jp_aot_emit(struct jp_aot_ctx *ctx, struct json_object *val)
+{
+	if (ctx->stop)
+		return;
+
+	if (val && !ctx->res)
+		ctx->res = val;
+
+	if (ctx->cb)
+		ctx->cb(val, ctx->priv);
+}
+
+static inline struct jp_aot_value
+jp_aot_bool(bool val)
+{
+	return (struct jp_aot_value){ T_BOOL, val, NULL };
+}
+
+static inline struct jp_aot_value
+jp_aot_value(struct json_object *obj)
+{
+	switch (json_object_get_type(obj))
+	{
+	case json_type_boolean:
+		return jp_aot_bool(json_object_get_boolean(obj));
+
+	case json_type_int:
+		return (struct jp_aot_value){ T_NUMBER, json_object_get_int(obj) };
+
+	case json_type_string:
+		return (struct jp_aot_value){ T_STRING, 0, json_object_get_string(obj) };
+
+	default:
+		return (struct jp_aot_value){ 0 };
+	}
+}
+
+static inline bool
+jp_aot_delta(int cmp, int delta)
+{
+	switch (cmp)
+	{
+	case T_EQ: return (delta == 0);
+	case T_NE: return (delta != 0);
+	case T_LT: return (delta < 0);
+	case T_LE: return (delta <= 0);
+	case T_GT: return (delta > 0);
+	case T_GE: return (delta >= 0);
+	default:   return false;
+	}
+}
+
+static inline bool
+jp_aot_cmp(int cmp, struct jp_aot_value left, struct jp_aot_value right)
+{
+	if (left.type != right.type)
+		return false;
+
+	switch (left.type)
+	{
+	case T_BOOL:
+	case T_NUMBER:
+		return jp_aot_delta(cmp, left.num - right.num);
+
+	case T_STRING:
+		return jp_aot_delta(cmp, strcmp(left.str, right.str));
+
+	default:
+		return false;
+	}
+}
+
+/* compares the value a chain of lookups found with a literal of type */
+static inline bool
+jp_aot_test(struct json_object *obj, enum json_type type, int cmp,
+            int num, const char *str)
+{
+	if (json_object_get_type(obj) != type)
+		return false;
+
+	switch (type)
+	{
+	case json_type_boolean:
+		return jp_aot_delta(cmp, json_object_get_boolean(obj) - num);
+
+	case json_type_int:
+		return jp_aot_delta(cmp, json_object_get_int(obj) - num);
+
+	default:
+		return jp_aot_delta(cmp, strcmp(json_object_get_string(obj), str));
+	}
+}
+
+static inline struct json_object *
+jp_aot_index(struct json_object *obj, int idx)
+{
+	if (json_object_get_type(obj) != json_type_array)
+		return NULL;
+
+	if (idx < 0)
+		idx += json_object_array_length(obj);
+
+	return (idx >= 0) ? json_object_array_get_idx(obj, idx) : NULL;
+}
+
+static inline void
+jp_aot_scan(struct jp_aot_iter *it, struct json_object *obj)
+{
+	memset(it, 0, sizeof(*it));
+	it->idx = -1;
+	it->step = 1;
+
+	switch (json_object_get_type(obj))
+	{
+	case json_type_object:
+		it->ent = json_object_get_object(obj)->head;
+		break;
+
+	case json_type_array:
+		it->obj = obj;
+		it->bound = json_object_array_length(obj);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* the range of an array slice, as jp_slice_range() */
+static inline void
+jp_aot_slice(struct jp_aot_iter *it, struct json_object *obj,
+             bool has_start, int start, bool has_end, int end, int step)
+{
+	int len;
+
+	memset(it, 0, sizeof(*it));
+
+	if (json_object_get_type(obj) != json_type_array || !step)
+		return;
+
+	len = json_object_array_length(obj);
+
+	if (step > 0)
+	{
+		start = has_start ? start : 0;
+		end = has_end ? end : len;
+
+		if (start < 0)
+			start = (start + len < 0) ? 0 : start + len;
+
+		if (end < 0)
+			end = (end + len < 0) ? 0 : end + len;
+
+		if (end > len)
+			end = len;
+	}
+	else
+	{
+		start = has_start ? start : len - 1;
+		end = has_end ? end : -len - 1;
+
+		if (start < 0)
+			start = (start + len < -1) ? -1 : start + len;
+
+		if (end < 0)
+			end = (end + len < -1) ? -1 : end + len;
+
+		if (start >= len)
+			start = len - 1;
+	}
+
+	/* a step past the array only selects the first index */
+	if (step > len || step < -len)
+		step = (step > 0) ? (len ? len : 1) : (len ? -len : -1);
+
+	it->obj = obj;
+	it->idx = start - step;
+	it->bound = end;
+	it->step = step;
+}
+
+/*
+ * Elements at the listed ascending indexes of an array. Of an object all
+ * members are selected if all is set, as members have no index.
+ */
+static inline void
+jp_aot_indexes(struct jp_aot_iter *it, struct json_object *obj,
+               const int *list, int n, bool all)
+{
+	memset(it, 0, sizeof(*it));
+	it->idx = -1;
+
+	switch (json_object_get_type(obj))
+	{
+	case json_type_object:
+		if (all)
+			it->ent = json_object_get_object(obj)->head;
+
+		break;
+
+	case json_type_array:
+		it->obj = obj;
+		it->list = list;
+		it->n = n;
+		it->bound = json_object_array_length(obj);
+		break;
+
+	default:
+		break;
+	}
+}
+
+#define JP_AOT_KEYS_LOCKSTEP 8
+
+static inline int
+jp_aot_cmp_key(const void *a, const void *b)
+{
+	return strcmp((const char *)a, *(const char *const *)b);
+}
+
+/*
+ * Puts the members found by key into document order. A few members are
+ * followed through the list in lockstep until every member but the last
+ * one has met its successor. More are collected in one pass over the list
+ * up to the last of them, finding each key among the sorted keys.
+ */
+static inline void
+jp_aot_keys_order(struct lh_table *t, const char *const *keys, int nkeys,
+                  struct lh_entry **ents, int n)
+{
+	struct lh_entry *cur[JP_AOT_KEYS_LOCKSTEP], *sorted[JP_AOT_KEYS_LOCKSTEP];
+	int succ[JP_AOT_KEYS_LOCKSTEP], i, j, found = 0;
+	bool first[JP_AOT_KEYS_LOCKSTEP];
+	struct lh_entry *ent;
+
+	if (n > JP_AOT_KEYS_LOCKSTEP)
+	{
+		for (ent = t->head; ent && found < n; ent = ent->next)
+			if (bsearch(lh_entry_k(ent), keys, nkeys, sizeof(*keys),
+			            jp_aot_cmp_key))
+				ents[found++] = ent;
+
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		cur[i] = ents[i]->next;
+		succ[i] = -1;
+		first[i] = true;
+	}
+
+	while (found < n - 1)
+	{
+		for (i = 0; i < n; i++)
+		{
+			if (succ[i] >= 0 || !cur[i])
+				continue;
+
+			for (j = 0; j < n && cur[i] != ents[j]; j++)
+				;
+
+			if (j < n)
+			{
+				succ[i] = j;
+				first[j] = false;
+				found++;
+			}
+			else
+			{
+				cur[i] = cur[i]->next;
+			}
+		}
+	}
+
+	for (i = 0; !first[i]; i++)
+		;
+
+	for (j = 0; j < n; j++, i = succ[i])
+		sorted[j] = ents[i];
+
+	memcpy(ents, sorted, n * sizeof(*ents));
+}
+
+/* members named by a key union, keys sorted, ents has room for all n */
+static inline void
+jp_aot_keys(struct jp_aot_iter *it, struct json_object *obj,
+            const char *const *keys, int n, struct lh_entry **ents)
+{
+	struct lh_entry *ent;
+	struct lh_table *t;
+	int i;
+
+	memset(it, 0, sizeof(*it));
+	it->idx = -1;
+
+	if (json_object_get_type(obj) != json_type_object)
+		return;
+
+	t = json_object_get_object(obj);
+
+	for (i = 0; i < n; i++)
+		if ((ent = lh_table_lookup_entry(t, keys[i])) != NULL)
+			ents[it->n++] = ent;
+
+	if (it->n > 1)
+		jp_aot_keys_order(t, keys, n, ents, it->n);
+
+	it->ents = ents;
+}
+
+static inline bool
+jp_aot_next(struct jp_aot_iter *it, struct json_object **val)
+{
+	if (it->ent)
+	{
+		it->key = lh_entry_k(it->ent);
+		*val = (struct json_object *)lh_entry_v(it->ent);
+		it->ent = it->ent->next;
+
+		return true;
+	}
+
+	if (it->ents)
+	{
+		if (it->pos >= it->n)
+			return false;
+
+		it->key = lh_entry_k(it->ents[it->pos]);
+		*val = (struct json_object *)lh_entry_v(it->ents[it->pos]);
+		it->pos++;
+
+		return true;
+	}
+
+	if (it->list)
+	{
+		while (it->pos < it->n)
+		{
+			it->idx = it->list[it->pos++];
+
+			if (it->idx < 0)
+				continue;
+
+			if (it->idx >= it->bound)
+				break;
+
+			*val = json_object_array_get_idx(it->obj, it->idx);
+
+			return true;
+		}
+
+		return false;
+	}
+
+	if (!it->obj)
+		return false;
+
+	it->idx += it->step;
+
+	if ((it->step > 0) ? (it->idx >= it->bound) : (it->idx <= it->bound))
+		return false;
+
+	*val = json_object_array_get_idx(it->obj, it->idx);
+
+	return true;
+}
+
+static inline bool
+jp_aot_is_container(struct json_object *obj)
+{
+	switch (json_object_get_type(obj))
+	{
+	case json_type_object:
+	case json_type_array:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static inline bool
+jp_aot_walk_push(struct jp_aot_walk *w, struct json_object *obj)
+{
+	struct jp_aot_iter *pos;
+
+	if (w->npos == w->apos)
+	{
+		if (w->pos == w->buf)
+		{
+			pos = malloc(w->apos * 2 * sizeof(*pos));
+
+			if (pos)
+				memcpy(pos, w->buf, w->npos * sizeof(*pos));
+		}
+		else
+		{
+			pos = realloc(w->pos, w->apos * 2 * sizeof(*pos));
+		}
+
+		if (!pos)
+			return false;
+
+		w->pos = pos;
+		w->apos *= 2;
+	}
+
+	jp_aot_scan(&w->pos[w->npos++], obj);
+
+	return true;
+}
+
+/* starts a walk, positions allocated by an earlier walk are reused */
+static inline void
+jp_aot_walk_start(struct jp_aot_walk *w, struct json_object *obj)
+{
+	if (!w->pos)
+	{
+		w->pos = w->buf;
+		w->apos = JP_AOT_WALK_BUF;
+	}
+
+	w->npos = 0;
+	w->first = NULL;
+
+	/* the first position always fits, the buffer holds several */
+	if (jp_aot_is_container(obj))
+	{
+		w->first = obj;
+		jp_aot_walk_push(w, obj);
+	}
+}
+
+/*
+ * Yields the value the walk started at, then each container below it.
+ * Running out of memory for deeper positions stops the whole match.
+ */
+static inline bool
+jp_aot_walk_next(struct jp_aot_ctx *ctx, struct jp_aot_walk *w,
+                 struct json_object **val)
+{
+	struct json_object *child;
+
+	if (w->first)
+	{
+		*val = w->first;
+		w->first = NULL;
+
+		return true;
+	}
+
+	while (w->npos > 0)
+	{
+		if (!jp_aot_next(&w->pos[w->npos - 1], &child))
+		{
+			w->npos--;
+			continue;
+		}
+
+		if (jp_aot_is_container(child))
+		{
+			if (!jp_aot_walk_push(w, child))
+			{
+				ctx->stop = true;
+				return false;
+			}
+
+			*val = child;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static inline void
+jp_aot_walk_free(struct jp_aot_walk *w)
+{
+	if (w->pos && w->pos != w->buf)
+		free(w->pos);
+}
+
+#endif /* __JSONPATH_AOT_H_ */
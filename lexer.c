@@ -17,6 +17,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <ctype.h>
 
 #include "ast.h"
@@ -24,11 +25,20 @@
 #include "jsonpath.h"
 
 
+/* whitespace, which is consumed without producing a token */
+#define T_SPACE -1
+
+/*
+ * Tokens are found by their first byte. Bytes starting both a one and a
+ * two byte token give the second byte of the longer one in next, bytes
+ * only valid as the start of a two byte token have no type of their own.
+ */
 struct token {
 	int type;
-	const char *pat;
-	int plen;
-	int (*parse)(const char *buf, struct jp_opcode *op, struct jp_state *s);
+	char next;
+	int type2;
+	int (*parse)(const char *buf, const char *end, struct jp_opcode *op,
+	             struct jp_state *s);
 };
 
 #define dec(o) \
@@ -39,281 +49,221 @@ struct token {
 		(((x) >= 'A') ? (10 + (x) - 'A') : dec(x)))
 
 /*
- * Stores the given codepoint as a utf8 multibyte sequence into the given
- * output buffer and substracts the required amount of bytes from  the given
- * length pointer.
- *
- * Returns false if the multibyte sequence would not fit into the buffer,
- * otherwise true.
+ * Stores the given codepoint as a utf8 multibyte sequence at the given
+ * output pointer and advances it. No sequence is longer than the escape
+ * it was written as, so literals are decoded in place.
  */
 
-static bool
-utf8enc(char **out, int *rem, int code)
+static void
+utf8enc(char **out, int code)
 {
 	if (code > 0 && code <= 0x7F)
 	{
-		if (*rem < 1)
-			return false;
-
-		*(*out++) = code; (*rem)--;
-		return true;
+		*(*out)++ = code;
 	}
 	else if (code > 0 && code <= 0x7FF)
 	{
-		if (*rem < 2)
-			return false;
-
-		*(*out)++ = ((code >>  6) & 0x1F) | 0xC0; (*rem)--;
-		*(*out)++ = ( code        & 0x3F) | 0x80; (*rem)--;
-		return true;
+		*(*out)++ = ((code >>  6) & 0x1F) | 0xC0;
+		*(*out)++ = ( code        & 0x3F) | 0x80;
 	}
 	else if (code > 0 && code <= 0xFFFF)
 	{
-		if (*rem < 3)
-			return false;
-
-		*(*out)++ = ((code >> 12) & 0x0F) | 0xE0; (*rem)--;
-		*(*out)++ = ((code >>  6) & 0x3F) | 0x80; (*rem)--;
-		*(*out)++ = ( code        & 0x3F) | 0x80; (*rem)--;
-		return true;
+		*(*out)++ = ((code >> 12) & 0x0F) | 0xE0;
+		*(*out)++ = ((code >>  6) & 0x3F) | 0x80;
+		*(*out)++ = ( code        & 0x3F) | 0x80;
 	}
 	else if (code > 0 && code <= 0x10FFFF)
 	{
-		if (*rem < 4)
-			return false;
-
-		*(*out)++ = ((code >> 18) & 0x07) | 0xF0; (*rem)--;
-		*(*out)++ = ((code >> 12) & 0x3F) | 0x80; (*rem)--;
-		*(*out)++ = ((code >>  6) & 0x3F) | 0x80; (*rem)--;
-		*(*out)++ = ( code        & 0x3F) | 0x80; (*rem)--;
-		return true;
+		*(*out)++ = ((code >> 18) & 0x07) | 0xF0;
+		*(*out)++ = ((code >> 12) & 0x3F) | 0x80;
+		*(*out)++ = ((code >>  6) & 0x3F) | 0x80;
+		*(*out)++ = ( code        & 0x3F) | 0x80;
 	}
-
-	return true;
 }
 
 
 /*
- * Parses a string literal from the given buffer.
- *
- * Returns a negative value on error, otherwise the amount of consumed
- * characters from the given buffer.
+ * Decodes the escape sequences of a NUL terminated string literal in
+ * place.
  *
- * Error values:
- *  -1	Unterminated string
- *  -2	Invalid escape sequence
- *  -3	String literal too long
+ * Returns the offset of the first invalid escape sequence, or -1 if all
+ * of them were valid.
  */
 
 static int
-parse_string(const char *buf, struct jp_opcode *op, struct jp_state *s)
+unescape(char *str)
 {
-	char q = *(buf++);
-	char str[128] = { 0 };
 	char *out = str;
-	const char *in = buf;
-	bool esc = false;
-	int rem = sizeof(str) - 1;
+	const char *in = str;
 	int code;
 
 	while (*in)
 	{
-		/* continuation of escape sequence */
-		if (esc)
+		/* ordinary char */
+		if (*in != '\\')
 		{
-			/* \uFFFF */
-			if (in[0] == 'u')
-			{
-				if (isxdigit(in[1]) && isxdigit(in[2]) &&
-				    isxdigit(in[3]) && isxdigit(in[4]))
-				{
-					if (!utf8enc(&out, &rem,
-					             hex(in[1]) * 16 * 16 * 16 +
-					             hex(in[2]) * 16 * 16 +
-					             hex(in[3]) * 16 +
-					             hex(in[4])))
-					{
-						s->error_pos = s->off + (in - buf);
-						return -3;
-					}
-
-					in += 5;
-				}
-				else
-				{
-					s->error_pos = s->off + (in - buf);
-					return -2;
-				}
-			}
+			*out++ = *in++;
+			continue;
+		}
 
-			/* \xFF */
-			else if (in[0] == 'x')
+		in++;
+
+		/* ￿ */
+		if (in[0] == 'u')
+		{
+			if (!isxdigit(in[1]) || !isxdigit(in[2]) ||
+			    !isxdigit(in[3]) || !isxdigit(in[4]))
+				return in - str;
+
+			utf8enc(&out, hex(in[1]) * 16 * 16 * 16 +
+			              hex(in[2]) * 16 * 16 +
+			              hex(in[3]) * 16 +
+			              hex(in[4]));
+			in += 5;
+		}
+
+		/* \xFF */
+		else if (in[0] == 'x')
+		{
+			if (!isxdigit(in[1]) || !isxdigit(in[2]))
+				return in - str;
+
+			utf8enc(&out, hex(in[1]) * 16 + hex(in[2]));
+			in += 3;
+		}
+
+		/* \377, \77 or \7 */
+		else if (in[0] >= '0' && in[0] <= '7')
+		{
+			/* \377 */
+			if (in[1] >= '0' && in[1] <= '7' &&
+			    in[2] >= '0' && in[2] <= '7')
 			{
-				if (isxdigit(in[1]) && isxdigit(in[2]))
-				{
-					if (!utf8enc(&out, &rem, hex(in[1]) * 16 + hex(in[2])))
-					{
-						s->error_pos = s->off + (in - buf);
-						return -3;
-					}
-
-					in += 3;
-				}
-				else
-				{
-					s->error_pos = s->off + (in - buf);
-					return -2;
-				}
+				code = dec(in[0]) * 8 * 8 +
+				       dec(in[1]) * 8 +
+				       dec(in[2]);
+
+				if (code > 255)
+					return in - str;
+
+				utf8enc(&out, code);
+				in += 3;
 			}
 
-			/* \377, \77 or \7 */
-			else if (in[0] >= '0' && in[0] <= '7')
+			/* \77 */
+			else if (in[1] >= '0' && in[1] <= '7')
 			{
-				/* \377 */
-				if (in[1] >= '0' && in[1] <= '7' &&
-				    in[2] >= '0' && in[2] <= '7')
-				{
-					code = dec(in[0]) * 8 * 8 +
-					       dec(in[1]) * 8 +
-					       dec(in[2]);
-
-					if (code > 255)
-					{
-						s->error_pos = s->off + (in - buf);
-						return -2;
-					}
-
-					if (!utf8enc(&out, &rem, code))
-					{
-						s->error_pos = s->off + (in - buf);
-						return -3;
-					}
-
-					in += 3;
-				}
-
-				/* \77 */
-				else if (in[1] >= '0' && in[1] <= '7')
-				{
-					if (!utf8enc(&out, &rem, dec(in[0]) * 8 + dec(in[1])))
-					{
-						s->error_pos = s->off + (in - buf);
-						return -3;
-					}
-
-					in += 2;
-				}
-
-				/* \7 */
-				else
-				{
-					if (!utf8enc(&out, &rem, dec(in[0])))
-					{
-						s->error_pos = s->off + (in - buf);
-						return -3;
-					}
-
-					in += 1;
-				}
+				utf8enc(&out, dec(in[0]) * 8 + dec(in[1]));
+				in += 2;
 			}
 
-			/* single character escape */
+			/* \7 */
 			else
 			{
-				if (rem-- < 1)
-				{
-					s->error_pos = s->off + (in - buf);
-					return -3;
-				}
-
-				switch (in[0])
-				{
-				case 'a': *out = '\a'; break;
-				case 'b': *out = '\b'; break;
-				case 'e': *out = '\e'; break;
-				case 'f': *out = '\f'; break;
-				case 'n': *out = '\n'; break;
-				case 'r': *out = '\r'; break;
-				case 't': *out = '\t'; break;
-				case 'v': *out = '\v'; break;
-				default:  *out = *in; break;
-				}
-
-				in++;
-				out++;
+				utf8enc(&out, dec(in[0]));
+				in += 1;
 			}
-
-			esc = false;
-		}
-
-		/* begin of escape sequence */
-		else if (*in == '\\')
-		{
-			in++;
-			esc = true;
 		}
 
-		/* terminating quote */
-		else if (*in == q)
-		{
-			op->str = strdup(str);
-			return (in - buf) + 2;
-		}
-
-		/* ordinary char */
+		/* single character escape */
 		else
 		{
-			if (rem-- < 1)
+			switch (in[0])
 			{
-				s->error_pos = s->off + (in - buf);
-				return -3;
+			case 'a': *out = '\a'; break;
+			case 'b': *out = '\b'; break;
+			case 'e': *out = '\e'; break;
+			case 'f': *out = '\f'; break;
+			case 'n': *out = '\n'; break;
+			case 'r': *out = '\r'; break;
+			case 't': *out = '\t'; break;
+			case 'v': *out = '\v'; break;
+			default:  *out = *in; break;
 			}
 
-			*out++ = *in++;
+			in++;
+			out++;
 		}
 	}
 
+	*out = 0;
+
 	return -1;
 }
 
 
 /*
- * Parses a label from the given buffer.
+ * Parses a string literal from the given buffer. The literal is copied
+ * once, straight from the expression into the state, and only decoded
+ * there if it contains escape sequences.
  *
  * Returns a negative value on error, otherwise the amount of consumed
  * characters from the given buffer.
  *
  * Error values:
- *  -3	Label too long
+ *  -1	Unterminated string
+ *  -2	Invalid escape sequence
  */
 
 static int
-parse_label(const char *buf, struct jp_opcode *op, struct jp_state *s)
+parse_string(const char *buf, const char *end, struct jp_opcode *op,
+             struct jp_state *s)
 {
-	char str[128] = { 0 };
-	char *out = str;
-	const char *in = buf;
-	int rem = sizeof(str) - 1;
+	char q = *(buf++);
+	const char *in;
+	bool esc = false;
+	int err;
 
-	while (*in == '_' || isalnum(*in))
+	for (in = buf; in < end && *in != q; in++)
 	{
-		if (rem-- < 1)
+		if (*in == '\\')
 		{
-			s->error_pos = s->off + (in - buf);
-			return -3;
+			esc = true;
+
+			if (++in == end)
+				break;
 		}
+	}
+
+	if (in >= end)
+		return -1;
 
-		*out++ = *in++;
+	op->str = jp_alloc_str(s, buf, in - buf);
+
+	if (esc && (err = unescape(op->str)) >= 0)
+	{
+		s->error_pos = s->off + err;
+		return -2;
 	}
 
-	if (!strcmp(str, "true") || !strcmp(str, "false"))
+	return (in - buf) + 2;
+}
+
+
+/*
+ * Parses a label from the given buffer.
+ *
+ * Returns the amount of consumed characters from the given buffer.
+ */
+
+static int
+parse_label(const char *buf, const char *end, struct jp_opcode *op,
+            struct jp_state *s)
+{
+	const char *in = buf;
+
+	while (in < end && (*in == '_' || isalnum(*in)))
+		in++;
+
+	if ((in - buf == 4 && !memcmp(buf, "true", 4)) ||
+	    (in - buf == 5 && !memcmp(buf, "false", 5)))
 	{
-		op->num = (str[0] == 't');
+		op->num = (buf[0] == 't');
 		op->type = T_BOOL;
 	}
 	else
 	{
-		op->str = strdup(str);
+		op->str = jp_alloc_str(s, buf, in - buf);
 	}
 
 	return (in - buf);
@@ -321,7 +271,8 @@ parse_label(const char *buf, struct jp_opcode *op, struct jp_state *s)
 
 
 /*
- * Parses a number literal from the given buffer.
+ * Parses a number literal from the given buffer. Values out of range
+ * saturate to the limits of an int.
  *
  * Returns a negative value on error, otherwise the amount of consumed
  * characters from the given buffer.
@@ -331,54 +282,65 @@ parse_label(const char *buf, struct jp_opcode *op, struct jp_state *s)
  */
 
 static int
-parse_number(const char *buf, struct jp_opcode *op, struct jp_state *s)
+parse_number(const char *buf, const char *end, struct jp_opcode *op,
+             struct jp_state *s)
 {
-	char *e;
-	int n = strtol(buf, &e, 10);
+	const char *in = buf;
+	bool neg = (*in == '-');
+	long long n = 0;
 
-	if (e == buf)
+	if (neg)
+		in++;
+
+	if (in == end || !isdigit(*in))
 	{
 		s->error_pos = s->off;
 		return -2;
 	}
 
-	op->num = n;
+	for (; in < end && isdigit(*in); in++)
+		if (n <= INT_MAX)
+			n = n * 10 + dec(*in);
 
-	return (e - buf);
+	if (neg)
+		op->num = (n > INT_MAX) ? INT_MIN : -n;
+	else
+		op->num = (n > INT_MAX) ? INT_MAX : n;
+
+	return (in - buf);
 }
 
-static const struct token tokens[] = {
-	{ 0,			" ",     1 },
-	{ 0,			"\t",    1 },
-	{ 0,			"\n",    1 },
-	{ T_LE,			"<=",    2 },
-	{ T_GE,			">=",    2 },
-	{ T_NE,			"!=",    2 },
-	{ T_AND,		"&&",    2 },
-	{ T_OR,			"||",    2 },
-	{ T_DOT,		".",     1 },
-	{ T_BROPEN,		"[",     1 },
-	{ T_BRCLOSE,	"]",     1 },
-	{ T_POPEN,		"(",     1 },
-	{ T_PCLOSE,		")",     1 },
-	{ T_UNION,		",",     1 },
-	{ T_ROOT,		"$",     1 },
-	{ T_THIS,		"@",     1 },
-	{ T_LT,			"<",     1 },
-	{ T_GT,			">",     1 },
-	{ T_EQ,			"=",     1 },
-	{ T_NOT,		"!",     1 },
-	{ T_WILDCARD,	"*",     1 },
-	{ T_STRING,		"'",	 1, parse_string },
-	{ T_STRING,		"\"",	 1, parse_string },
-	{ T_LABEL,		"_",     1, parse_label  },
-	{ T_LABEL,		"az",    0, parse_label  },
-	{ T_LABEL,		"AZ",    0, parse_label  },
-	{ T_NUMBER,		"-",     1, parse_number },
-	{ T_NUMBER,		"09",    0, parse_number },
+static const struct token tokens[256] = {
+	[' ']			= { T_SPACE },
+	['\t']			= { T_SPACE },
+	['\n']			= { T_SPACE },
+	['<']			= { T_LT,       '=', T_LE },
+	['>']			= { T_GT,       '=', T_GE },
+	['!']			= { T_NOT,      '=', T_NE },
+	['&']			= { 0,          '&', T_AND },
+	['|']			= { 0,          '|', T_OR },
+	['.']			= { T_DOT,      '.', T_DOTDOT },
+	['[']			= { T_BROPEN },
+	[']']			= { T_BRCLOSE },
+	['(']			= { T_POPEN },
+	[')']			= { T_PCLOSE },
+	[',']			= { T_UNION },
+	['$']			= { T_ROOT },
+	['@']			= { T_THIS },
+	['=']			= { T_EQ },
+	['*']			= { T_WILDCARD },
+	['?']			= { T_FILTER },
+	[':']			= { T_COLON },
+	['\'']			= { T_STRING, .parse = parse_string },
+	['"']			= { T_STRING, .parse = parse_string },
+	['_']			= { T_LABEL,  .parse = parse_label },
+	['a' ... 'z']	= { T_LABEL,  .parse = parse_label },
+	['A' ... 'Z']	= { T_LABEL,  .parse = parse_label },
+	['-']			= { T_NUMBER, .parse = parse_number },
+	['0' ... '9']	= { T_NUMBER, .parse = parse_number },
 };
 
-const char *jp_tokennames[23] = {
+const char *jp_tokennames[26] = {
 	[0]				= "End of file",
 	[T_AND]			= "'&&'",
 	[T_OR]			= "'||'",
@@ -402,48 +364,51 @@ const char *jp_tokennames[23] = {
 	[T_STRING]		= "String",
 	[T_POPEN]		= "'('",
 	[T_PCLOSE]		= "')'",
+	[T_DOTDOT]		= "'..'",
+	[T_FILTER]		= "'?'",
+	[T_COLON]		= "':'",
 };
 
 
 static int
-match_token(const char *ptr, struct jp_opcode *op, struct jp_state *s)
+match_token(const char *ptr, const char *end, struct jp_opcode *op,
+            struct jp_state *s)
 {
-	int i;
-	const struct token *tok;
+	const struct token *tok = &tokens[(unsigned char)*ptr];
 
-	for (i = 0, tok = &tokens[0];
-	     i < sizeof(tokens) / sizeof(tokens[0]);
-		 i++, tok = &tokens[i])
+	if (tok->next && ptr + 1 < end && ptr[1] == tok->next)
 	{
-		if ((tok->plen > 0 && !strncmp(ptr, tok->pat, tok->plen)) ||
-		    (tok->plen == 0 && *ptr >= tok->pat[0] && *ptr <= tok->pat[1]))
-		{
-			op->type = tok->type;
-
-			if (tok->parse)
-				return tok->parse(ptr, op, s);
+		op->type = tok->type2;
+		return 2;
+	}
 
-			return tok->plen;
-		}
+	if (!tok->type)
+	{
+		s->error_pos = s->off;
+		return -4;
 	}
 
-	s->error_pos = s->off;
-	return -4;
+	op->type = tok->type;
+
+	if (tok->parse)
+		return tok->parse(ptr, end, op, s);
+
+	return 1;
 }
 
 struct jp_opcode *
-jp_get_token(struct jp_state *s, const char *input, int *mlen)
+jp_get_token(struct jp_state *s, const char *input, size_t len, int *mlen)
 {
 	struct jp_opcode op = { 0 };
 
-	*mlen = match_token(input, &op, s);
+	*mlen = match_token(input, input + len, &op, s);
 
 	if (*mlen < 0)
 	{
 		s->error_code = *mlen;
 		return NULL;
 	}
-	else if (op.type == 0)
+	else if (op.type == T_SPACE)
 	{
 		return NULL;
 	}
@@ -20,6 +20,6 @@
 #include "ast.h"
 
 struct jp_opcode *
-jp_get_token(struct jp_state *s, const char *input, int *mlen);
+jp_get_token(struct jp_state *s, const char *input, size_t len, int *mlen);
 
 #endif /* __LEXER_H_ */
@@ -15,20 +15,28 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <json.h>
 
 #include "jsonpath.h"
 
-#include <libubox/list.h>
-
-struct match_item {
-       struct json_object *jsobj;
-       struct list_head list;
+struct pattern {
+	int opt;
+	int limit;
+	char *expr;
+	const char *sep;
+	struct jp_state *state;
+	struct jp_results matches;
 };
 
 struct karl_matching_state_example {
@@ -45,18 +53,26 @@ print_usage(char *app)
 	"  -h, --help	Print this help\n"
 	"  -i path	Specify a JSON file to parse\n"
 	"  -s \"json\"	Specify a JSON string to parse\n"
+	"  -S		Stream the input, evaluating patterns without loading\n"
+	"		the whole document\n"
+	"  --lines	Treat each line of the input as a document of its own\n"
+	"		and match all patterns against every one of them\n"
+	"  -j, --jobs n	Match on n threads, 0 for one per CPU\n"
+	"  --ordered	Keep the output of parallel jobs in input order\n"
 	"  -l limit	Specify max number of results to show\n"
 	"  -F separator	Specify a field separator when using export\n"
 	"  -t <pattern>	Print the type of values matched by pattern\n"
 	"  -e <pattern>	Print the values matched by pattern\n"
-	"  -e VAR=<pat>	Serialize matched value for shell \"eval\"\n\n"
+	"  -e VAR=<pat>	Serialize matched value for shell \"eval\"\n"
+	"  -x <pattern>	Explain how pattern is matched and estimate its cost\n\n"
 	"== Patterns ==\n\n"
 	"  Patterns are JsonPath: http://goessner.net/articles/JsonPath/\n"
-	"  This tool implements $, @, [], * and the union operator ','\n"
-	"  plus the usual expressions and literals.\n"
-	"  It does not support the recursive child search operator '..' or\n"
-	"  the '?()' and '()' filter expressions as those would require a\n"
-	"  complete JavaScript engine to support them.\n\n"
+	"  This tool implements $, @, [], *, array slices [start:end:step],\n"
+	"  the recursive child search operator '..' and the union operator\n"
+	"  ',' plus the usual expressions and literals.\n"
+	"  Filters may be written as [?(expr)] or simply as [expr].\n"
+	"  It does not support '()' script expressions as those would\n"
+	"  require a complete JavaScript engine to support them.\n\n"
 	"== Examples ==\n\n"
 	"  Display the first IPv4 address on lan:\n"
 	"  # ifstatus lan | %s -e '@[\"ipv4-address\"][0].address'\n\n"
@@ -64,54 +80,112 @@ print_usage(char *app)
 	"  # ubus call system board | %s -e '@.release.description'\n\n"
 	"  Find all interfaces which are up:\n"
 	"  # ubus call network.interface dump | \\\n"
-	"  	%s -e '@.interface[@.up=true].interface'\n\n"
+	"  	%s -e '@.interface[?(@.up=true)].interface'\n\n"
 	"  Export br-lan traffic counters for shell eval:\n"
 	"  # devstatus br-lan | %s -e 'RX=@.statistics.rx_bytes' \\\n"
 	"	-e 'TX=@.statistics.tx_bytes'\n",
 		app, app, app, app, app);
 }
 
+/* mapped files are handed out in slices of this size */
+#define READ_SLICE	(1024 * 1024)
+
+/* pipes deliver at most their capacity per read() */
+#define READ_BUF	(64 * 1024)
+
+typedef int (*feed_cb_t)(const char *buf, size_t len, void *priv);
+
+/*
+ * Passes the rest of the input to feed until it returns non-zero, which is
+ * then returned. Regular files are mapped instead of copied through a
+ * buffer, anything else is read in large chunks.
+ */
+static int
+read_input(FILE *fd, feed_cb_t feed, void *priv)
+{
+	static char buf[READ_BUF];
+	struct stat s;
+	size_t len;
+	off_t off;
+	char *map;
+	int rv = 0;
+
+	if (!fstat(fileno(fd), &s) && S_ISREG(s.st_mode) &&
+	    (off = ftello(fd)) >= 0 && off < s.st_size)
+	{
+		map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fileno(fd), 0);
+
+		if (map != MAP_FAILED)
+		{
+			madvise(map, s.st_size, MADV_SEQUENTIAL);
+
+			for (; !rv && off < s.st_size; off += len)
+			{
+				len = s.st_size - off;
+
+				if (len > READ_SLICE)
+					len = READ_SLICE;
+
+				rv = feed(map + off, len, priv);
+			}
+
+			munmap(map, s.st_size);
+			fseeko(fd, off, SEEK_SET);
+
+			return rv;
+		}
+	}
+
+	while (!rv && (len = fread(buf, 1, sizeof(buf), fd)) > 0)
+		rv = feed(buf, len, priv);
+
+	return rv;
+}
+
+struct parse_state {
+	struct json_tokener *tok;
+	struct json_object *obj;
+	enum json_tokener_error err;
+};
+
+static int
+parse_feed(const char *buf, size_t len, void *priv)
+{
+	struct parse_state *ps = priv;
+
+	ps->obj = json_tokener_parse_ex(ps->tok, buf, len);
+	ps->err = json_tokener_get_error(ps->tok);
+
+	return (ps->err != json_tokener_continue);
+}
+
 static struct json_object *
 parse_json(FILE *fd, const char *source, const char **error)
 {
-	int len;
-	char buf[256];
-	struct json_object *obj = NULL;
-	struct json_tokener *tok = json_tokener_new();
-	enum json_tokener_error err = json_tokener_continue;
+	struct parse_state ps = { .err = json_tokener_continue };
+
+	ps.tok = json_tokener_new();
 
-	if (!tok)
+	if (!ps.tok)
 		return NULL;
 
 	if (source)
-	{
-		obj = json_tokener_parse_ex(tok, source, strlen(source));
-		err = json_tokener_get_error(tok);
-	}
+		parse_feed(source, strlen(source), &ps);
 	else
-	{
-		while ((len = fread(buf, 1, sizeof(buf), fd)) > 0)
-		{
-			obj = json_tokener_parse_ex(tok, buf, len);
-			err = json_tokener_get_error(tok);
+		read_input(fd, parse_feed, &ps);
 
-			if (!err || err != json_tokener_continue)
-				break;
-		}
-	}
-
-	json_tokener_free(tok);
+	json_tokener_free(ps.tok);
 
-	if (err)
+	if (ps.err)
 	{
-		if (err == json_tokener_continue)
-			err = json_tokener_error_parse_eof;
+		if (ps.err == json_tokener_continue)
+			ps.err = json_tokener_error_parse_eof;
 
-		*error = json_tokener_error_desc(err);
+		*error = json_tokener_error_desc(ps.err);
 		return NULL;
 	}
 
-	return obj;
+	return ps.obj;
 }
 
 static void karl_test_cb(struct json_object *item, void *userdata)
@@ -161,44 +235,44 @@ out:
 
 
 static void
-print_string(const char *s)
+print_string(FILE *out, const char *s)
 {
 	const char *p;
 
-	printf("'");
+	fprintf(out, "'");
 
 	for (p = s; *p; p++)
 	{
 		if (*p == '\'')
-			printf("'\"'\"'");
+			fprintf(out, "'\"'\"'");
 		else
-			printf("%c", *p);
+			fprintf(out, "%c", *p);
 	}
 
-	printf("'");
+	fprintf(out, "'");
 }
 
 static void
-print_separator(const char *sep, int *sc, int sl)
+print_separator(FILE *out, const char *sep, int *sc, int sl)
 {
 	if (*sc > 0)
 	{
 		switch (sep[(*sc - 1) % sl])
 		{
 		case '"':
-			printf("'\"'");
+			fprintf(out, "'\"'");
 			break;
 
 		case '\'':
-			printf("\"'\"");
+			fprintf(out, "\"'\"");
 			break;
 
 		case ' ':
-			printf("\\ ");
+			fprintf(out, "\\ ");
 			break;
 
 		default:
-			printf("%c", sep[(*sc - 1) % sl]);
+			fprintf(out, "%c", sep[(*sc - 1) % sl]);
 		}
 	}
 
@@ -206,66 +280,68 @@ print_separator(const char *sep, int *sc, int sl)
 }
 
 static void
-export_value(struct list_head *matches, const char *prefix, const char *sep,
-             int limit)
+export_value(FILE *out, struct jp_results *matches, const char *prefix,
+             const char *sep, int limit)
 {
-	int n, len;
+	int i, n, len;
 	int sc = 0, sl = strlen(sep);
-	struct match_item *item;
+	struct json_object *item;
 
-	if (list_empty(matches))
+	if (!matches->count)
 		return;
 
 	if (prefix)
 	{
-		printf("export %s=", prefix);
+		fprintf(out, "export %s=", prefix);
 
-		list_for_each_entry(item, matches, list)
+		for (i = 0; i < matches->count; i++)
 		{
 			if (limit-- <= 0)
 				break;
 
-			switch (json_object_get_type(item->jsobj))
+			item = matches->items[i];
+
+			switch (json_object_get_type(item))
 			{
 			case json_type_object:
 				; /* a label can only be part of a statement */
-				json_object_object_foreach(item->jsobj, key, val)
+				json_object_object_foreach(item, key, val)
 				{
 					if (!val)
 						continue;
 
-					print_separator(sep, &sc, sl);
-					print_string(key);
+					print_separator(out, sep, &sc, sl);
+					print_string(out, key);
 				}
 				break;
 
 			case json_type_array:
-				for (n = 0, len = json_object_array_length(item->jsobj);
+				for (n = 0, len = json_object_array_length(item);
 				     n < len; n++)
 				{
-					print_separator(sep, &sc, sl);
-					printf("%d", n);
+					print_separator(out, sep, &sc, sl);
+					fprintf(out, "%d", n);
 				}
 				break;
 
 			case json_type_boolean:
-				print_separator(sep, &sc, sl);
-				printf("%d", json_object_get_boolean(item->jsobj));
+				print_separator(out, sep, &sc, sl);
+				fprintf(out, "%d", json_object_get_boolean(item));
 				break;
 
 			case json_type_int:
-				print_separator(sep, &sc, sl);
-				printf("%d", json_object_get_int(item->jsobj));
+				print_separator(out, sep, &sc, sl);
+				fprintf(out, "%d", json_object_get_int(item));
 				break;
 
 			case json_type_double:
-				print_separator(sep, &sc, sl);
-				printf("%f", json_object_get_double(item->jsobj));
+				print_separator(out, sep, &sc, sl);
+				fprintf(out, "%f", json_object_get_double(item));
 				break;
 
 			case json_type_string:
-				print_separator(sep, &sc, sl);
-				print_string(json_object_get_string(item->jsobj));
+				print_separator(out, sep, &sc, sl);
+				print_string(out, json_object_get_string(item));
 				break;
 
 			case json_type_null:
@@ -273,27 +349,29 @@ export_value(struct list_head *matches, const char *prefix, const char *sep,
 			}
 		}
 
-		printf("; ");
+		fprintf(out, "; ");
 	}
 	else
 	{
-		list_for_each_entry(item, matches, list)
+		for (i = 0; i < matches->count; i++)
 		{
 			if (limit-- <= 0)
 				break;
 
-			switch (json_object_get_type(item->jsobj))
+			item = matches->items[i];
+
+			switch (json_object_get_type(item))
 			{
 			case json_type_object:
 			case json_type_array:
 			case json_type_boolean:
 			case json_type_int:
 			case json_type_double:
-				printf("%s\n", json_object_to_json_string(item->jsobj));
+				fprintf(out, "%s\n", json_object_to_json_string(item));
 				break;
 
 			case json_type_string:
-				printf("%s\n", json_object_get_string(item->jsobj));
+				fprintf(out, "%s\n", json_object_get_string(item));
 				break;
 
 			case json_type_null:
@@ -304,10 +382,10 @@ export_value(struct list_head *matches, const char *prefix, const char *sep,
 }
 
 static void
-export_type(struct list_head *matches, const char *prefix, int limit)
+export_type(FILE *out, struct jp_results *matches, const char *prefix, int limit)
 {
+	int i;
 	bool first = true;
-	struct match_item *item;
 	const char *types[] = {
 		"null",
 		"boolean",
@@ -318,46 +396,45 @@ export_type(struct list_head *matches, const char *prefix, int limit)
 		"string"
 	};
 
-	if (list_empty(matches))
+	if (!matches->count)
 		return;
 
 	if (prefix)
-		printf("export %s=", prefix);
+		fprintf(out, "export %s=", prefix);
 
-	list_for_each_entry(item, matches, list)
+	for (i = 0; i < matches->count; i++)
 	{
-		if (!first)
-			printf("\\ ");
-
 		if (limit-- <= 0)
 			break;
 
-		printf("%s", types[json_object_get_type(item->jsobj)]);
+		if (!first)
+			fprintf(out, "\\ ");
+
+		fprintf(out, "%s", types[json_object_get_type(matches->items[i])]);
 		first = false;
 	}
 
 	if (prefix)
-		printf("; ");
+		fprintf(out, "; ");
 	else
-		printf("\n");
+		fprintf(out, "\n");
 }
 
 
 
 
-static void
-match_cb(struct json_object *res, void *priv)
+static int
+stream_cb(struct json_object *res, void *priv)
 {
-	struct list_head *h = priv;
-	struct match_item *i = calloc(1, sizeof(*i));
-
-	if (i)
+	/* streamed values are released after the callback unless referenced */
+	if (jp_results_add(priv, json_object_get(res)))
 	{
-		i->jsobj = res;
-		list_add_tail(&i->list, h);
+		json_object_put(res);
+		return 1;
 	}
-}
 
+	return 0;
+}
 
 
 static void
@@ -412,15 +489,43 @@ print_error(struct jp_state *state, char *expr)
 }
 
 
+static void
+export_matches(FILE *out, int opt, struct jp_state *state,
+               struct jp_results *matches, const char *sep, int limit)
+{
+	const char *prefix;
+
+	prefix = (state->path->type == T_LABEL) ? state->path->str : NULL;
+
+	switch (opt)
+	{
+	case 't':
+		export_type(out, matches, prefix, limit);
+		break;
+
+	default:
+		export_value(out, matches, prefix, sep, limit);
+		break;
+	}
+}
+
+static int
+stream_feed(const char *buf, size_t len, void *priv)
+{
+	return jp_stream_feed(priv, buf, len);
+}
+
 static bool
-filter_json(int opt, struct json_object *jsobj, char *expr, const char *sep,
-            int limit)
+stream_json(int opt, FILE *fd, const char *source, char *expr,
+            const char *sep, int limit)
 {
+	int i, err = 0;
+	bool found = false;
 	struct jp_state *state;
-	const char *prefix = NULL;
-	struct list_head matches;
-	struct match_item *item, *tmp;
-	struct json_object *res = NULL;
+	struct jp_stream *stream = NULL;
+	struct jp_results matches;
+
+	jp_results_init(&matches, NULL, 0);
 
 	state = jp_parse(expr);
 
@@ -435,38 +540,803 @@ filter_json(int opt, struct json_object *jsobj, char *expr, const char *sep,
 		goto out;
 	}
 
-	INIT_LIST_HEAD(&matches);
+	/* no more input is read once the limit was reached */
+	stream = jp_stream_new_limit(state->path, stream_cb, &matches, limit);
 
-	res = jp_match(state->path, jsobj, match_cb, &matches);
-	prefix = (state->path->type == T_LABEL) ? state->path->str : NULL;
+	if (!stream)
+	{
+		fprintf(stderr, "Pattern %s cannot be streamed\n", expr);
+		goto out;
+	}
 
-	switch (opt)
+	if (source)
+		err = jp_stream_feed(stream, source, strlen(source));
+	else
+		err = read_input(fd, stream_feed, stream);
+
+	if (err >= 0)
+		err = jp_stream_end(stream);
+
+	if (err)
 	{
-	case 't':
-		export_type(&matches, prefix, limit);
-		break;
+		fprintf(stderr, "Failed to parse json data: %s\n",
+		        jp_stream_error(stream));
+		goto out;
+	}
 
-	default:
-		export_value(&matches, prefix, sep, limit);
-		break;
+	if (matches.failed)
+	{
+		fprintf(stderr, "Out of memory\n");
+		err = -1;
+		goto out;
 	}
 
-	list_for_each_entry_safe(item, tmp, &matches, list)
-		free(item);
+	export_matches(stdout, opt, state, &matches, sep, limit);
 
 out:
+	for (i = 0; i < matches.count; i++)
+	{
+		if (matches.items[i])
+			found = true;
+
+		json_object_put(matches.items[i]);
+	}
+
+	jp_results_free(&matches);
+
+	if (stream)
+		jp_stream_free(stream);
+
 	if (state)
 		jp_free(state);
 
-	return !!res;
+	return found && !err;
+}
+
+/* prints the plan of a pattern, which needs no input */
+static bool
+explain_pattern(char *expr)
+{
+	struct jp_state *state;
+	char *plan;
+
+	state = jp_parse(expr);
+
+	if (!state)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+
+	if (state->error_code)
+	{
+		print_error(state, expr);
+		jp_free(state);
+		return false;
+	}
+
+	plan = jp_explain(state);
+
+	if (plan)
+		fputs(plan, stdout);
+	else
+		fprintf(stderr, "Out of memory\n");
+
+	free(plan);
+	jp_free(state);
+
+	return (plan != NULL);
+}
+
+static bool
+parse_pattern(struct pattern *p, int opt, char *expr, const char *sep,
+              int limit)
+{
+	p->state = jp_parse(expr);
+
+	if (!p->state)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+	else if (p->state->error_code)
+	{
+		print_error(p->state, expr);
+		jp_free(p->state);
+		return false;
+	}
+
+	p->opt = opt;
+	p->expr = expr;
+	p->sep = sep;
+	p->limit = limit;
+	jp_results_init(&p->matches, NULL, 0);
+
+	return true;
+}
+
+static struct jp_set *
+build_set(struct pattern *patterns, int npatterns)
+{
+	int i;
+	struct jp_set *set;
+
+	set = jp_set_new();
+
+	for (i = 0; set && i < npatterns; i++)
+	{
+		if (jp_set_add_limit(set, patterns[i].state->path, jp_results_cb,
+		                     &patterns[i].matches, patterns[i].limit))
+		{
+			jp_set_free(set);
+			set = NULL;
+		}
+	}
+
+	if (!set)
+		fprintf(stderr, "Out of memory\n");
+
+	return set;
+}
+
+/* prints and clears the matches of all patterns, true if each had one */
+static bool
+export_patterns(FILE *out, struct pattern *patterns, int npatterns)
+{
+	int i, j;
+	bool found, rv = true;
+
+	for (i = 0; i < npatterns; i++)
+	{
+		found = false;
+
+		if (patterns[i].matches.failed)
+			fprintf(stderr, "Out of memory\n");
+
+		export_matches(out, patterns[i].opt, patterns[i].state,
+		               &patterns[i].matches, patterns[i].sep,
+		               patterns[i].limit);
+
+		for (j = 0; j < patterns[i].matches.count; j++)
+			if (patterns[i].matches.items[j])
+				found = true;
+
+		jp_results_reset(&patterns[i].matches);
+
+		if (!found)
+			rv = false;
+	}
+
+	return rv;
+}
+
+static void
+free_patterns(struct pattern *patterns, int *npatterns)
+{
+	int i;
+
+	for (i = 0; i < *npatterns; i++)
+	{
+		jp_results_free(&patterns[i].matches);
+		jp_free(patterns[i].state);
+	}
+
+	*npatterns = 0;
+}
+
+/*
+ * Matches all pending patterns in a single pass over the document, or with
+ * more than one job each pattern on its own, splitting large arrays and
+ * objects across the threads.
+ */
+static bool
+filter_json(struct json_object *jsobj, struct pattern *patterns, int npatterns,
+            int jobs)
+{
+	bool rv;
+	int i;
+	struct jp_set *set = NULL;
+	struct jp_pool *pool = NULL;
+
+	if (jobs != 1)
+		pool = jp_pool_new(jobs);
+
+	if (pool)
+	{
+		for (i = 0; i < npatterns; i++)
+			jp_match_parallel(patterns[i].state->path, jsobj, pool,
+			                  jp_results_cb, &patterns[i].matches,
+			                  patterns[i].limit);
+
+		jp_pool_free(pool);
+	}
+	else
+	{
+		set = build_set(patterns, npatterns);
+
+		if (set)
+			jp_match_set(set, jsobj);
+	}
+
+	rv = export_patterns(stdout, patterns, npatterns);
+
+	free_patterns(patterns, &npatterns);
+	jp_set_free(set);
+
+	return rv;
+}
+
+static int
+flush_patterns(FILE *input, const char *source, struct json_object **jsobj,
+               struct pattern *patterns, int *npatterns, int jobs)
+{
+	int i;
+	const char *jserr = NULL;
+
+	if (!*npatterns)
+		return 0;
+
+	if (!*jsobj)
+	{
+		*jsobj = parse_json(input, source, &jserr);
+
+		if (!*jsobj)
+		{
+			fprintf(stderr, "Failed to parse json data: %s\n", jserr);
+			free_patterns(patterns, npatterns);
+			return 126;
+		}
+	}
+
+	i = *npatterns;
+	*npatterns = 0;
+
+	return filter_json(*jsobj, patterns, i, jobs) ? 0 : 1;
+}
+
+/*
+ * Input of --lines, one record per line. Each line is handed to the
+ * tokenizer straight from the input buffer, a record split across reads
+ * is continued with the next one.
+ */
+struct lines_state {
+	struct json_tokener *tok;
+	struct jp_set *set;
+	struct pattern *patterns;
+	int npatterns;
+	int line;
+	FILE *out;
+
+	/* the current line has more than whitespace / its value is complete */
+	bool content, done;
+
+	/* the value of the current line, matched once the line proves clean */
+	struct json_object *obj;
+	bool valid;
+
+	bool matched, failed;
+};
+
+static void
+lines_error(struct lines_state *ls, enum json_tokener_error err)
+{
+	fprintf(stderr, "Failed to parse json data on line %d: %s\n",
+	        ls->line, json_tokener_error_desc(err));
+
+	ls->failed = true;
+}
+
+static void
+lines_trailing(struct lines_state *ls, const char *buf, size_t len)
+{
+	if (!ls->valid)
+		return;
+
+	while (len && isspace((unsigned char)*buf))
+	{
+		buf++;
+		len--;
+	}
+
+	if (len)
+	{
+		lines_error(ls, json_tokener_error_parse_unexpected);
+		ls->valid = false;
+	}
+}
+
+static void
+lines_parse(struct lines_state *ls, const char *buf, size_t len)
+{
+	struct json_object *obj;
+	enum json_tokener_error err;
+	size_t off;
+
+	if (ls->done)
+	{
+		lines_trailing(ls, buf, len);
+		return;
+	}
+
+	if (!ls->content)
+	{
+		while (len && isspace((unsigned char)*buf))
+		{
+			buf++;
+			len--;
+		}
+
+		if (!len)
+			return;
+
+		ls->content = true;
+	}
+
+	obj = json_tokener_parse_ex(ls->tok, buf, len);
+	err = json_tokener_get_error(ls->tok);
+
+	if (err == json_tokener_continue)
+		return;
+
+	ls->done = true;
+
+	if (err)
+	{
+		lines_error(ls, err);
+		return;
+	}
+
+	ls->obj = obj;
+	ls->valid = true;
+	off = ls->tok->char_offset;
+
+	if (off < len)
+		lines_trailing(ls, buf + off, len - off);
+}
+
+static void
+lines_end(struct lines_state *ls)
+{
+	if (ls->content && !ls->done)
+		lines_error(ls, json_tokener_error_parse_eof);
+
+	if (ls->valid)
+	{
+		if (ls->set)
+			jp_match_set(ls->set, ls->obj);
+
+		if (export_patterns(ls->out, ls->patterns, ls->npatterns))
+			ls->matched = true;
+	}
+
+	json_object_put(ls->obj);
+	ls->obj = NULL;
+	ls->valid = false;
+
+	json_tokener_reset(ls->tok);
+	ls->content = false;
+	ls->done = false;
+	ls->line++;
+}
+
+/*
+ * Ends the input. json-c can only tell that a number at the very end is
+ * complete once something follows it, so the last record is given a
+ * terminator before it is reported as cut short.
+ */
+static void
+lines_finish(struct lines_state *ls)
+{
+	struct json_object *obj;
+
+	if (!ls->content)
+		return;
+
+	if (!ls->done)
+	{
+		obj = json_tokener_parse_ex(ls->tok, "", 1);
+
+		if (json_tokener_get_error(ls->tok) == json_tokener_success)
+		{
+			ls->obj = obj;
+			ls->valid = true;
+			ls->done = true;
+		}
+	}
+
+	lines_end(ls);
+}
+
+static int
+lines_feed(const char *buf, size_t len, void *priv)
+{
+	struct lines_state *ls = priv;
+	const char *nl, *end = buf + len;
+
+	while (buf < end)
+	{
+		nl = memchr(buf, '\n', end - buf);
+
+		lines_parse(ls, buf, (nl ? nl + 1 : end) - buf);
+
+		if (!nl)
+			break;
+
+		lines_end(ls);
+		buf = nl + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parallel --lines: the input is cut into chunks at line boundaries, which
+ * the threads of a pool match with state of their own. The output of a
+ * chunk is collected in memory and written once it is complete, either
+ * right away or after the output of all chunks before it.
+ */
+#define LINES_CHUNK	(1024 * 1024)
+
+struct lines_chunk {
+	struct lines_chunk *next;
+	struct lines_job *job;
+	char *buf;
+	size_t len;
+	int line;
+	char *out;
+	size_t outlen;
+	bool done;
+};
+
+struct lines_job {
+	struct jp_pool *pool;
+	struct lines_state *workers;
+	bool ordered;
+
+	pthread_mutex_t lock;
+	pthread_cond_t room;
+	int inflight, maxflight;
+
+	/* chunks not written yet in input order, if ordered */
+	struct lines_chunk *head, **tail;
+
+	/* chunk being filled */
+	char *buf;
+	size_t len;
+	int line;
+
+	bool oom;
+};
+
+static void
+lines_write(struct lines_chunk *c)
+{
+	if (c->outlen)
+		fwrite(c->out, 1, c->outlen, stdout);
+
+	free(c->out);
+	free(c);
+}
+
+static void
+lines_task(void *arg, int worker)
+{
+	struct lines_chunk *c = arg;
+	struct lines_job *job = c->job;
+	struct lines_state *ls = &job->workers[worker];
+
+	ls->out = open_memstream(&c->out, &c->outlen);
+
+	if (ls->out)
+	{
+		ls->line = c->line;
+		lines_feed(c->buf, c->len, ls);
+		lines_finish(ls);
+
+		fclose(ls->out);
+	}
+
+	free(c->buf);
+
+	pthread_mutex_lock(&job->lock);
+
+	if (!ls->out)
+		job->oom = true;
+
+	if (job->ordered)
+	{
+		c->done = true;
+
+		while (job->head && job->head->done)
+		{
+			c = job->head;
+			job->head = c->next;
+			lines_write(c);
+			job->inflight--;
+		}
+
+		if (!job->head)
+			job->tail = &job->head;
+	}
+	else
+	{
+		lines_write(c);
+		job->inflight--;
+	}
+
+	pthread_cond_signal(&job->room);
+	pthread_mutex_unlock(&job->lock);
+}
+
+/* hands len bytes of the pending input to the pool as one chunk */
+static bool
+lines_submit(struct lines_job *job, size_t len)
+{
+	struct lines_chunk *c;
+	const char *p, *end;
+
+	c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return false;
+
+	c->job = job;
+	c->line = job->line;
+	c->len = len;
+	c->buf = malloc(len);
+
+	if (!c->buf)
+	{
+		free(c);
+		return false;
+	}
+
+	memcpy(c->buf, job->buf, len);
+	memmove(job->buf, job->buf + len, job->len - len);
+	job->len -= len;
+
+	for (p = c->buf, end = p + len; (p = memchr(p, '\n', end - p)) != NULL; p++)
+		job->line++;
+
+	pthread_mutex_lock(&job->lock);
+
+	while (job->inflight >= job->maxflight)
+		pthread_cond_wait(&job->room, &job->lock);
+
+	job->inflight++;
+
+	if (job->ordered)
+	{
+		*job->tail = c;
+		job->tail = &c->next;
+	}
+
+	pthread_mutex_unlock(&job->lock);
+
+	/* without memory to queue it, run it here once the pool is idle */
+	if (jp_pool_submit(job->pool, lines_task, c))
+	{
+		jp_pool_wait(job->pool);
+		lines_task(c, 0);
+	}
+
+	return true;
+}
+
+static int
+lines_split(const char *buf, size_t len, void *priv)
+{
+	struct lines_job *job = priv;
+	const char *nl;
+	size_t n;
+	char *tmp;
+
+	if (job->len + len > LINES_CHUNK * 2 || !job->buf)
+	{
+		tmp = realloc(job->buf, job->len + len + LINES_CHUNK * 2);
+
+		if (!tmp)
+			goto oom;
+
+		job->buf = tmp;
+	}
+
+	memcpy(job->buf + job->len, buf, len);
+	job->len += len;
+
+	if (job->len < LINES_CHUNK)
+		return 0;
+
+	nl = memrchr(job->buf, '\n', job->len);
+
+	if (!nl)
+		return 0;
+
+	n = nl + 1 - job->buf;
+
+	if (!lines_submit(job, n))
+		goto oom;
+
+	return 0;
+
+oom:
+	job->oom = true;
+	return -1;
+}
+
+static bool
+lines_worker_init(struct lines_state *ls, struct pattern *patterns,
+                  int npatterns)
+{
+	int i;
+
+	ls->npatterns = npatterns;
+	ls->patterns = calloc(npatterns + 1, sizeof(*ls->patterns));
+	ls->tok = json_tokener_new();
+
+	if (!ls->patterns || !ls->tok)
+		return false;
+
+	/* parsed patterns are shared, matches are collected per thread */
+	for (i = 0; i < npatterns; i++)
+	{
+		ls->patterns[i] = patterns[i];
+		jp_results_init(&ls->patterns[i].matches, NULL, 0);
+	}
+
+	ls->set = build_set(ls->patterns, npatterns);
+
+	return (ls->set != NULL);
+}
+
+static void
+lines_worker_free(struct lines_state *ls)
+{
+	int i;
+
+	for (i = 0; ls->patterns && i < ls->npatterns; i++)
+		jp_results_free(&ls->patterns[i].matches);
+
+	free(ls->patterns);
+	jp_set_free(ls->set);
+
+	if (ls->tok)
+		json_tokener_free(ls->tok);
+}
+
+static int
+filter_lines_parallel(FILE *input, const char *source,
+                      struct pattern *patterns, int npatterns,
+                      int jobs, bool ordered)
+{
+	struct lines_job job = { .ordered = ordered, .line = 1 };
+	bool matched = false, failed = false;
+	int i, n = 0;
+
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.room, NULL);
+	job.tail = &job.head;
+	job.pool = jp_pool_new(jobs);
+
+	if (job.pool)
+	{
+		n = jp_pool_size(job.pool);
+		job.workers = calloc(n, sizeof(*job.workers));
+	}
+
+	job.maxflight = 4 * n;
+	job.oom = !job.workers;
+
+	for (i = 0; job.workers && i < n; i++)
+		if (!lines_worker_init(&job.workers[i], patterns, npatterns))
+			job.oom = true;
+
+	if (!job.oom)
+	{
+		if (source)
+			lines_split(source, strlen(source), &job);
+		else
+			read_input(input, lines_split, &job);
+
+		/* the last line needs no newline */
+		if (!job.oom && job.len && !lines_submit(&job, job.len))
+			job.oom = true;
+	}
+
+	jp_pool_free(job.pool);
+
+	for (i = 0; job.workers && i < n; i++)
+	{
+		matched |= job.workers[i].matched;
+		failed |= job.workers[i].failed;
+		lines_worker_free(&job.workers[i]);
+	}
+
+	free(job.workers);
+	free(job.buf);
+	pthread_cond_destroy(&job.room);
+	pthread_mutex_destroy(&job.lock);
+
+	if (job.oom)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 127;
+	}
+
+	if (failed)
+		return 126;
+
+	return matched ? 0 : 1;
 }
 
+/* matches all patterns against every line of the input on its own */
+static int
+filter_lines(FILE *input, const char *source, struct pattern *patterns,
+             int *npatterns, int jobs, bool ordered)
+{
+	int rv;
+	struct lines_state ls = {
+		.patterns = patterns,
+		.npatterns = *npatterns,
+		.line = 1,
+		.out = stdout
+	};
+
+	if (jobs != 1)
+	{
+		rv = filter_lines_parallel(input, source, patterns, *npatterns,
+		                           jobs, ordered);
+
+		free_patterns(patterns, npatterns);
+
+		return rv;
+	}
+
+	ls.tok = json_tokener_new();
+
+	if (!ls.tok)
+	{
+		fprintf(stderr, "Out of memory\n");
+		free_patterns(patterns, npatterns);
+		return 127;
+	}
+
+	ls.set = build_set(patterns, *npatterns);
+
+	if (source)
+		lines_feed(source, strlen(source), &ls);
+	else
+		read_input(input, lines_feed, &ls);
+
+	lines_finish(&ls);
+
+	json_tokener_free(ls.tok);
+	jp_set_free(ls.set);
+	free_patterns(patterns, npatterns);
+
+	if (ls.failed)
+		return 126;
+
+	return ls.matched ? 0 : 1;
+}
+
+static const struct option long_options[] = {
+	{ "help",  no_argument, NULL, 'h' },
+	{ "lines", no_argument, NULL, 'L' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "ordered", no_argument, NULL, 'O' },
+	{ NULL }
+};
+
 int main(int argc, char **argv)
 {
-	int opt, rv = 0, limit = 0x7FFFFFFF;
+	int opt, rv = 0, err, npatterns = 0, limit = 0x7FFFFFFF;
+	int jobs = 1;
+	bool stream = false, streamed = false, lines = false, ordered = false;
 	FILE *input = stdin;
 	struct json_object *jsobj = NULL;
-	const char *jserr = NULL, *source = NULL, *separator = " ";
+	struct pattern *patterns = NULL;
+	const char *source = NULL, *separator = " ";
 
 	if (argc == 1)
 	{
@@ -474,7 +1344,17 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
-	while ((opt = getopt(argc, argv, "hi:s:e:k:t:F:l:q")) != -1)
+	patterns = calloc(argc, sizeof(*patterns));
+
+	if (!patterns)
+	{
+		fprintf(stderr, "Out of memory\n");
+		rv = 127;
+		goto out;
+	}
+
+	while ((opt = getopt_long(argc, argv, "hi:s:Se:k:t:F:l:qj:x:",
+	                          long_options, NULL)) != -1)
 	{
 		switch (opt)
 		{
@@ -500,6 +1380,22 @@ int main(int argc, char **argv)
 			source = optarg;
 			break;
 
+		case 'S':
+			stream = true;
+			break;
+
+		case 'L':
+			lines = true;
+			break;
+
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+
+		case 'O':
+			ordered = true;
+			break;
+
 		case 'F':
 			if (optarg && *optarg)
 				separator = optarg;
@@ -511,27 +1407,59 @@ int main(int argc, char **argv)
 
 		case 't':
 		case 'e':
-			if (!jsobj)
+			if (stream && !lines)
 			{
-				jsobj = parse_json(input, source, &jserr);
+				/* keep the output in option order */
+				if (npatterns)
+				{
+					streamed = true;
+					err = flush_patterns(input, source, &jsobj,
+					                     patterns, &npatterns, jobs);
 
-				if (!jsobj)
+					if (err > rv)
+						rv = err;
+
+					if (rv == 126)
+						goto out;
+				}
+
+				/* every streamed pattern reads the input from the start */
+				if (!source && streamed && fseek(input, 0, SEEK_SET))
 				{
-					fprintf(stderr, "Failed to parse json data: %s\n",
-					        jserr);
+					fprintf(stderr, "Cannot rewind input to stream %s\n",
+					        optarg);
 
-					rv = 126;
-					goto out;
+					rv = 1;
+					break;
 				}
+
+				if (!stream_json(opt, input, source, optarg, separator, limit))
+					rv = 1;
+
+				streamed = true;
+				break;
 			}
 
-			if (!filter_json(opt, jsobj, optarg, separator, limit))
+			/* plain patterns are collected and matched together */
+			if (!parse_pattern(&patterns[npatterns], opt, optarg,
+			                   separator, limit))
+			{
 				rv = 1;
+				break;
+			}
 
+			npatterns++;
 			break;
+
 		case 'k':
 			do_karl_test(input, source, optarg);
 			break;
+
+		case 'x':
+			if (!explain_pattern(optarg))
+				rv = 1;
+
+			break;
 			
 		case 'q':
 			fclose(stderr);
@@ -539,7 +1467,22 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (lines)
+		err = filter_lines(input, source, patterns, &npatterns,
+		                   jobs, ordered);
+	else
+		err = flush_patterns(input, source, &jsobj, patterns, &npatterns,
+		                     jobs);
+
+	if (err > rv)
+		rv = err;
+
 out:
+	while (npatterns > 0)
+		jp_free(patterns[--npatterns].state);
+
+	free(patterns);
+
 	if (jsobj)
 		json_object_put(jsobj);
 
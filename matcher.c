@@ -15,32 +15,50 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "jsonpath.h"
+#include "matcher.h"
 
-static struct json_object *
-jp_match_next(struct jp_opcode *ptr,
-              struct json_object *root, struct json_object *cur,
-              jp_match_cb_t cb, void *priv);
+/* iteration state of an active JP_OP_SCAN, resumed on backtrack */
+struct jp_frame {
+	int pc;
+	struct json_object *obj;
+	struct lh_entry *ent;
+	int idx, len, step;
+};
+
+/*
+ * Containers entered by the active JP_OP_DESCEND frames. Frames nest, so
+ * they share one stack and each only uses the positions above its base.
+ */
+#define JP_WALK_BUF 32
+
+struct jp_walk {
+	struct jp_frame *pos;
+	int npos, apos;
+	struct jp_frame buf[JP_WALK_BUF];
+};
 
 static bool
-jp_json_to_op(struct json_object *obj, struct jp_opcode *op)
+jp_json_to_value(struct json_object *obj, struct jp_value *val)
 {
 	switch (json_object_get_type(obj))
 	{
 	case json_type_boolean:
-		op->type = T_BOOL;
-		op->num = json_object_get_boolean(obj);
+		val->type = T_BOOL;
+		val->num = json_object_get_boolean(obj);
 		return true;
 
 	case json_type_int:
-		op->type = T_NUMBER;
-		op->num = json_object_get_int(obj);
+		val->type = T_NUMBER;
+		val->num = json_object_get_int(obj);
 		return true;
 
 	case json_type_string:
-		op->type = T_STRING;
-		op->str = (char *)json_object_get_string(obj);
+		val->type = T_STRING;
+		val->str = json_object_get_string(obj);
 		return true;
 
 	default:
@@ -49,245 +67,1012 @@ jp_json_to_op(struct json_object *obj, struct jp_opcode *op)
 }
 
 static bool
-jp_resolve(struct json_object *root, struct json_object *cur,
-           struct jp_opcode *op, struct jp_opcode *res)
+jp_cmp_delta(int op, int delta)
 {
-	struct json_object *val;
-
-	switch (op->type)
+	switch (op)
 	{
-	case T_THIS:
-		val = jp_match(op, cur, NULL, NULL);
+	case T_EQ:
+		return (delta == 0);
 
-		if (val)
-			return jp_json_to_op(val, res);
+	case T_LT:
+		return (delta < 0);
 
-		return false;
+	case T_LE:
+		return (delta <= 0);
 
-	case T_ROOT:
-		val = jp_match(op, root, NULL, NULL);
+	case T_GT:
+		return (delta > 0);
 
-		if (val)
-			return jp_json_to_op(val, res);
+	case T_GE:
+		return (delta >= 0);
 
-		return false;
+	case T_NE:
+		return (delta != 0);
 
 	default:
-		*res = *op;
-		return true;
+		return false;
 	}
 }
 
 static bool
-jp_cmp(struct jp_opcode *op, struct json_object *root, struct json_object *cur)
+jp_cmp(int op, const struct jp_value *left, const struct jp_value *right)
 {
 	int delta;
-	struct jp_opcode left, right;
 
-	if (!jp_resolve(root, cur, op->down, &left) ||
-        !jp_resolve(root, cur, op->down->sibling, &right))
+	if (left->type != right->type)
 		return false;
 
-	if (left.type != right.type)
-		return false;
-
-	switch (left.type)
+	switch (left->type)
 	{
 	case T_BOOL:
 	case T_NUMBER:
-		delta = left.num - right.num;
+		delta = left->num - right->num;
 		break;
 
 	case T_STRING:
-		delta = strcmp(left.str, right.str);
+		delta = strcmp(left->str, right->str);
 		break;
 
 	default:
 		return false;
 	}
 
-	switch (op->type)
+	return jp_cmp_delta(op, delta);
+}
+
+/* follows a sub-path of KEY and INDEX steps, which needs no frames */
+static struct json_object *
+jp_chain(const struct jp_prog *prog, int pc, struct jp_ctx *ctx,
+         struct json_object *cur)
+{
+	const struct jp_insn *insn;
+	int idx;
+
+	for (;; pc++)
 	{
-	case T_EQ:
-		return (delta == 0);
+		insn = &prog->code[pc];
 
-	case T_LT:
-		return (delta < 0);
+		switch (insn->op)
+		{
+		case JP_OP_KEY:
+			if (!jp_key(prog, insn->arg, ctx, cur, &cur))
+				return NULL;
 
-	case T_LE:
-		return (delta <= 0);
+			break;
 
-	case T_GT:
-		return (delta > 0);
+		case JP_OP_INDEX:
+			if (json_object_get_type(cur) != json_type_array)
+				return NULL;
 
-	case T_GE:
-		return (delta >= 0);
+			idx = insn->arg;
 
-	case T_NE:
-		return (delta != 0);
+			if (idx < 0)
+				idx += json_object_array_length(cur);
 
-	default:
-		return false;
+			if (idx < 0)
+				return NULL;
+
+			cur = json_object_array_get_idx(cur, idx);
+			break;
+
+		default:
+			return cur;
+		}
+
+		if (!cur)
+			return NULL;
 	}
 }
 
 static bool
-jp_expr(struct jp_opcode *op, struct json_object *root, struct json_object *cur,
-        int idx, const char *key, jp_match_cb_t cb, void *priv)
+jp_test(const struct jp_test *test, struct json_object *val)
 {
-	struct jp_opcode *sop;
+	int delta;
+
+	if (json_object_get_type(val) != test->type)
+		return false;
 
-	switch (op->type)
+	switch (test->type)
 	{
-	case T_WILDCARD:
-		return true;
+	case json_type_boolean:
+		delta = json_object_get_boolean(val) - test->lit.num;
+		break;
 
-	case T_EQ:
-	case T_NE:
-	case T_LT:
-	case T_LE:
-	case T_GT:
-	case T_GE:
-		return jp_cmp(op, root, cur);
+	case json_type_int:
+		delta = json_object_get_int(val) - test->lit.num;
+		break;
 
-	case T_ROOT:
-		return !!jp_match(op, root, NULL, NULL);
+	default:
+		delta = strcmp(json_object_get_string(val), test->lit.str);
+		break;
+	}
 
-	case T_THIS:
-		return !!jp_match(op, cur, NULL, NULL);
+	return jp_cmp_delta(test->cmp, delta);
+}
 
-	case T_NOT:
-		return !jp_expr(op->down, root, cur, idx, key, cb, priv);
+void
+jp_ctx_init(struct jp_ctx *ctx, const struct jp_prog *prog,
+            struct json_object *root, struct jp_value *hoisted)
+{
+	int i;
 
-	case T_AND:
-		for (sop = op->down; sop; sop = sop->sibling)
-			if (!jp_expr(sop, root, cur, idx, key, cb, priv))
-				return false;
-		return true;
+	ctx->root = root;
+	ctx->hoisted = hoisted;
+	ctx->stop = (ctx->left == 0);
+
+	for (i = 0; i < prog->nhoists; i++)
+		hoisted[i].type = JP_UNRESOLVED;
+}
+
+static int
+jp_found(struct json_object *res, void *priv)
+{
+	return (res != NULL);
+}
+
+bool
+jp_emit(struct jp_ctx *ctx, struct json_object *res)
+{
+	/* values sub-paths find are no matches */
+	JP_STAT_ADD(ctx, matches, ctx->cb != jp_found);
+
+	if (ctx->cb)
+	{
+		if (ctx->cb(res, ctx->priv))
+			ctx->stop = true;
+	}
+	else if (ctx->notify)
+	{
+		ctx->notify(res, ctx->priv);
+	}
+
+	if (ctx->left > 0 && --ctx->left == 0)
+		ctx->stop = true;
+
+	return ctx->stop;
+}
+
+/* runs the sub-path of an operand up to its first value, which is all
+ * that existence tests and comparisons look at. The hoisted values of the
+ * enclosing match are shared. */
+static struct json_object *
+jp_subpath(const struct jp_prog *prog, const struct jp_insn *insn,
+           struct jp_ctx *ctx, struct json_object *cur)
+{
+	struct jp_ctx sub = { .root = ctx->root, .hoisted = ctx->hoisted,
+	                      .cb = jp_found, .left = -1, .stats = ctx->stats };
+	struct json_object *res;
+
+	res = jp_run(prog, insn->arg, &sub,
+	             (insn->aux == T_ROOT) ? ctx->root : cur);
+
+	/* running out of memory ends the enclosing match too */
+	if (sub.oom)
+		ctx->stop = ctx->oom = true;
+
+	return res;
+}
+
+/* evaluates an operand that looks at the document */
+static void
+jp_operand(const struct jp_prog *prog, const struct jp_insn *insn,
+           struct jp_ctx *ctx, struct json_object *cur, struct jp_value *val)
+{
+	const struct jp_test *test;
+	struct json_object *obj;
+
+	JP_STAT_ADD(ctx, subpaths, 1);
+
+	switch (insn->op)
+	{
+	case JP_OP_EXISTS:
+		val->type = T_BOOL;
+		val->num = !!jp_subpath(prog, insn, ctx, cur);
+		break;
 
-	case T_OR:
-	case T_UNION:
-		for (sop = op->down; sop; sop = sop->sibling)
-			if (jp_expr(sop, root, cur, idx, key, cb, priv))
+	case JP_OP_RESOLVE:
+		obj = jp_subpath(prog, insn, ctx, cur);
+
+		if (!obj || !jp_json_to_value(obj, val))
+			val->type = 0;
+
+		break;
+
+	default:
+		test = &prog->tests[insn->arg];
+		obj = jp_chain(prog, test->path, ctx,
+		               (test->root == T_ROOT) ? ctx->root : cur);
+
+		val->type = T_BOOL;
+		val->num = jp_test(test, obj);
+		JP_STAT_ADD(ctx, compares, 1);
+		break;
+	}
+}
+
+bool
+jp_pred(const struct jp_prog *prog, int pc, struct jp_ctx *ctx,
+        struct json_object *cur, int idx, const char *key)
+{
+	const struct jp_insn *insn;
+	struct jp_value stack[JP_STACK_MAX + 1], *sp = stack, *hoisted;
+
+	for (;;)
+	{
+		insn = &prog->code[pc++];
+
+		switch (insn->op)
+		{
+		case JP_OP_TRUE:
+			(sp++)->num = true;
+			break;
+
+		case JP_OP_FALSE:
+			(sp++)->num = false;
+			break;
+
+		case JP_OP_IS_KEY:
+			(sp++)->num = (key && !strcmp(prog->consts[insn->arg].str, key));
+			break;
+
+		case JP_OP_IS_INDEX:
+			(sp++)->num = (idx == insn->arg);
+			break;
+
+		case JP_OP_EXISTS:
+		case JP_OP_RESOLVE:
+		case JP_OP_TEST:
+			jp_operand(prog, insn, ctx, cur, sp++);
+			break;
+
+		case JP_OP_HOIST:
+			hoisted = &ctx->hoisted[insn->arg];
+
+			if (hoisted->type == JP_UNRESOLVED)
+				jp_operand(prog, &prog->hoists[insn->arg], ctx, ctx->root,
+				           hoisted);
+
+			*sp++ = *hoisted;
+			break;
+
+		case JP_OP_NOT:
+			sp[-1].num = !sp[-1].num;
+			break;
+
+		case JP_OP_AND:
+			if (!sp[-1].num)
+				pc = insn->arg;
+			else
+				sp--;
+			break;
+
+		case JP_OP_OR:
+			if (sp[-1].num)
+				pc = insn->arg;
+			else
+				sp--;
+			break;
+
+		case JP_OP_LOAD:
+			*sp++ = prog->consts[insn->arg];
+			break;
+
+		case JP_OP_CMP:
+			JP_STAT_ADD(ctx, compares, 1);
+			sp--;
+			sp[-1].num = jp_cmp(insn->aux, &sp[-1], &sp[0]);
+			break;
+
+		default:
+			return sp[-1].num;
+		}
+	}
+}
+
+/* advance a scan to its next accepted child */
+static bool
+jp_scan_next(const struct jp_prog *prog, struct jp_frame *f,
+             struct jp_ctx *ctx, struct json_object **cur)
+{
+	int pred = prog->code[f->pc].arg;
+	struct json_object *val;
+	const char *key;
+
+	if (f->ent)
+	{
+		while (f->ent && !ctx->stop)
+		{
+			key = lh_entry_k(f->ent);
+			val = lh_entry_v(f->ent);
+			f->ent = f->ent->next;
+			JP_STAT_ADD(ctx, keys, 1);
+
+			if (jp_pred(prog, pred, ctx, val, -1, key) && !ctx->stop)
+			{
+				*cur = val;
 				return true;
+			}
+		}
+
 		return false;
+	}
 
-	case T_STRING:
-		return (key && !strcmp(op->str, key));
+	while (!ctx->stop && ++f->idx < f->len)
+	{
+		val = json_object_array_get_idx(f->obj, f->idx);
+		JP_STAT_ADD(ctx, keys, 1);
 
-	case T_NUMBER:
-		return (idx == op->num);
+		if (jp_pred(prog, pred, ctx, val, f->idx, NULL) && !ctx->stop)
+		{
+			*cur = val;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+jp_is_container(struct json_object *obj)
+{
+	switch (json_object_get_type(obj))
+	{
+	case json_type_object:
+	case json_type_array:
+		return true;
 
 	default:
 		return false;
 	}
 }
 
-static struct json_object *
-jp_match_expr(struct jp_opcode *ptr,
-              struct json_object *root, struct json_object *cur,
-              jp_match_cb_t cb, void *priv)
+/* claims a position on top of the walk stack */
+/* grows the walk stack as needed, stopping the match if it cannot */
+static struct jp_frame *
+jp_walk_alloc(struct jp_walk *w, struct jp_ctx *ctx)
 {
-	int idx, len;
-	struct json_object *tmp, *res = NULL;
+	struct jp_frame *pos;
+	int n = w->apos * 2;
 
-	switch (json_object_get_type(cur))
+	if (w->npos == w->apos)
 	{
-	case json_type_object:
-		; /* a label can only be part of a statement and a declaration is not a statement */
-		json_object_object_foreach(cur, key, val)
+		if (w->pos == w->buf)
 		{
-			if (jp_expr(ptr, root, val, -1, key, cb, priv))
-			{
-				tmp = jp_match_next(ptr->sibling, root, val, cb, priv);
+			pos = malloc(n * sizeof(*pos));
 
-				if (tmp && !res)
-					res = tmp;
-			}
+			if (pos)
+				memcpy(pos, w->buf, w->npos * sizeof(*pos));
+		}
+		else
+		{
+			pos = realloc(w->pos, n * sizeof(*pos));
 		}
 
-		break;
+		if (!pos)
+		{
+			ctx->stop = ctx->oom = true;
+			return NULL;
+		}
 
-	case json_type_array:
-		len = json_object_array_length(cur);
+		w->pos = pos;
+		w->apos = n;
+	}
+
+	return &w->pos[w->npos++];
+}
+
+static bool
+jp_walk_push(struct jp_walk *w, struct jp_ctx *ctx, struct json_object *obj)
+{
+	struct jp_frame *pos = jp_walk_alloc(w, ctx);
+
+	if (!pos)
+		return false;
 
-		for (idx = 0; idx < len; idx++)
+	pos->obj = obj;
+	pos->ent = NULL;
+	pos->idx = -1;
+	pos->len = 0;
+
+	if (json_object_get_type(obj) == json_type_object)
+		pos->ent = json_object_get_object(obj)->head;
+	else
+		pos->len = json_object_array_length(obj);
+
+	return true;
+}
+
+/*
+ * Advances the preorder walk of a JP_OP_DESCEND frame to the next
+ * container below it. Scalars are passed over, as no step selects anything
+ * from them.
+ */
+static bool
+jp_walk_next(struct jp_walk *w, int base, struct jp_ctx *ctx,
+             struct json_object **cur)
+{
+	struct jp_frame *top;
+	struct json_object *val;
+
+	while (w->npos > base)
+	{
+		top = &w->pos[w->npos - 1];
+
+		if (top->ent)
 		{
-			tmp = json_object_array_get_idx(cur, idx);
+			val = lh_entry_v(top->ent);
+			top->ent = top->ent->next;
+		}
+		else if (++top->idx < top->len)
+		{
+			val = json_object_array_get_idx(top->obj, top->idx);
+		}
+		else
+		{
+			w->npos--;
+			continue;
+		}
 
-			if (jp_expr(ptr, root, tmp, idx, NULL, cb, priv))
-			{
-				tmp = jp_match_next(ptr->sibling, root, tmp, cb, priv);
+		JP_STAT_ADD(ctx, keys, 1);
+
+		if (jp_is_container(val))
+		{
+			if (!jp_walk_push(w, ctx, val))
+				return false;
+
+			*cur = val;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int
+jp_slice_step(const struct jp_value *slice)
+{
+	return (slice[2].type == T_NUMBER) ? slice[2].num : 1;
+}
+
+/*
+ * Resolves the slice bounds and step against an array of len elements.
+ * The first index is returned one step early, so advancing the frame
+ * yields it. A step reaching past the array only selects the first
+ * index, it is clamped to the length so that no index computed from it
+ * overflows.
+ */
+bool
+jp_slice_range(const struct jp_value *slice, int len, int *idx, int *bound,
+               int *stride)
+{
+	int start, end, step = jp_slice_step(slice);
+
+	if (step > 0)
+	{
+		start = (slice[0].type == T_NUMBER) ? slice[0].num : 0;
+		end = (slice[1].type == T_NUMBER) ? slice[1].num : len;
+
+		if (start < 0)
+			start = (start + len < 0) ? 0 : start + len;
+
+		if (end < 0)
+			end = (end + len < 0) ? 0 : end + len;
+
+		if (end > len)
+			end = len;
+	}
+	else if (step < 0)
+	{
+		start = (slice[0].type == T_NUMBER) ? slice[0].num : len - 1;
+		end = (slice[1].type == T_NUMBER) ? slice[1].num : -len - 1;
+
+		if (start < 0)
+			start = (start + len < -1) ? -1 : start + len;
+
+		if (end < 0)
+			end = (end + len < -1) ? -1 : end + len;
+
+		if (start >= len)
+			start = len - 1;
+	}
+	else
+	{
+		return false;
+	}
+
+	if (step > len || step < -len)
+		step = (step > 0) ? (len ? len : 1) : (len ? -len : -1);
+
+	*idx = start - step;
+	*bound = end;
+	*stride = step;
+
+	return true;
+}
 
-				if (tmp && !res)
-					res = tmp;
+static bool
+jp_slice_next(struct jp_frame *f, struct json_object **cur)
+{
+	f->idx += f->step;
+
+	if ((f->step > 0) ? (f->idx >= f->len) : (f->idx <= f->len))
+		return false;
+
+	*cur = json_object_array_get_idx(f->obj, f->idx);
+
+	return true;
+}
+
+#define JP_KEYS_LOCKSTEP 8
+
+static int
+jp_cmp_ent(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)((const struct jp_frame *)a)->ent;
+	uintptr_t y = (uintptr_t)((const struct jp_frame *)b)->ent;
+
+	return (x > y) - (x < y);
+}
+
+static int
+jp_cmp_rank(const void *a, const void *b)
+{
+	const struct jp_frame *x = a, *y = b;
+
+	return (x->idx < y->idx) - (x->idx > y->idx);
+}
+
+/*
+ * Puts members found by hash lookup into reverse document order. A few
+ * members are followed through the list in lockstep until every member but
+ * the last one has met its successor, which only looks at the members in
+ * between but compares each step against all of them. More members are
+ * ranked in one pass over the list up to the last of them instead, finding
+ * each step among the members sorted by address.
+ */
+static void
+jp_keys_order(struct lh_table *t, struct jp_frame *hits, int n)
+{
+	struct lh_entry *ents[JP_KEYS_LOCKSTEP], *cur[JP_KEYS_LOCKSTEP], *ent;
+	int succ[JP_KEYS_LOCKSTEP], i, j, found = 0;
+	bool first[JP_KEYS_LOCKSTEP];
+	struct jp_frame key, *hit;
+
+	if (n > JP_KEYS_LOCKSTEP)
+	{
+		qsort(hits, n, sizeof(*hits), jp_cmp_ent);
+
+		for (ent = t->head; ent && found < n; ent = ent->next)
+		{
+			key.ent = ent;
+			hit = bsearch(&key, hits, n, sizeof(*hits), jp_cmp_ent);
+
+			if (hit)
+				hit->idx = found++;
+		}
+
+		qsort(hits, n, sizeof(*hits), jp_cmp_rank);
+
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		ents[i] = hits[i].ent;
+		cur[i] = ents[i]->next;
+		succ[i] = -1;
+		first[i] = true;
+	}
+
+	while (found < n - 1)
+	{
+		for (i = 0; i < n; i++)
+		{
+			if (succ[i] >= 0 || !cur[i])
+				continue;
+
+			for (j = 0; j < n && cur[i] != ents[j]; j++)
+				;
+
+			if (j < n)
+			{
+				succ[i] = j;
+				first[j] = false;
+				found++;
+			}
+			else
+			{
+				cur[i] = cur[i]->next;
 			}
 		}
+	}
 
-		break;
+	for (i = 0; !first[i]; i++)
+		;
 
-	default:
-		break;
+	for (j = n - 1; j >= 0; j--, i = succ[i])
+		hits[j].ent = ents[i];
+}
+
+/* looks up the members of a key union, leaving them on the walk stack */
+static bool
+jp_keys_find(const struct jp_prog *prog, int arg, struct jp_ctx *ctx,
+             struct json_object *obj, struct jp_walk *w)
+{
+	const struct jp_value *list = &prog->consts[arg];
+	struct lh_table *t = json_object_get_object(obj);
+	struct lh_entry *ent;
+	struct jp_frame *pos;
+	int i, base = w->npos;
+
+	for (i = 1; i <= list->num; i++)
+	{
+		if ((ent = jp_key_entry(prog, arg + i, ctx, t)) == NULL)
+			continue;
+
+		if ((pos = jp_walk_alloc(w, ctx)) == NULL)
+			return false;
+
+		pos->ent = ent;
 	}
 
-	return res;
+	if (w->npos - base > 1)
+		jp_keys_order(t, &w->pos[base], w->npos - base);
+
+	return (w->npos > base);
 }
 
-static struct json_object *
-jp_match_next(struct jp_opcode *ptr,
-              struct json_object *root, struct json_object *cur,
-              jp_match_cb_t cb, void *priv)
+static bool
+jp_keys_next(struct jp_frame *f, struct jp_walk *w, struct json_object **cur)
 {
-	int idx;
-	struct json_object *next = NULL;
+	if (w->npos == f->idx)
+		return false;
+
+	*cur = lh_entry_v(w->pos[--w->npos].ent);
 
-	if (!ptr)
+	return true;
+}
+
+/*
+ * Index unions select elements by position. Applied to an object they
+ * select all members if -1 is listed, as members have no index.
+ */
+static bool
+jp_indexes_all(const struct jp_value *list)
+{
+	int i;
+
+	for (i = 1; i <= list->num && list[i].num <= -1; i++)
+		if (list[i].num == -1)
+			return true;
+
+	return false;
+}
+
+static bool
+jp_indexes_next(const struct jp_prog *prog, struct jp_frame *f,
+                struct json_object **cur)
+{
+	const struct jp_value *list = &prog->consts[prog->code[f->pc].arg];
+
+	if (f->ent)
 	{
-		if (cb)
-			cb(cur, priv);
+		*cur = lh_entry_v(f->ent);
+		f->ent = f->ent->next;
 
-		return cur;
+		return true;
 	}
 
-	switch (ptr->type)
+	while (f->obj && ++f->idx <= list->num)
 	{
-	case T_STRING:
-	case T_LABEL:
-		if (json_object_object_get_ex(cur, ptr->str, &next))
-			return jp_match_next(ptr->sibling, root, next, cb, priv);
+		if (list[f->idx].num < 0)
+			continue;
 
-		break;
+		if (list[f->idx].num >= f->len)
+			break;
 
-	case T_NUMBER:
-		if (json_object_get_type(cur) == json_type_array)
+		*cur = json_object_array_get_idx(f->obj, list[f->idx].num);
+
+		return true;
+	}
+
+	return false;
+}
+
+/* resumes the innermost frame with its next value */
+static bool
+jp_frame_next(const struct jp_prog *prog, struct jp_frame *f,
+              struct jp_walk *walk, struct jp_ctx *ctx,
+              struct json_object **cur)
+{
+	switch (prog->code[f->pc].op)
+	{
+	case JP_OP_DESCEND:
+		return jp_walk_next(walk, f->idx, ctx, cur);
+
+	case JP_OP_SLICE:
+		if (!jp_slice_next(f, cur))
+			return false;
+
+		JP_STAT_ADD(ctx, keys, 1);
+		return true;
+
+	case JP_OP_KEYS:
+		return jp_keys_next(f, walk, cur);
+
+	case JP_OP_INDEXES:
+		if (!jp_indexes_next(prog, f, cur))
+			return false;
+
+		JP_STAT_ADD(ctx, keys, 1);
+		return true;
+
+	default:
+		return jp_scan_next(prog, f, ctx, cur);
+	}
+}
+
+/*
+ * Runs the path starting at pc against cur. Steps that select a single
+ * child move cur forward, scans push a frame and the machine backtracks to
+ * the innermost frame whenever a step fails or a value was emitted.
+ */
+struct json_object *
+jp_run(const struct jp_prog *prog, int pc, struct jp_ctx *ctx,
+       struct json_object *cur)
+{
+	const struct jp_insn *insn;
+	struct jp_frame frames[prog->nframes + 1], *f;
+	struct jp_walk walk;
+	struct json_object *next, *res = NULL;
+	int nf = 0, idx;
+
+	if (ctx->stop)
+		return NULL;
+
+	walk.pos = walk.buf;
+	walk.npos = 0;
+	walk.apos = JP_WALK_BUF;
+
+	for (;;)
+	{
+		insn = &prog->code[pc];
+
+		switch (insn->op)
 		{
-			idx = ptr->num;
+		case JP_OP_KEY:
+			JP_STAT_ADD(ctx, keys, 1);
+
+			if (!jp_key(prog, insn->arg, ctx, cur, &next))
+				goto backtrack;
+
+			JP_STAT_ADD(ctx, nodes, 1);
+			cur = next;
+			pc++;
+			continue;
+
+		case JP_OP_INDEX:
+			if (json_object_get_type(cur) != json_type_array)
+				goto backtrack;
+
+			idx = insn->arg;
 
 			if (idx < 0)
 				idx += json_object_array_length(cur);
 
-			if (idx >= 0)
-				next = json_object_array_get_idx(cur, idx);
+			next = (idx >= 0) ? json_object_array_get_idx(cur, idx) : NULL;
+			JP_STAT_ADD(ctx, keys, 1);
+
+			if (!next)
+				goto backtrack;
+
+			JP_STAT_ADD(ctx, nodes, 1);
+			cur = next;
+			pc++;
+			continue;
+
+		case JP_OP_SCAN:
+			f = &frames[nf];
+			f->pc = pc;
+			f->obj = cur;
+			f->ent = NULL;
+			f->idx = -1;
+			f->len = 0;
+
+			switch (json_object_get_type(cur))
+			{
+			case json_type_object:
+				f->ent = json_object_get_object(cur)->head;
+
+				if (!f->ent)
+					goto backtrack;
+
+				break;
+
+			case json_type_array:
+				f->len = json_object_array_length(cur);
+				break;
+
+			default:
+				goto backtrack;
+			}
+
+			nf++;
+			goto resume;
+
+		case JP_OP_SLICE:
+			if (json_object_get_type(cur) != json_type_array)
+				goto backtrack;
+
+			f = &frames[nf];
+			f->pc = pc;
+			f->obj = cur;
+			f->ent = NULL;
+
+			if (!jp_slice_range(&prog->consts[insn->arg],
+			                    json_object_array_length(cur),
+			                    &f->idx, &f->len, &f->step))
+				goto backtrack;
+
+			nf++;
+			goto resume;
+
+		case JP_OP_KEYS:
+			if (json_object_get_type(cur) != json_type_object)
+				goto backtrack;
+
+			f = &frames[nf];
+			f->pc = pc;
+			f->idx = walk.npos;
+
+			JP_STAT_ADD(ctx, keys, prog->consts[insn->arg].num);
+
+			if (!jp_keys_find(prog, insn->arg, ctx, cur, &walk))
+				goto backtrack;
 
-			if (next)
-				return jp_match_next(ptr->sibling, root, next, cb, priv);
+			nf++;
+			goto resume;
+
+		case JP_OP_INDEXES:
+			f = &frames[nf];
+			f->pc = pc;
+			f->obj = NULL;
+			f->ent = NULL;
+			f->idx = 0;
+			f->len = 0;
+
+			switch (json_object_get_type(cur))
+			{
+			case json_type_object:
+				if (!jp_indexes_all(&prog->consts[insn->arg]))
+					goto backtrack;
+
+				f->ent = json_object_get_object(cur)->head;
+
+				if (!f->ent)
+					goto backtrack;
+
+				break;
+
+			case json_type_array:
+				f->obj = cur;
+				f->len = json_object_array_length(cur);
+				break;
+
+			default:
+				goto backtrack;
+			}
+
+			nf++;
+			goto resume;
+
+		case JP_OP_DESCEND:
+			if (!jp_is_container(cur))
+				goto backtrack;
+
+			/* the value itself is the first one the next step runs on */
+			f = &frames[nf++];
+			f->pc = pc;
+			f->idx = walk.npos;
+
+			if (!jp_walk_push(&walk, ctx, cur))
+				goto backtrack;
+
+			JP_STAT_MAX(ctx, depth, nf + walk.npos);
+			pc++;
+			continue;
+
+		default:
+			if (cur && !res)
+				res = cur;
+
+			jp_emit(ctx, cur);
+			goto backtrack;
 		}
 
-		break;
+backtrack:
+		/* no more matches wanted, or no memory left: drop all frames */
+		if (nf == 0 || ctx->stop)
+		{
+			if (walk.pos != walk.buf)
+				free(walk.pos);
 
-	default:
-		return jp_match_expr(ptr, root, cur, cb, priv);
+			return res;
+		}
+
+resume:
+		f = &frames[nf - 1];
+
+		if (!jp_frame_next(prog, f, &walk, ctx, &cur))
+		{
+			nf--;
+			goto backtrack;
+		}
+
+		JP_STAT_ADD(ctx, nodes, 1);
+		JP_STAT_MAX(ctx, depth, nf + walk.npos);
+		pc = f->pc + 1;
 	}
+}
 
-	return NULL;
+static struct json_object *
+jp_match_prog(const struct jp_prog *prog, struct json_object *jsobj,
+              struct jp_ctx *ctx)
+{
+	struct jp_value hoisted[prog->nhoists + 1];
+
+	jp_ctx_init(ctx, prog, jsobj, hoisted);
+
+	return jp_run(prog, 0, ctx, jsobj);
+}
+
+static struct json_object *
+jp_match_path(struct jp_opcode *path, json_object *jsobj, struct jp_ctx *ctx)
+{
+	struct jp_prog *prog = path->prog;
+	struct json_object *res;
+
+	if (prog)
+		return jp_match_prog(prog, jsobj, ctx);
+
+	/* paths that did not come out of jp_parse() are compiled on the fly */
+	prog = jp_compile(NULL, path);
+
+	if (!prog)
+		return NULL;
+
+	res = jp_match_prog(prog, jsobj, ctx);
+	jp_prog_free(prog);
+
+	return res;
 }
 
 struct json_object *
 jp_match(struct jp_opcode *path, json_object *jsobj,
          jp_match_cb_t cb, void *priv)
 {
-	if (path->type == T_LABEL)
-		path = path->down;
+	struct jp_ctx ctx = { .notify = cb, .priv = priv, .left = -1 };
+
+	return jp_match_path(path, jsobj, &ctx);
+}
+
+struct json_object *
+jp_match_limit(struct jp_opcode *path, json_object *jsobj,
+               jp_match_stop_cb_t cb, void *priv, int max_results)
+{
+	struct jp_ctx ctx = { .cb = cb, .priv = priv, .left = max_results };
+
+	return jp_match_path(path, jsobj, &ctx);
+}
+
+struct json_object *
+jp_match_stats(struct jp_opcode *path, json_object *jsobj,
+               jp_match_cb_t cb, void *priv, struct jp_stats *stats)
+{
+	struct jp_ctx ctx = { .notify = cb, .priv = priv, .left = -1,
+	                      .stats = stats };
+
+	memset(stats, 0, sizeof(*stats));
 
-	return jp_match_next(path->down, jsobj, jsobj, cb, priv);
+	return jp_match_path(path, jsobj, &ctx);
 }
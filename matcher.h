@@ -22,4 +22,138 @@
 
 #include <json.h>
 
+#include "compiler.h"
+
+/*
+ * State of one match. Hoisted operands are evaluated against root the
+ * first time a predicate needs them and kept in hoisted[], which must hold
+ * prog->nhoists values, until the match ends.
+ * Matches go to cb, or to notify which cannot stop the match, and at most
+ * left of them are reported. Once stop is set nothing more is reported.
+ * Work done is counted in stats, if given.
+ */
+struct jp_ctx {
+	struct json_object *root;
+	struct jp_value *hoisted;
+
+	jp_match_stop_cb_t cb;
+	jp_match_cb_t notify;
+	void *priv;
+	int left;
+	bool stop;
+
+	/* the match was stopped as the walk stack could not grow */
+	bool oom;
+
+	struct jp_stats *stats;
+};
+
+/* counters of jp_match_stats(), only built with JP_STATS defined */
+#ifdef JP_STATS
+#define JP_STAT_ADD(ctx, field, n) \
+	do { if ((ctx)->stats) (ctx)->stats->field += (n); } while (0)
+#define JP_STAT_MAX(ctx, field, n) \
+	do { if ((ctx)->stats && (ctx)->stats->field < (n)) \
+	         (ctx)->stats->field = (n); } while (0)
+#else
+#define JP_STAT_ADD(ctx, field, n) do { } while (0)
+#define JP_STAT_MAX(ctx, field, n) do { } while (0)
+#endif
+
+/*
+ * Looks up a member by the key at consts[arg]. Objects of the same shape,
+ * with the same members added in the same order, keep each member in the
+ * same slot of their tables, so the slot the key was last found in is
+ * tried first. Otherwise the table is probed with the hash jp_compile()
+ * computed, unless it was created with another hash function.
+ *
+ * Matches running in parallel share the slots, which are only ever read
+ * and replaced whole.
+ */
+static inline struct lh_entry *
+jp_key_entry(const struct jp_prog *prog, int arg, struct jp_ctx *ctx,
+             struct lh_table *t)
+{
+	const struct jp_value *key = &prog->consts[arg];
+	struct lh_entry *ent;
+	int slot;
+
+	if (t->hash_fn != prog->hash_fn)
+		return lh_table_lookup_entry(t, key->str);
+
+	slot = __atomic_load_n(&prog->slots[arg], __ATOMIC_RELAXED);
+
+	if (slot < t->size)
+	{
+		ent = &t->table[slot];
+
+		if (ent->k != LH_EMPTY && ent->k != LH_FREED &&
+		    !strcmp((const char *)ent->k, key->str))
+		{
+			JP_STAT_ADD(ctx, key_hits, 1);
+			return ent;
+		}
+	}
+
+	JP_STAT_ADD(ctx, key_misses, 1);
+
+	ent = lh_table_lookup_entry_w_hash(t, key->str, key->hash);
+
+	if (ent && ent - t->table != slot)
+		__atomic_store_n(&prog->slots[arg], ent - t->table, __ATOMIC_RELAXED);
+
+	return ent;
+}
+
+/* as json_object_object_get_ex() for the key at consts[arg] */
+static inline bool
+jp_key(const struct jp_prog *prog, int arg, struct jp_ctx *ctx,
+       struct json_object *obj, struct json_object **val)
+{
+	struct lh_entry *ent;
+
+	if (json_object_get_type(obj) != json_type_object)
+		return false;
+
+	ent = jp_key_entry(prog, arg, ctx, json_object_get_object(obj));
+
+	if (!ent)
+		return false;
+
+	*val = (struct json_object *)lh_entry_v(ent);
+
+	return true;
+}
+
+/* the type of hoisted values not evaluated yet */
+#define JP_UNRESOLVED -1
+
+/* starts a match, the callbacks and left are set up by the caller before */
+void
+jp_ctx_init(struct jp_ctx *ctx, const struct jp_prog *prog,
+            struct json_object *root, struct jp_value *hoisted);
+
+/* reports a match, returns true once no more matches are wanted */
+bool
+jp_emit(struct jp_ctx *ctx, struct json_object *res);
+
+/* runs the path at pc against cur, as jp_match() does from the start */
+struct json_object *
+jp_run(const struct jp_prog *prog, int pc, struct jp_ctx *ctx,
+       struct json_object *cur);
+
+/* the step of a slice as written, and its first index, bound and stride
+ * within len elements, the first index is returned one step early */
+int
+jp_slice_step(const struct jp_value *slice);
+
+bool
+jp_slice_range(const struct jp_value *slice, int len, int *idx, int *bound,
+               int *stride);
+
+/* evaluates the predicate at pc for a child found at idx or key */
+bool
+jp_pred(const struct jp_prog *prog, int pc, struct jp_ctx *ctx,
+        struct json_object *cur, int idx, const char *key);
+
 #endif
@@ -0,0 +1,583 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jsonpath.h"
+#include "matcher.h"
+
+/*
+ * The steps of all paths in a set are merged into a trie, identical
+ * leading steps share one node. Matching walks the document once, carrying
+ * the set of trie nodes positioned at the current value: children reached
+ * by several nodes are visited a single time with the union of them.
+ */
+
+struct jp_set_path {
+	struct jp_set_path *next;
+	struct jp_set_path *list;
+	const struct jp_prog *prog;
+	struct jp_prog *own;
+	struct jp_ctx ctx;
+	int max;
+};
+
+struct jp_set_node {
+	struct jp_set_node *child;
+	struct jp_set_node *sibling;
+	const struct jp_prog *prog;
+	struct jp_ctx *ctx;
+	int pc;
+
+	/* hand the rest of the path from pc to the ordinary matcher, for
+	 * steps the trie does not handle itself */
+	bool run;
+
+	/* some child step needs to look at every member */
+	bool scan;
+
+	/* paths ending at this node, in the order they were added */
+	struct jp_set_path *ends;
+};
+
+struct jp_set {
+	struct jp_set_node root;
+	struct jp_set_path *paths;
+	struct jp_set_node **nodes;
+	struct json_object **vals;
+	int nnodes;
+	int depth;
+
+	/* paths still wanting matches */
+	int live;
+};
+
+static bool jp_path_equal(const struct jp_prog *a, int apc,
+                          const struct jp_prog *b, int bpc);
+
+static bool
+jp_const_equal(const struct jp_value *a, const struct jp_value *b)
+{
+	if (a->type != b->type || a->num != b->num)
+		return false;
+
+	return (a->type != T_STRING || !strcmp(a->str, b->str));
+}
+
+static bool
+jp_test_equal(const struct jp_prog *a, const struct jp_test *x,
+              const struct jp_prog *b, const struct jp_test *y)
+{
+	return (x->root == y->root && x->cmp == y->cmp &&
+	        jp_const_equal(&x->lit, &y->lit) &&
+	        jp_path_equal(a, x->path, b, y->path));
+}
+
+static bool
+jp_hoist_equal(const struct jp_prog *a, const struct jp_insn *x,
+               const struct jp_prog *b, const struct jp_insn *y)
+{
+	if (x->op != y->op || x->aux != y->aux)
+		return false;
+
+	if (x->op == JP_OP_TEST)
+		return jp_test_equal(a, &a->tests[x->arg], b, &b->tests[y->arg]);
+
+	return jp_path_equal(a, x->arg, b, y->arg);
+}
+
+static bool
+jp_pred_equal(const struct jp_prog *a, int apc,
+              const struct jp_prog *b, int bpc)
+{
+	const struct jp_insn *x, *y;
+
+	for (;; apc++, bpc++)
+	{
+		x = &a->code[apc];
+		y = &b->code[bpc];
+
+		if (x->op != y->op || x->aux != y->aux)
+			return false;
+
+		switch (x->op)
+		{
+		case JP_OP_LOAD:
+		case JP_OP_IS_KEY:
+			if (!jp_const_equal(&a->consts[x->arg], &b->consts[y->arg]))
+				return false;
+
+			break;
+
+		case JP_OP_IS_INDEX:
+			if (x->arg != y->arg)
+				return false;
+
+			break;
+
+		case JP_OP_AND:
+		case JP_OP_OR:
+			if (x->arg - apc != y->arg - bpc)
+				return false;
+
+			break;
+
+		case JP_OP_EXISTS:
+		case JP_OP_RESOLVE:
+			if (!jp_path_equal(a, x->arg, b, y->arg))
+				return false;
+
+			break;
+
+		case JP_OP_TEST:
+			if (!jp_test_equal(a, &a->tests[x->arg], b, &b->tests[y->arg]))
+				return false;
+
+			break;
+
+		case JP_OP_HOIST:
+			if (!jp_hoist_equal(a, &a->hoists[x->arg], b, &b->hoists[y->arg]))
+				return false;
+
+			break;
+
+		case JP_OP_RET:
+			return true;
+		}
+	}
+}
+
+static bool
+jp_step_equal(const struct jp_prog *a, int apc,
+              const struct jp_prog *b, int bpc)
+{
+	const struct jp_insn *x = &a->code[apc], *y = &b->code[bpc];
+	int i;
+
+	if (x->op != y->op)
+		return false;
+
+	switch (x->op)
+	{
+	case JP_OP_KEY:
+		return !strcmp(a->consts[x->arg].str, b->consts[y->arg].str);
+
+	case JP_OP_INDEX:
+		return (x->arg == y->arg);
+
+	case JP_OP_SCAN:
+		return jp_pred_equal(a, x->arg, b, y->arg);
+
+	case JP_OP_SLICE:
+		return (jp_const_equal(&a->consts[x->arg], &b->consts[y->arg]) &&
+		        jp_const_equal(&a->consts[x->arg + 1], &b->consts[y->arg + 1]) &&
+		        jp_const_equal(&a->consts[x->arg + 2], &b->consts[y->arg + 2]));
+
+	case JP_OP_KEYS:
+	case JP_OP_INDEXES:
+		for (i = 0; i <= a->consts[x->arg].num; i++)
+			if (!jp_const_equal(&a->consts[x->arg + i], &b->consts[y->arg + i]))
+				return false;
+
+		return true;
+
+	case JP_OP_DESCEND:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static bool
+jp_path_equal(const struct jp_prog *a, int apc,
+              const struct jp_prog *b, int bpc)
+{
+	for (;; apc++, bpc++)
+	{
+		if (a->code[apc].op == JP_OP_EMIT || b->code[bpc].op == JP_OP_EMIT)
+			return (a->code[apc].op == b->code[bpc].op);
+
+		if (!jp_step_equal(a, apc, b, bpc))
+			return false;
+	}
+}
+
+struct jp_set *
+jp_set_new(void)
+{
+	return calloc(1, sizeof(struct jp_set));
+}
+
+static struct jp_set_node *
+jp_set_child(struct jp_set *set, struct jp_set_node *node,
+             struct jp_set_path *p, int pc, bool run)
+{
+	const struct jp_prog *prog = p->prog;
+	struct jp_set_node *child, **tail;
+
+	for (tail = &node->child; *tail; tail = &(*tail)->sibling)
+		if (!run && !(*tail)->run &&
+		    jp_step_equal((*tail)->prog, (*tail)->pc, prog, pc))
+			return *tail;
+
+	child = calloc(1, sizeof(*child));
+
+	if (!child)
+		return NULL;
+
+	child->prog = prog;
+	child->ctx = &p->ctx;
+	child->pc = pc;
+	child->run = run;
+	*tail = child;
+
+	if (prog->code[pc].op == JP_OP_SCAN)
+		node->scan = true;
+
+	set->nnodes++;
+
+	return child;
+}
+
+static int
+jp_set_add_path(struct jp_set *set, struct jp_opcode *path,
+                jp_match_stop_cb_t cb, jp_match_cb_t notify, void *userdata,
+                int max)
+{
+	struct jp_set_node *node = &set->root, **nodes;
+	struct jp_set_path *p, **tail;
+	struct json_object **vals;
+	const struct jp_prog *prog;
+	int pc, size;
+
+	p = calloc(1, sizeof(*p));
+
+	if (!p)
+		return -1;
+
+	prog = path->prog;
+
+	if (!prog)
+		prog = p->own = jp_compile(NULL, path);
+
+	if (prog)
+		p->ctx.hoisted = calloc(prog->nhoists + 1, sizeof(*p->ctx.hoisted));
+
+	if (!prog || !p->ctx.hoisted)
+	{
+		jp_prog_free(p->own);
+		free(p);
+		return -1;
+	}
+
+	p->prog = prog;
+	p->ctx.cb = cb;
+	p->ctx.notify = notify;
+	p->ctx.priv = userdata;
+	p->max = max;
+	p->list = set->paths;
+	set->paths = p;
+
+	for (pc = 0; prog->code[pc].op != JP_OP_EMIT; pc++)
+	{
+		switch (prog->code[pc].op)
+		{
+		case JP_OP_KEY:
+		case JP_OP_INDEX:
+		case JP_OP_SCAN:
+			node = jp_set_child(set, node, p, pc, false);
+			break;
+
+		default:
+			node = jp_set_child(set, node, p, pc, true);
+			break;
+		}
+
+		if (!node)
+			return -1;
+
+		if (node->run)
+			break;
+	}
+
+	for (tail = &node->ends; *tail; tail = &(*tail)->next)
+		;
+
+	*tail = p;
+
+	if (pc + 1 > set->depth)
+		set->depth = pc + 1;
+
+	/* every level of the walk holds at most two sets of nodes */
+	size = 2 * (set->nnodes + 1) * (set->depth + 1);
+
+	nodes = realloc(set->nodes, size * sizeof(*nodes));
+
+	if (!nodes)
+		return -1;
+
+	set->nodes = nodes;
+
+	vals = realloc(set->vals, size * sizeof(*vals));
+
+	if (!vals)
+		return -1;
+
+	set->vals = vals;
+
+	return 0;
+}
+
+int
+jp_set_add(struct jp_set *set, struct jp_opcode *path,
+           jp_match_cb_t cb, void *userdata)
+{
+	return jp_set_add_path(set, path, NULL, cb, userdata, -1);
+}
+
+int
+jp_set_add_limit(struct jp_set *set, struct jp_opcode *path,
+                 jp_match_stop_cb_t cb, void *userdata, int max_results)
+{
+	return jp_set_add_path(set, path, cb, NULL, userdata, max_results);
+}
+
+static bool
+jp_set_accept(struct jp_set_node *child, struct json_object *val,
+              int idx, int len, const char *key)
+{
+	const struct jp_insn *insn = &child->prog->code[child->pc];
+
+	switch (insn->op)
+	{
+	case JP_OP_KEY:
+		return (key && !strcmp(child->prog->consts[insn->arg].str, key));
+
+	case JP_OP_INDEX:
+		return (!key && val &&
+		        (insn->arg == idx || insn->arg + len == idx));
+
+	case JP_OP_SCAN:
+		return jp_pred(child->prog, insn->arg, child->ctx, val, idx, key);
+
+	default:
+		return false;
+	}
+}
+
+/*
+ * Visits cur with the n trie nodes positioned at it. The sets of nodes for
+ * its children are built in the scratch space following nodes[n].
+ */
+static void
+jp_set_visit(struct jp_set *set, struct json_object *cur,
+             struct jp_set_node **nodes, int n)
+{
+	struct jp_set_node *child, **next = nodes + n, **group;
+	struct json_object *val, **vals;
+	struct jp_set_path *p;
+	struct lh_entry *ent;
+	bool scan = false;
+	int i, j, k, m, idx, len;
+
+	for (i = 0; i < n; i++)
+	{
+		for (p = nodes[i]->ends; p; p = p->next)
+			if (!p->ctx.stop && jp_emit(&p->ctx, cur))
+				set->live--;
+
+		for (child = nodes[i]->child; child; child = child->sibling)
+		{
+			if (!child->run || child->ctx->stop)
+				continue;
+
+			jp_run(child->prog, child->pc, child->ctx, cur);
+
+			if (child->ctx->stop)
+				set->live--;
+		}
+
+		scan |= nodes[i]->scan;
+	}
+
+	if (!set->live)
+		return;
+
+	if (scan)
+	{
+		switch (json_object_get_type(cur))
+		{
+		case json_type_object:
+			for (ent = json_object_get_object(cur)->head;
+			     ent && set->live; ent = ent->next)
+			{
+				val = lh_entry_v(ent);
+
+				for (i = 0, m = 0; i < n; i++)
+					for (child = nodes[i]->child; child; child = child->sibling)
+						if (jp_set_accept(child, val, -1, 0, lh_entry_k(ent)))
+							next[m++] = child;
+
+				if (m)
+					jp_set_visit(set, val, next, m);
+			}
+
+			break;
+
+		case json_type_array:
+			len = json_object_array_length(cur);
+
+			for (idx = 0; idx < len && set->live; idx++)
+			{
+				val = json_object_array_get_idx(cur, idx);
+
+				for (i = 0, m = 0; i < n; i++)
+					for (child = nodes[i]->child; child; child = child->sibling)
+						if (jp_set_accept(child, val, idx, len, NULL))
+							next[m++] = child;
+
+				if (m)
+					jp_set_visit(set, val, next, m);
+			}
+
+			break;
+
+		default:
+			break;
+		}
+
+		return;
+	}
+
+	/* only direct steps, look every child up and visit each distinct one
+	 * once with all nodes leading to it */
+	vals = set->vals + (next - set->nodes);
+
+	for (i = 0, m = 0; i < n; i++)
+	{
+		for (child = nodes[i]->child; child; child = child->sibling)
+		{
+			if (child->run)
+				continue;
+
+			if (child->prog->code[child->pc].op == JP_OP_KEY)
+			{
+				if (!jp_key(child->prog, child->prog->code[child->pc].arg,
+				            child->ctx, cur, &val))
+					continue;
+			}
+			else
+			{
+				if (json_object_get_type(cur) != json_type_array)
+					continue;
+
+				idx = child->prog->code[child->pc].arg;
+
+				if (idx < 0)
+					idx += json_object_array_length(cur);
+
+				if (idx < 0 || !(val = json_object_array_get_idx(cur, idx)))
+					continue;
+			}
+
+			vals[m] = val;
+			next[m++] = child;
+		}
+	}
+
+	group = next + m;
+
+	for (i = 0; i < m && set->live; i++)
+	{
+		if (!next[i])
+			continue;
+
+		group[0] = next[i];
+
+		for (j = i + 1, k = 1; vals[i] && j < m; j++)
+		{
+			if (next[j] && vals[j] == vals[i])
+			{
+				group[k++] = next[j];
+				next[j] = NULL;
+			}
+		}
+
+		jp_set_visit(set, vals[i], group, k);
+	}
+}
+
+void
+jp_match_set(struct jp_set *set, struct json_object *input)
+{
+	struct jp_set_path *p;
+
+	if (!set->nodes)
+		return;
+
+	set->live = 0;
+
+	for (p = set->paths; p; p = p->list)
+	{
+		p->ctx.left = p->max;
+		jp_ctx_init(&p->ctx, p->prog, input, p->ctx.hoisted);
+
+		if (!p->ctx.stop)
+			set->live++;
+	}
+
+	set->nodes[0] = &set->root;
+	jp_set_visit(set, input, set->nodes, 1);
+}
+
+static void
+jp_set_free_node(struct jp_set_node *node)
+{
+	struct jp_set_node *child, *tmp;
+
+	for (child = node->child; child; child = tmp)
+	{
+		tmp = child->sibling;
+		jp_set_free_node(child);
+		free(child);
+	}
+}
+
+void
+jp_set_free(struct jp_set *set)
+{
+	struct jp_set_path *p, *tmp;
+
+	if (!set)
+		return;
+
+	jp_set_free_node(&set->root);
+
+	for (p = set->paths; p; p = tmp)
+	{
+		tmp = p->list;
+		jp_prog_free(p->own);
+		free(p->ctx.hoisted);
+		free(p);
+	}
+
+	free(set->nodes);
+	free(set->vals);
+	free(set);
+}
@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "matcher.h"
+#include "pool.h"
+
+/* scans and slices over at least this many children are split up */
+#define JP_PAR_MIN	1024
+
+/* fewest children a partition is given */
+#define JP_PAR_PART	256
+
+/*
+ * Up to the first wide step the path is followed on the calling thread.
+ * The children a large scan or slice visits are then split into ranges,
+ * each of which runs the rest of the path on a pool thread. Matches are
+ * collected per range as borrowed pointers and reported in range order,
+ * which is the order the sequential matcher yields them in. The document
+ * is only read, no reference counts are touched.
+ */
+struct jp_par {
+	const struct jp_prog *prog;
+	struct jp_pool *pool;
+	struct jp_ctx *ctx;
+	struct json_object *first;
+};
+
+/* children visited by a scan or slice step, at start + k * step */
+struct jp_par_span {
+	int pc;
+	struct json_object *obj;
+	struct lh_entry **ents;
+	int start, step, count;
+};
+
+struct jp_par_part {
+	struct jp_par *par;
+	const struct jp_par_span *span;
+	int from, to;
+	struct jp_results res;
+	struct jp_value *hoisted;
+	int left;
+};
+
+static bool
+jp_par_span_init(const struct jp_prog *prog, int pc, struct json_object *cur,
+                 struct jp_par_span *span)
+{
+	const struct jp_insn *insn = &prog->code[pc];
+	struct lh_table *tab;
+	struct lh_entry *ent;
+	int idx, bound, n;
+
+	span->pc = pc;
+	span->obj = cur;
+	span->ents = NULL;
+	span->start = 0;
+	span->step = 1;
+
+	switch (json_object_get_type(cur))
+	{
+	case json_type_object:
+		if (insn->op != JP_OP_SCAN)
+			return false;
+
+		/* members are indexed once so ranges can start anywhere */
+		tab = json_object_get_object(cur);
+		span->ents = malloc((tab->count + 1) * sizeof(*span->ents));
+
+		if (!span->ents)
+			return false;
+
+		for (ent = tab->head, n = 0; ent; ent = ent->next)
+			span->ents[n++] = ent;
+
+		span->count = n;
+		return true;
+
+	case json_type_array:
+		n = json_object_array_length(cur);
+
+		if (insn->op == JP_OP_SCAN)
+		{
+			span->count = n;
+			return true;
+		}
+
+		if (!jp_slice_range(&prog->consts[insn->arg], n, &idx, &bound,
+		                    &span->step))
+			return false;
+
+		span->start = idx + span->step;
+
+		if (span->step > 0)
+			n = bound - span->start;
+		else
+			n = span->start - bound;
+
+		n = (n > 0) ? (n - 1) / abs(span->step) + 1 : 0;
+		span->count = n;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/* yields the k-th child of a span, if the step selects it */
+static bool
+jp_par_child(const struct jp_prog *prog, const struct jp_par_span *span,
+             struct jp_ctx *ctx, int k, struct json_object **val)
+{
+	const struct jp_insn *insn = &prog->code[span->pc];
+	int idx = span->start + k * span->step;
+
+	if (span->ents)
+	{
+		*val = lh_entry_v(span->ents[idx]);
+
+		return jp_pred(prog, insn->arg, ctx, *val, -1,
+		               lh_entry_k(span->ents[idx]));
+	}
+
+	*val = json_object_array_get_idx(span->obj, idx);
+
+	if (insn->op == JP_OP_SLICE)
+		return true;
+
+	return jp_pred(prog, insn->arg, ctx, *val, idx, NULL);
+}
+
+static void
+jp_par_run(struct jp_par *par, int pc, struct json_object *cur)
+{
+	struct json_object *res = jp_run(par->prog, pc, par->ctx, cur);
+
+	if (!par->first)
+		par->first = res;
+}
+
+/* runs a range of a span on the calling thread, reporting right away */
+static void
+jp_par_range(struct jp_par *par, const struct jp_par_span *span,
+             int from, int to)
+{
+	struct json_object *val;
+	int k;
+
+	for (k = from; k < to && !par->ctx->stop; k++)
+		if (jp_par_child(par->prog, span, par->ctx, k, &val))
+			jp_par_run(par, span->pc + 1, val);
+}
+
+static void
+jp_par_task(void *arg, int i)
+{
+	struct jp_par_part *part = (struct jp_par_part *)arg + i;
+	const struct jp_prog *prog = part->par->prog;
+	const struct jp_par_span *span = part->span;
+	struct jp_ctx ctx = { .cb = jp_results_cb, .priv = &part->res,
+	                      .left = part->left };
+	struct json_object *val;
+	int k;
+
+	jp_ctx_init(&ctx, prog, part->par->ctx->root, part->hoisted);
+
+	for (k = part->from; k < part->to && !ctx.stop; k++)
+		if (jp_par_child(prog, span, &ctx, k, &val))
+			jp_run(prog, span->pc + 1, &ctx, val);
+
+	if (ctx.oom)
+		part->res.failed = 1;
+}
+
+static void
+jp_par_split(struct jp_par *par, const struct jp_par_span *span)
+{
+	const struct jp_prog *prog = par->prog;
+	struct jp_par_part *parts;
+	struct jp_value *hoisted;
+	struct json_object *val;
+	int i, j, n;
+
+	n = span->count / JP_PAR_PART;
+
+	if (n > 4 * jp_pool_size(par->pool))
+		n = 4 * jp_pool_size(par->pool);
+
+	parts = calloc(n, sizeof(*parts));
+	hoisted = calloc(n * (prog->nhoists + 1), sizeof(*hoisted));
+
+	if (!parts || !hoisted)
+	{
+		jp_par_range(par, span, 0, span->count);
+		goto out;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		parts[i].par = par;
+		parts[i].span = span;
+		parts[i].from = (int)((long)span->count * i / n);
+		parts[i].to = (int)((long)span->count * (i + 1) / n);
+		parts[i].hoisted = hoisted + i * (prog->nhoists + 1);
+
+		/* no range can contribute more than the whole match wants */
+		parts[i].left = par->ctx->left;
+		jp_results_init(&parts[i].res, NULL, 0);
+	}
+
+	jp_pool_for(par->pool, n, jp_par_task, parts);
+
+	for (i = 0; i < n && !par->ctx->stop; i++)
+	{
+		/* a range running out of memory is redone here */
+		if (parts[i].res.failed)
+		{
+			jp_par_range(par, span, parts[i].from, parts[i].to);
+			continue;
+		}
+
+		for (j = 0; j < parts[i].res.count; j++)
+		{
+			val = parts[i].res.items[j];
+
+			if (!par->first)
+				par->first = val;
+
+			if (jp_emit(par->ctx, val))
+				break;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		jp_results_free(&parts[i].res);
+
+out:
+	free(hoisted);
+	free(parts);
+}
+
+static void
+jp_par_visit(struct jp_par *par, int pc, struct json_object *cur)
+{
+	const struct jp_prog *prog = par->prog;
+	const struct jp_insn *insn;
+	struct jp_par_span span;
+	struct json_object *val;
+	int idx, k;
+
+	for (;; pc++)
+	{
+		insn = &prog->code[pc];
+
+		if (insn->op == JP_OP_KEY)
+		{
+			if (!jp_key(prog, insn->arg, par->ctx, cur, &cur))
+				return;
+		}
+		else if (insn->op == JP_OP_INDEX)
+		{
+			if (json_object_get_type(cur) != json_type_array)
+				return;
+
+			idx = insn->arg;
+
+			if (idx < 0)
+				idx += json_object_array_length(cur);
+
+			cur = (idx >= 0) ? json_object_array_get_idx(cur, idx) : NULL;
+
+			if (!cur)
+				return;
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	if ((insn->op != JP_OP_SCAN && insn->op != JP_OP_SLICE) ||
+	    !jp_par_span_init(prog, pc, cur, &span))
+	{
+		jp_par_run(par, pc, cur);
+		return;
+	}
+
+	if (span.count >= JP_PAR_MIN)
+	{
+		jp_par_split(par, &span);
+	}
+	else
+	{
+		/* small, but a child may still hold a large container */
+		for (k = 0; k < span.count && !par->ctx->stop; k++)
+			if (jp_par_child(prog, &span, par->ctx, k, &val))
+				jp_par_visit(par, pc + 1, val);
+	}
+
+	free(span.ents);
+}
+
+static struct json_object *
+jp_par_match(const struct jp_prog *prog, struct json_object *jsobj,
+             struct jp_pool *pool, struct jp_ctx *ctx)
+{
+	struct jp_value hoisted[prog->nhoists + 1];
+	struct jp_par par = { .prog = prog, .pool = pool, .ctx = ctx };
+
+	jp_ctx_init(ctx, prog, jsobj, hoisted);
+
+	if (!ctx->stop)
+		jp_par_visit(&par, 0, jsobj);
+
+	return par.first;
+}
+
+struct json_object *
+jp_match_parallel(struct jp_opcode *path, struct json_object *jsobj,
+                  struct jp_pool *pool, jp_match_stop_cb_t cb, void *priv,
+                  int max_results)
+{
+	struct jp_ctx ctx = { .cb = cb, .priv = priv, .left = max_results };
+	struct jp_prog *prog = path->prog;
+	struct json_object *res;
+
+	if (prog)
+		return jp_par_match(prog, jsobj, pool, &ctx);
+
+	prog = jp_compile(NULL, path);
+
+	if (!prog)
+		return NULL;
+
+	res = jp_par_match(prog, jsobj, pool, &ctx);
+	jp_prog_free(prog);
+
+	return res;
+}
@@ -54,29 +54,29 @@ input ::= expr(A).									{ s->path = A; }
 expr(A) ::= T_LABEL(B) T_EQ path(C).				{ A = B; B->down = C; }
 expr(A) ::= path(B).								{ A = B; }
 
-path(A) ::= T_ROOT segments(B).						{ A = alloc_op(T_ROOT, 0, NULL, B); }
-path(A) ::= T_THIS segments(B).						{ A = alloc_op(T_THIS, 0, NULL, B); }
+path(A) ::= T_ROOT segments(B).						{ A = alloc_op(T_ROOT, 0, NULL, reverse_op(B)); }
+path(A) ::= T_THIS segments(B).						{ A = alloc_op(T_THIS, 0, NULL, reverse_op(B)); }
 
-segments(A) ::= segments(B) segment(C).				{ A = append_op(B, C); }
+segments(A) ::= segments(B) segment(C).				{ A = prepend_op(B, C); }
 segments(A) ::= segment(B).							{ A = B; }
 
 segment(A) ::= T_DOT T_LABEL(B).					{ A = B; }
 segment(A) ::= T_DOT T_WILDCARD(B).					{ A = B; }
 segment(A) ::= T_BROPEN union_exps(B) T_BRCLOSE.	{ A = B; }
 
-union_exps(A) ::= union_exp(B).						{ A = B->sibling ? alloc_op(T_UNION, 0, NULL, B) : B; }
+union_exps(A) ::= union_exp(B).						{ B = reverse_op(B); A = B->sibling ? alloc_op(T_UNION, 0, NULL, B) : B; }
 
-union_exp(A) ::= union_exp(B) T_UNION or_exps(C).	{ A = append_op(B, C); }
+union_exp(A) ::= union_exp(B) T_UNION or_exps(C).	{ A = prepend_op(B, C); }
 union_exp(A) ::= or_exps(B).						{ A = B; }
 
-or_exps(A) ::= or_exp(B).							{ A = B->sibling ? alloc_op(T_OR, 0, NULL, B) : B; }
+or_exps(A) ::= or_exp(B).							{ B = reverse_op(B); A = B->sibling ? alloc_op(T_OR, 0, NULL, B) : B; }
 
-or_exp(A) ::= or_exp(B) T_OR and_exps(C).			{ A = append_op(B, C); }
+or_exp(A) ::= or_exp(B) T_OR and_exps(C).			{ A = prepend_op(B, C); }
 or_exp(A) ::= and_exps(B).							{ A = B; }
 
-and_exps(A) ::= and_exp(B).							{ A = B->sibling ? alloc_op(T_AND, 0, NULL, B) : B; }
+and_exps(A) ::= and_exp(B).							{ B = reverse_op(B); A = B->sibling ? alloc_op(T_AND, 0, NULL, B) : B; }
 
-and_exp(A) ::= and_exp(B) T_AND cmp_exp(C).			{ A = append_op(B, C); }
+and_exp(A) ::= and_exp(B) T_AND cmp_exp(C).			{ A = prepend_op(B, C); }
 and_exp(A) ::= cmp_exp(B).							{ A = B; }
 
 cmp_exp(A) ::= unary_exp(B) T_LT unary_exp(C).		{ A = alloc_op(T_LT, 0, NULL, B, C); }
@@ -94,3 +94,18 @@ unary_exp(A) ::= T_WILDCARD(B).						{ A = B; }
 unary_exp(A) ::= T_POPEN or_exps(B) T_PCLOSE.		{ A = B; }
 unary_exp(A) ::= T_NOT unary_exp(B).				{ A = alloc_op(T_NOT, 0, NULL, B); }
 unary_exp(A) ::= path(B).							{ A = B; }
+
+/* kept last so the tokens below are numbered after the ones above */
+segment(A) ::= T_DOTDOT T_LABEL(B).					{ A = alloc_op(T_DOTDOT, 0, NULL, B); }
+segment(A) ::= T_DOTDOT T_WILDCARD(B).				{ A = alloc_op(T_DOTDOT, 0, NULL, B); }
+segment(A) ::= T_DOTDOT T_BROPEN union_exps(B) T_BRCLOSE.	{ A = alloc_op(T_DOTDOT, 0, NULL, B); }
+segment(A) ::= T_BROPEN T_FILTER T_POPEN or_exps(B) T_PCLOSE T_BRCLOSE.	{ A = B; }
+segment(A) ::= T_DOTDOT T_BROPEN T_FILTER T_POPEN or_exps(B) T_PCLOSE T_BRCLOSE.	{ A = alloc_op(T_DOTDOT, 0, NULL, B); }
+segment(A) ::= T_BROPEN slice(B) T_BRCLOSE.			{ A = B; }
+segment(A) ::= T_DOTDOT T_BROPEN slice(B) T_BRCLOSE.	{ A = alloc_op(T_DOTDOT, 0, NULL, B); }
+
+slice(A) ::= slice_bound(B) T_COLON slice_bound(C).	{ A = alloc_op(T_COLON, 0, NULL, B, C); }
+slice(A) ::= slice_bound(B) T_COLON slice_bound(C) T_COLON slice_bound(D).	{ A = alloc_op(T_COLON, 0, NULL, B, C, D); }
+
+slice_bound(A) ::= T_NUMBER(B).						{ A = B; }
+slice_bound(A) ::= .								{ A = alloc_op(T_WILDCARD, 0, NULL); }
@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+struct jp_pool_task {
+	jp_pool_fn_t fn;
+	void *arg;
+};
+
+/*
+ * Each worker owns a ring of tasks. The owner pushes and pops at the tail,
+ * so it keeps working on what it queued last, while idle workers steal
+ * from the head, taking the oldest and usually largest pieces of work.
+ */
+struct jp_pool_worker {
+	struct jp_pool *pool;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct jp_pool_task *tasks;
+	unsigned int head, tail, size;
+	int id;
+};
+
+struct jp_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	bool stop;
+
+	/* tasks sitting in rings / submitted but not finished */
+	int queued;
+	int pending;
+
+	unsigned int next;
+	int nworkers;
+	int nstarted;
+	struct jp_pool_worker workers[];
+};
+
+static __thread struct jp_pool_worker *jp_pool_self;
+
+static int
+jp_pool_push(struct jp_pool_worker *w, jp_pool_fn_t fn, void *arg)
+{
+	struct jp_pool_task *tasks, *task;
+	unsigned int i, n, size;
+
+	pthread_mutex_lock(&w->lock);
+
+	n = w->tail - w->head;
+
+	if (n == w->size)
+	{
+		size = w->size ? w->size * 2 : 64;
+		tasks = malloc(size * sizeof(*tasks));
+
+		if (!tasks)
+		{
+			pthread_mutex_unlock(&w->lock);
+			return -1;
+		}
+
+		for (i = 0; i < n; i++)
+			tasks[i] = w->tasks[(w->head + i) & (w->size - 1)];
+
+		free(w->tasks);
+		w->tasks = tasks;
+		w->size = size;
+		w->head = 0;
+		w->tail = n;
+	}
+
+	task = &w->tasks[w->tail++ & (w->size - 1)];
+	task->fn = fn;
+	task->arg = arg;
+
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+static bool
+jp_pool_pop(struct jp_pool_worker *w, struct jp_pool_task *task, bool steal)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&w->lock);
+
+	if (w->head != w->tail)
+	{
+		*task = steal ? w->tasks[w->head++ & (w->size - 1)]
+		              : w->tasks[--w->tail & (w->size - 1)];
+		found = true;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	return found;
+}
+
+static bool
+jp_pool_take(struct jp_pool_worker *w, struct jp_pool_task *task)
+{
+	struct jp_pool *pool = w->pool;
+	int i;
+
+	if (jp_pool_pop(w, task, false))
+		goto found;
+
+	for (i = 1; i < pool->nworkers; i++)
+		if (jp_pool_pop(&pool->workers[(w->id + i) % pool->nworkers], task, true))
+			goto found;
+
+	return false;
+
+found:
+	__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+	return true;
+}
+
+static void
+jp_pool_finish(struct jp_pool *pool)
+{
+	if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->done);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *
+jp_pool_run(void *priv)
+{
+	struct jp_pool_worker *w = priv;
+	struct jp_pool *pool = w->pool;
+	struct jp_pool_task task;
+	bool stop;
+
+	jp_pool_self = w;
+
+	for (;;)
+	{
+		if (jp_pool_take(w, &task))
+		{
+			task.fn(task.arg, w->id);
+			jp_pool_finish(pool);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+
+		while (!pool->stop &&
+		       !__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		stop = pool->stop && !__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE);
+
+		pthread_mutex_unlock(&pool->lock);
+
+		if (stop)
+			return NULL;
+	}
+}
+
+struct jp_pool *
+jp_pool_new(int nworkers)
+{
+	struct jp_pool *pool;
+	int i;
+
+	if (nworkers <= 0)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (nworkers <= 0)
+		nworkers = 1;
+
+	pool = calloc(1, sizeof(*pool) + nworkers * sizeof(pool->workers[0]));
+
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->nworkers = nworkers;
+
+	for (i = 0; i < nworkers; i++)
+	{
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		pthread_mutex_init(&pool->workers[i].lock, NULL);
+	}
+
+	for (i = 0; i < nworkers; i++)
+	{
+		if (pthread_create(&pool->workers[i].thread, NULL, jp_pool_run,
+		                   &pool->workers[i]))
+		{
+			jp_pool_free(pool);
+			return NULL;
+		}
+
+		pool->nstarted++;
+	}
+
+	return pool;
+}
+
+int
+jp_pool_size(struct jp_pool *pool)
+{
+	return pool->nworkers;
+}
+
+int
+jp_pool_submit(struct jp_pool *pool, jp_pool_fn_t fn, void *arg)
+{
+	struct jp_pool_worker *w = jp_pool_self;
+
+	/* tasks queued by a task stay with its worker */
+	if (!w || w->pool != pool)
+		w = &pool->workers[__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) %
+		                   pool->nworkers];
+
+	__atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+
+	if (jp_pool_push(w, fn, arg))
+	{
+		jp_pool_finish(pool);
+		return -1;
+	}
+
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+void
+jp_pool_wait(struct jp_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE))
+		pthread_cond_wait(&pool->done, &pool->lock);
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+jp_pool_free(struct jp_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	jp_pool_wait(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nstarted; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	for (i = 0; i < pool->nworkers; i++)
+	{
+		pthread_mutex_destroy(&pool->workers[i].lock);
+		free(pool->workers[i].tasks);
+	}
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+struct jp_pool_for {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int n, next, done, refs;
+};
+
+static void
+jp_pool_for_work(struct jp_pool_for *pf)
+{
+	int i, n = 0;
+
+	while ((i = __atomic_fetch_add(&pf->next, 1, __ATOMIC_RELAXED)) < pf->n)
+	{
+		pf->fn(pf->arg, i);
+		n++;
+	}
+
+	if (n && __atomic_add_fetch(&pf->done, n, __ATOMIC_ACQ_REL) == pf->n)
+	{
+		pthread_mutex_lock(&pf->lock);
+		pthread_cond_broadcast(&pf->cond);
+		pthread_mutex_unlock(&pf->lock);
+	}
+}
+
+static void
+jp_pool_for_put(struct jp_pool_for *pf)
+{
+	if (__atomic_sub_fetch(&pf->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	pthread_cond_destroy(&pf->cond);
+	pthread_mutex_destroy(&pf->lock);
+	free(pf);
+}
+
+/* helpers starting after everything was claimed merely drop their ref */
+static void
+jp_pool_for_task(void *arg, int worker)
+{
+	jp_pool_for_work(arg);
+	jp_pool_for_put(arg);
+}
+
+void
+jp_pool_for(struct jp_pool *pool, int n, void (*fn)(void *arg, int i),
+            void *arg)
+{
+	struct jp_pool_for *pf;
+	int i;
+
+	pf = calloc(1, sizeof(*pf));
+
+	if (!pf)
+	{
+		for (i = 0; i < n; i++)
+			fn(arg, i);
+
+		return;
+	}
+
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+	pf->fn = fn;
+	pf->arg = arg;
+	pf->n = n;
+	pf->refs = 1;
+
+	for (i = 1; i < n && i <= pool->nworkers; i++)
+	{
+		__atomic_add_fetch(&pf->refs, 1, __ATOMIC_ACQ_REL);
+
+		if (jp_pool_submit(pool, jp_pool_for_task, pf))
+		{
+			__atomic_sub_fetch(&pf->refs, 1, __ATOMIC_ACQ_REL);
+			break;
+		}
+	}
+
+	jp_pool_for_work(pf);
+
+	pthread_mutex_lock(&pf->lock);
+
+	while (__atomic_load_n(&pf->done, __ATOMIC_ACQUIRE) < n)
+		pthread_cond_wait(&pf->cond, &pf->lock);
+
+	pthread_mutex_unlock(&pf->lock);
+
+	jp_pool_for_put(pf);
+}
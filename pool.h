@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __POOL_H_
+#define __POOL_H_
+
+#include "jsonpath.h"
+
+/*
+ * Runs fn(arg, i) for every i below n, on the calling thread and on pool
+ * threads which are idle meanwhile, and returns once all of them did.
+ * Every call is claimed by whoever gets to it first, so it completes even
+ * if no pool thread ever becomes available, and may be used from tasks.
+ */
+void
+jp_pool_for(struct jp_pool *pool, int n, void (*fn)(void *arg, int i),
+            void *arg);
+
+#endif /* __POOL_H_ */
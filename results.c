@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "jsonpath.h"
+
+void
+jp_results_init(struct jp_results *res, struct json_object **buf, int size)
+{
+	res->items = buf;
+	res->count = 0;
+	res->size = buf ? size : 0;
+	res->owned = 0;
+	res->failed = 0;
+}
+
+static int
+jp_results_grow(struct jp_results *res)
+{
+	struct json_object **items;
+	int size = res->size ? res->size * 2 : 16;
+
+	/* a caller supplied buffer is left alone, the items move to the heap */
+	if (res->owned)
+	{
+		items = realloc(res->items, size * sizeof(*items));
+	}
+	else
+	{
+		items = malloc(size * sizeof(*items));
+
+		if (items && res->count)
+			memcpy(items, res->items, res->count * sizeof(*items));
+	}
+
+	if (!items)
+	{
+		res->failed = 1;
+		return -1;
+	}
+
+	res->items = items;
+	res->size = size;
+	res->owned = 1;
+
+	return 0;
+}
+
+int
+jp_results_add(struct jp_results *res, struct json_object *obj)
+{
+	if (res->count == res->size && jp_results_grow(res))
+		return -1;
+
+	res->items[res->count++] = obj;
+
+	return 0;
+}
+
+int
+jp_results_cb(struct json_object *obj, void *priv)
+{
+	return jp_results_add(priv, obj) ? 1 : 0;
+}
+
+void
+jp_results_reset(struct jp_results *res)
+{
+	res->count = 0;
+	res->failed = 0;
+}
+
+void
+jp_results_free(struct jp_results *res)
+{
+	if (res->owned)
+		free(res->items);
+
+	jp_results_init(res, NULL, 0);
+}
+
+int
+jp_match_collect(struct jp_opcode *path, struct json_object *input,
+                 struct jp_results *res, int max_results)
+{
+	int count = res->count;
+
+	jp_match_limit(path, input, jp_results_cb, res, max_results);
+
+	return res->failed ? -1 : (res->count - count);
+}
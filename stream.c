@@ -0,0 +1,595 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jsonpath.h"
+#include "matcher.h"
+#include "tokenizer.h"
+
+/*
+ * The streaming matcher follows the document with the set of program
+ * counters positioned at each open container. Entering a child steps every
+ * counter over its KEY, INDEX or SCAN instruction, a DESCEND counter also
+ * stays in place for the child. Subtrees no counter survives are skipped
+ * without being looked at.
+ *
+ * A child is only built as a json_object when the path selects it, when a
+ * filter needs to look at its value, or when a negative index or slice
+ * needs the length of the array. Once built, the remaining instructions run on it
+ * through the ordinary matcher and the value is released again.
+ */
+
+struct jp_stream_level {
+	bool object;
+	int idx;
+	int pcs;
+	int npcs;
+};
+
+struct jp_stream {
+	struct jp_tokenizer tok;
+	const struct jp_prog *prog;
+	struct jp_prog *own;
+	struct jp_ctx ctx;
+	bool *dynamic;
+
+	struct jp_stream_level *levels;
+	int nlevels, alevels;
+	int *pcs;
+	int npcs, apcs;
+	char *key;
+	size_t akey;
+	int skip;
+
+	/* subtree being built and what to run on it once complete */
+	struct json_object **build;
+	int nbuild, abuild;
+	int *tasks;
+	int ntasks, atasks;
+	char *tkey;
+	size_t atkey;
+	int tidx;
+};
+
+static bool
+jp_stream_grow(void **ptr, int *alloc, int want, size_t size)
+{
+	int n = *alloc ? *alloc : 16;
+	void *tmp;
+
+	if (want <= *alloc)
+		return true;
+
+	while (n < want)
+		n *= 2;
+
+	tmp = realloc(*ptr, n * size);
+
+	if (!tmp)
+		return false;
+
+	*ptr = tmp;
+	*alloc = n;
+
+	return true;
+}
+
+static bool
+jp_stream_strcpy(char **dst, size_t *alloc, const char *src, size_t len)
+{
+	char *tmp;
+
+	if (len + 1 > *alloc)
+	{
+		tmp = realloc(*dst, len + 1);
+
+		if (!tmp)
+			return false;
+
+		*dst = tmp;
+		*alloc = len + 1;
+	}
+
+	memcpy(*dst, src, len + 1);
+
+	return true;
+}
+
+static bool
+jp_stream_add_pc(struct jp_stream *st, int pc)
+{
+	if (!jp_stream_grow((void **)&st->pcs, &st->apcs, st->npcs + 1,
+	                    sizeof(*st->pcs)))
+		return false;
+
+	st->pcs[st->npcs++] = pc;
+
+	return true;
+}
+
+static bool
+jp_stream_add_task(struct jp_stream *st, int task)
+{
+	if (!jp_stream_grow((void **)&st->tasks, &st->atasks, st->ntasks + 1,
+	                    sizeof(*st->tasks)))
+		return false;
+
+	st->tasks[st->ntasks++] = task;
+
+	return true;
+}
+
+/* runs the collected tasks on a completely built value, then drops it */
+static void
+jp_stream_fire(struct jp_stream *st, struct json_object *val)
+{
+	const struct jp_prog *prog = st->prog;
+	int i, pc;
+
+	for (i = 0; i < st->ntasks && !st->ctx.stop; i++)
+	{
+		pc = st->tasks[i];
+
+		/* filters are encoded as -(pc + 1) of their SCAN */
+		if (pc < 0)
+		{
+			pc = -pc - 1;
+
+			if (!jp_pred(prog, prog->code[pc].arg, &st->ctx, val, st->tidx,
+			             (st->tidx < 0) ? st->tkey : NULL))
+				continue;
+
+			pc++;
+		}
+
+		jp_run(prog, pc, &st->ctx, val);
+	}
+
+	st->ntasks = 0;
+	json_object_put(val);
+}
+
+static struct json_object *
+jp_stream_scalar(int ev, const char *buf, size_t len)
+{
+	switch (ev)
+	{
+	case JP_EV_STRING:
+		return json_object_new_string_len(buf, len);
+
+	case JP_EV_NUMBER:
+		if (strpbrk(buf, ".eE"))
+			return json_object_new_double(strtod(buf, NULL));
+
+		return json_object_new_int64(strtoll(buf, NULL, 10));
+
+	case JP_EV_TRUE:
+	case JP_EV_FALSE:
+		return json_object_new_boolean(ev == JP_EV_TRUE);
+
+	default:
+		return NULL;
+	}
+}
+
+static int
+jp_stream_build(struct jp_stream *st, int ev, const char *buf, size_t len)
+{
+	struct json_object *val, *parent;
+	bool container = (ev == JP_EV_OBJECT_BEGIN || ev == JP_EV_ARRAY_BEGIN);
+
+	if (ev == JP_EV_OBJECT_END || ev == JP_EV_ARRAY_END)
+	{
+		val = st->build[--st->nbuild];
+
+		if (!st->nbuild)
+			jp_stream_fire(st, val);
+
+		return 0;
+	}
+
+	if (ev == JP_EV_OBJECT_BEGIN)
+		val = json_object_new_object();
+	else if (ev == JP_EV_ARRAY_BEGIN)
+		val = json_object_new_array();
+	else
+		val = jp_stream_scalar(ev, buf, len);
+
+	if (!val && ev != JP_EV_NULL)
+		return -1;
+
+	if (st->nbuild)
+	{
+		parent = st->build[st->nbuild - 1];
+
+		if (json_object_get_type(parent) == json_type_object)
+			json_object_object_add(parent, st->key, val);
+		else
+			json_object_array_add(parent, val);
+
+		/* the parent holds the reference now */
+		if (!container)
+			return 0;
+	}
+	else if (!container)
+	{
+		jp_stream_fire(st, val);
+		return 0;
+	}
+
+	if (!jp_stream_grow((void **)&st->build, &st->abuild, st->nbuild + 1,
+	                    sizeof(*st->build)))
+	{
+		if (!st->nbuild)
+			json_object_put(val);
+
+		return -1;
+	}
+
+	st->build[st->nbuild++] = val;
+
+	return 0;
+}
+
+/* slices counting from the end or backwards need the array's length */
+static bool
+jp_stream_slice_len(const struct jp_value *slice)
+{
+	return ((slice[0].type == T_NUMBER && slice[0].num < 0) ||
+	        (slice[1].type == T_NUMBER && slice[1].num < 0) ||
+	        (slice[2].type == T_NUMBER && slice[2].num < 0));
+}
+
+static bool
+jp_stream_slice(const struct jp_value *slice, int idx)
+{
+	int start = (slice[0].type == T_NUMBER) ? slice[0].num : 0;
+	int step = (slice[2].type == T_NUMBER) ? slice[2].num : 1;
+
+	if (jp_stream_slice_len(slice) || step == 0 || idx < start)
+		return false;
+
+	if (slice[1].type == T_NUMBER && idx >= slice[1].num)
+		return false;
+
+	return ((idx - start) % step == 0);
+}
+
+/* children of objects are at index -1, as the unions they replace had it */
+static bool
+jp_stream_pick(const struct jp_value *list, const char *key, int idx)
+{
+	int i;
+
+	for (i = 1; i <= list->num; i++)
+		if ((list[i].type == T_STRING)
+		    ? (key && !strcmp(list[i].str, key)) : (list[i].num == idx))
+			return true;
+
+	return false;
+}
+
+/* steps a single counter over the child entered */
+static bool
+jp_stream_step_pc(struct jp_stream *st, int pc, const char *key, int idx)
+{
+	const struct jp_prog *prog = st->prog;
+	const struct jp_insn *insn = &prog->code[pc];
+
+	switch (insn->op)
+	{
+	case JP_OP_KEY:
+		if (key && !strcmp(prog->consts[insn->arg].str, key))
+			return jp_stream_add_pc(st, pc + 1);
+
+		break;
+
+	case JP_OP_INDEX:
+		if (idx == insn->arg)
+			return jp_stream_add_pc(st, pc + 1);
+
+		break;
+
+	case JP_OP_SCAN:
+		if (st->dynamic[pc])
+			return jp_stream_add_task(st, -pc - 1);
+
+		if (jp_pred(prog, insn->arg, &st->ctx, NULL, idx, key))
+			return jp_stream_add_pc(st, pc + 1);
+
+		break;
+
+	case JP_OP_KEYS:
+	case JP_OP_INDEXES:
+		if (jp_stream_pick(&prog->consts[insn->arg], key, idx))
+			return jp_stream_add_pc(st, pc + 1);
+
+		break;
+
+	case JP_OP_SLICE:
+		if (idx >= 0 && jp_stream_slice(&prog->consts[insn->arg], idx))
+			return jp_stream_add_pc(st, pc + 1);
+
+		break;
+
+	case JP_OP_DESCEND:
+		/* the next step applies to this container's children, the
+		 * descent itself carries on into the child */
+		return (jp_stream_step_pc(st, pc + 1, key, idx) &&
+		        jp_stream_add_pc(st, pc));
+	}
+
+	return true;
+}
+
+/* steps the counters of the innermost container into the child entered */
+static bool
+jp_stream_step(struct jp_stream *st, const char *key, int idx)
+{
+	const struct jp_stream_level *l = &st->levels[st->nlevels - 1];
+	int i;
+
+	for (i = l->pcs; i < l->pcs + l->npcs; i++)
+		if (!jp_stream_step_pc(st, st->pcs[i], key, idx))
+			return false;
+
+	return true;
+}
+
+static int
+jp_stream_value(struct jp_stream *st, int ev, const char *buf, size_t len)
+{
+	const struct jp_prog *prog = st->prog;
+	struct jp_stream_level *l;
+	const char *key = NULL;
+	int i, pc, idx = -1, start = st->npcs;
+	bool build = false;
+
+	if (!st->nlevels)
+	{
+		if (!jp_stream_add_pc(st, 0))
+			return -1;
+	}
+	else
+	{
+		l = &st->levels[st->nlevels - 1];
+
+		if (l->object)
+			key = st->key;
+		else
+			idx = l->idx++;
+
+		if (!jp_stream_step(st, key, idx))
+			return -1;
+	}
+
+	build = (st->ntasks > 0);
+
+	for (i = start; i < st->npcs && !build; i++)
+	{
+		pc = st->pcs[i];
+
+		if (prog->code[pc].op == JP_OP_EMIT ||
+		    (prog->code[pc].op == JP_OP_INDEX && prog->code[pc].arg < 0) ||
+		    (prog->code[pc].op == JP_OP_SLICE &&
+		     jp_stream_slice_len(&prog->consts[prog->code[pc].arg])))
+			build = true;
+	}
+
+	if (build)
+	{
+		for (i = start; i < st->npcs; i++)
+			if (!jp_stream_add_task(st, st->pcs[i]))
+				return -1;
+
+		st->npcs = start;
+		st->tidx = idx;
+
+		if (key && !jp_stream_strcpy(&st->tkey, &st->atkey, key, strlen(key)))
+			return -1;
+
+		return jp_stream_build(st, ev, buf, len);
+	}
+
+	if (ev != JP_EV_OBJECT_BEGIN && ev != JP_EV_ARRAY_BEGIN)
+	{
+		st->npcs = start;
+		return 0;
+	}
+
+	if (st->npcs == start)
+	{
+		st->skip = 1;
+		return 0;
+	}
+
+	if (!jp_stream_grow((void **)&st->levels, &st->alevels, st->nlevels + 1,
+	                    sizeof(*st->levels)))
+		return -1;
+
+	l = &st->levels[st->nlevels++];
+	l->object = (ev == JP_EV_OBJECT_BEGIN);
+	l->idx = 0;
+	l->pcs = start;
+	l->npcs = st->npcs - start;
+
+	return 0;
+}
+
+static int
+jp_stream_dispatch(struct jp_stream *st, int ev, const char *buf, size_t len)
+{
+	if (ev == JP_EV_KEY)
+		return jp_stream_strcpy(&st->key, &st->akey, buf, len) ? 0 : -1;
+
+	if (st->nbuild)
+		return jp_stream_build(st, ev, buf, len);
+
+	if (st->skip)
+	{
+		if (ev == JP_EV_OBJECT_BEGIN || ev == JP_EV_ARRAY_BEGIN)
+			st->skip++;
+		else if (ev == JP_EV_OBJECT_END || ev == JP_EV_ARRAY_END)
+			st->skip--;
+
+		return 0;
+	}
+
+	if (ev == JP_EV_OBJECT_END || ev == JP_EV_ARRAY_END)
+	{
+		st->npcs -= st->levels[--st->nlevels].npcs;
+		return 0;
+	}
+
+	return jp_stream_value(st, ev, buf, len);
+}
+
+static int
+jp_stream_event(int ev, const char *buf, size_t len, void *priv)
+{
+	struct jp_stream *st = priv;
+
+	if (jp_stream_dispatch(st, ev, buf, len))
+	{
+		st->tok.error = "Out of memory";
+		return -1;
+	}
+
+	/* the tokenizer hands this back from jp_tokenizer_feed() */
+	return st->ctx.stop ? 1 : 0;
+}
+
+static struct jp_stream *
+jp_stream_create(struct jp_opcode *path, jp_match_stop_cb_t cb,
+                 jp_match_cb_t notify, void *priv, int max)
+{
+	const struct jp_insn *insn;
+	struct jp_stream *st;
+	int pc, i;
+
+	st = calloc(1, sizeof(*st));
+
+	if (!st)
+		return NULL;
+
+	st->prog = path->prog;
+
+	if (!st->prog)
+		st->prog = st->own = jp_compile(NULL, path);
+
+	if (!st->prog)
+		goto fail;
+
+	/* the document root is never available while streaming, so there is
+	 * nothing to resolve operands rooted at $ against */
+	if (st->prog->nhoists)
+		goto fail;
+
+	st->dynamic = calloc(st->prog->ncode, sizeof(*st->dynamic));
+
+	if (!st->dynamic)
+		goto fail;
+
+	for (pc = 0; pc < st->prog->ncode; pc++)
+	{
+		insn = &st->prog->code[pc];
+
+		if (insn->op != JP_OP_SCAN)
+			continue;
+
+		for (i = insn->arg; st->prog->code[i].op != JP_OP_RET; i++)
+			if (st->prog->code[i].op == JP_OP_EXISTS ||
+			    st->prog->code[i].op == JP_OP_RESOLVE ||
+			    st->prog->code[i].op == JP_OP_TEST)
+				st->dynamic[pc] = true;
+	}
+
+	st->ctx.cb = cb;
+	st->ctx.notify = notify;
+	st->ctx.priv = priv;
+	st->ctx.left = max;
+	jp_ctx_init(&st->ctx, st->prog, NULL, NULL);
+	jp_tokenizer_init(&st->tok, jp_stream_event, st);
+
+	return st;
+
+fail:
+	jp_stream_free(st);
+	return NULL;
+}
+
+struct jp_stream *
+jp_stream_new(struct jp_opcode *path, jp_match_cb_t cb, void *priv)
+{
+	return jp_stream_create(path, NULL, cb, priv, -1);
+}
+
+struct jp_stream *
+jp_stream_new_limit(struct jp_opcode *path, jp_match_stop_cb_t cb,
+                    void *priv, int max_results)
+{
+	return jp_stream_create(path, cb, NULL, priv, max_results);
+}
+
+int
+jp_stream_feed(struct jp_stream *st, const char *buf, size_t len)
+{
+	if (st->ctx.stop)
+		return 1;
+
+	if (!jp_tokenizer_feed(&st->tok, buf, len))
+		return 0;
+
+	return st->ctx.stop ? 1 : -1;
+}
+
+int
+jp_stream_end(struct jp_stream *st)
+{
+	if (st->ctx.stop || !jp_tokenizer_end(&st->tok))
+		return 0;
+
+	/* a number at the very end is only complete now */
+	return st->ctx.stop ? 0 : -1;
+}
+
+const char *
+jp_stream_error(struct jp_stream *st)
+{
+	return st->tok.error;
+}
+
+void
+jp_stream_free(struct jp_stream *st)
+{
+	/* a partially built value is owned by its outermost container */
+	if (st->nbuild)
+		json_object_put(st->build[0]);
+
+	jp_tokenizer_free(&st->tok);
+	jp_prog_free(st->own);
+	free(st->dynamic);
+	free(st->levels);
+	free(st->pcs);
+	free(st->key);
+	free(st->build);
+	free(st->tasks);
+	free(st->tkey);
+	free(st);
+}
@@ -0,0 +1,556 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tokenizer.h"
+
+enum {
+	S_VALUE,		/* expecting a value */
+	S_VALUE_OR_END,	/* after '[' */
+	S_KEY,			/* expecting a member name after ',' */
+	S_KEY_OR_END,	/* after '{' */
+	S_COLON,
+	S_NEXT,			/* after a value, expecting ',' or a closing bracket */
+	S_STRING,
+	S_ESCAPE,
+	S_UNICODE,
+	S_NUMBER,
+	S_LITERAL,
+	S_DONE,
+	S_ERROR
+};
+
+#define is_space(c) \
+	((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+#define is_digit(c) \
+	((c) >= '0' && (c) <= '9')
+
+#define hex(x) \
+	(((x) >= 'a') ? (10 + (x) - 'a') : \
+		(((x) >= 'A') ? (10 + (x) - 'A') : ((x) - '0')))
+
+void
+jp_tokenizer_init(struct jp_tokenizer *t, jp_event_cb_t cb, void *priv)
+{
+	memset(t, 0, sizeof(*t));
+	t->cb = cb;
+	t->priv = priv;
+}
+
+void
+jp_tokenizer_reset(struct jp_tokenizer *t)
+{
+	t->state = S_VALUE;
+	t->depth = 0;
+	t->len = 0;
+	t->uhigh = 0;
+	t->off = 0;
+	t->error = NULL;
+}
+
+void
+jp_tokenizer_free(struct jp_tokenizer *t)
+{
+	free(t->stack);
+	free(t->buf);
+	t->stack = NULL;
+	t->buf = NULL;
+}
+
+static int
+fail(struct jp_tokenizer *t, const char *error)
+{
+	t->state = S_ERROR;
+	t->error = error;
+	return -1;
+}
+
+static bool
+append(struct jp_tokenizer *t, const char *s, size_t n)
+{
+	size_t size = t->size ? t->size : 64;
+	char *tmp;
+
+	if (t->len + n + 1 > t->size)
+	{
+		while (t->len + n + 1 > size)
+			size *= 2;
+
+		tmp = realloc(t->buf, size);
+
+		if (!tmp)
+			return false;
+
+		t->buf = tmp;
+		t->size = size;
+	}
+
+	memcpy(t->buf + t->len, s, n);
+	t->len += n;
+	t->buf[t->len] = 0;
+
+	return true;
+}
+
+static bool
+append_utf8(struct jp_tokenizer *t, unsigned int code)
+{
+	char out[4];
+
+	if (code <= 0x7F)
+	{
+		out[0] = code;
+		return append(t, out, 1);
+	}
+	else if (code <= 0x7FF)
+	{
+		out[0] = ((code >>  6) & 0x1F) | 0xC0;
+		out[1] = ( code        & 0x3F) | 0x80;
+		return append(t, out, 2);
+	}
+	else if (code <= 0xFFFF)
+	{
+		out[0] = ((code >> 12) & 0x0F) | 0xE0;
+		out[1] = ((code >>  6) & 0x3F) | 0x80;
+		out[2] = ( code        & 0x3F) | 0x80;
+		return append(t, out, 3);
+	}
+
+	out[0] = ((code >> 18) & 0x07) | 0xF0;
+	out[1] = ((code >> 12) & 0x3F) | 0x80;
+	out[2] = ((code >>  6) & 0x3F) | 0x80;
+	out[3] = ( code        & 0x3F) | 0x80;
+	return append(t, out, 4);
+}
+
+/* a high surrogate not followed by a low one is replaced by U+FFFD */
+static bool
+flush_surrogate(struct jp_tokenizer *t)
+{
+	if (!t->uhigh)
+		return true;
+
+	t->uhigh = 0;
+
+	return append_utf8(t, 0xFFFD);
+}
+
+static bool
+push(struct jp_tokenizer *t, char type)
+{
+	int n = t->adepth ? t->adepth * 2 : 16;
+	char *tmp;
+
+	if (t->depth == t->adepth)
+	{
+		tmp = realloc(t->stack, n);
+
+		if (!tmp)
+			return false;
+
+		t->stack = tmp;
+		t->adepth = n;
+	}
+
+	t->stack[t->depth++] = type;
+
+	return true;
+}
+
+static void
+value_done(struct jp_tokenizer *t)
+{
+	t->state = t->depth ? S_NEXT : S_DONE;
+}
+
+static int
+emit(struct jp_tokenizer *t, int event)
+{
+	return t->cb(event, t->buf, t->len, t->priv);
+}
+
+static int
+finish_number(struct jp_tokenizer *t)
+{
+	char *e;
+
+	/* an empty buffer still needs a terminator for strtod() */
+	if (!append(t, "", 0))
+		return fail(t, "Out of memory");
+
+	strtod(t->buf, &e);
+
+	if (e == t->buf || *e)
+		return fail(t, "Invalid number");
+
+	value_done(t);
+
+	return emit(t, JP_EV_NUMBER);
+}
+
+static int
+begin_value(struct jp_tokenizer *t, char c)
+{
+	switch (c)
+	{
+	case '{':
+		if (!push(t, '{'))
+			return fail(t, "Out of memory");
+
+		t->state = S_KEY_OR_END;
+		return emit(t, JP_EV_OBJECT_BEGIN);
+
+	case '[':
+		if (!push(t, '['))
+			return fail(t, "Out of memory");
+
+		t->state = S_VALUE_OR_END;
+		return emit(t, JP_EV_ARRAY_BEGIN);
+
+	case '"':
+		t->key = false;
+		t->len = 0;
+		t->state = S_STRING;
+		return 0;
+
+	case 't':
+		t->lit = "true";
+		break;
+
+	case 'f':
+		t->lit = "false";
+		break;
+
+	case 'n':
+		t->lit = "null";
+		break;
+
+	default:
+		return fail(t, "Unexpected character");
+	}
+
+	t->lpos = 1;
+	t->state = S_LITERAL;
+
+	return 0;
+}
+
+static int
+close_container(struct jp_tokenizer *t, char c)
+{
+	char open = (c == '}') ? '{' : '[';
+
+	if (!t->depth || t->stack[t->depth - 1] != open)
+		return fail(t, "Unexpected character");
+
+	t->depth--;
+	value_done(t);
+
+	return emit(t, (c == '}') ? JP_EV_OBJECT_END : JP_EV_ARRAY_END);
+}
+
+int
+jp_tokenizer_feed(struct jp_tokenizer *t, const char *buf, size_t len)
+{
+	const char *p = buf, *end = buf + len, *run;
+	unsigned char c;
+	int rv = 0;
+
+	if (t->state == S_ERROR)
+		return -1;
+
+	while (p < end && !rv)
+	{
+		c = *p;
+
+		switch (t->state)
+		{
+		case S_VALUE_OR_END:
+			if (c == ']')
+			{
+				p++;
+				rv = close_container(t, c);
+				break;
+			}
+
+			/* fall through */
+
+		case S_VALUE:
+			if (is_space(c))
+			{
+				p++;
+			}
+			else if (c == '-' || is_digit(c))
+			{
+				t->len = 0;
+				t->state = S_NUMBER;
+			}
+			else
+			{
+				p++;
+				rv = begin_value(t, c);
+			}
+
+			break;
+
+		case S_KEY_OR_END:
+		case S_KEY:
+			p++;
+
+			if (is_space(c))
+				break;
+
+			if (c == '}' && t->state == S_KEY_OR_END)
+			{
+				rv = close_container(t, c);
+			}
+			else if (c == '"')
+			{
+				t->key = true;
+				t->len = 0;
+				t->state = S_STRING;
+			}
+			else
+			{
+				rv = fail(t, "Expected member name");
+			}
+
+			break;
+
+		case S_COLON:
+			p++;
+
+			if (is_space(c))
+				break;
+
+			if (c == ':')
+				t->state = S_VALUE;
+			else
+				rv = fail(t, "Expected ':'");
+
+			break;
+
+		case S_NEXT:
+			p++;
+
+			if (is_space(c))
+				break;
+
+			if (c == ',')
+				t->state = (t->stack[t->depth - 1] == '{') ? S_KEY : S_VALUE;
+			else if (c == '}' || c == ']')
+				rv = close_container(t, c);
+			else
+				rv = fail(t, "Expected ',' or closing bracket");
+
+			break;
+
+		case S_STRING:
+			/* copy runs of ordinary characters in one go */
+			for (run = p; p < end; p++)
+				if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20)
+					break;
+
+			if (p > run &&
+			    (!flush_surrogate(t) || !append(t, run, p - run)))
+			{
+				rv = fail(t, "Out of memory");
+				break;
+			}
+
+			if (p == end)
+				break;
+
+			c = *p++;
+
+			if (c == '\\')
+			{
+				t->state = S_ESCAPE;
+			}
+			else if (c == '"')
+			{
+				if (!flush_surrogate(t) || !append(t, "", 0))
+				{
+					rv = fail(t, "Out of memory");
+				}
+				else if (t->key)
+				{
+					t->state = S_COLON;
+					rv = emit(t, JP_EV_KEY);
+				}
+				else
+				{
+					value_done(t);
+					rv = emit(t, JP_EV_STRING);
+				}
+			}
+			else
+			{
+				rv = fail(t, "Control character in string");
+			}
+
+			break;
+
+		case S_ESCAPE:
+			p++;
+
+			if (c == 'u')
+			{
+				t->ucount = 0;
+				t->ucode = 0;
+				t->state = S_UNICODE;
+				break;
+			}
+
+			switch (c)
+			{
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case '"':
+			case '\\':
+			case '/':
+				break;
+
+			default:
+				rv = fail(t, "Invalid escape sequence");
+				continue;
+			}
+
+			if (!flush_surrogate(t) || !append(t, (char *)&c, 1))
+				rv = fail(t, "Out of memory");
+
+			t->state = S_STRING;
+			break;
+
+		case S_UNICODE:
+			p++;
+
+			if (!((c >= '0' && c <= '9') ||
+			      (c >= 'a' && c <= 'f') ||
+			      (c >= 'A' && c <= 'F')))
+			{
+				rv = fail(t, "Invalid escape sequence");
+				break;
+			}
+
+			t->ucode = t->ucode * 16 + hex(c);
+
+			if (++t->ucount < 4)
+				break;
+
+			t->state = S_STRING;
+
+			if (t->uhigh && t->ucode >= 0xDC00 && t->ucode <= 0xDFFF)
+			{
+				t->ucode = 0x10000 + ((t->uhigh - 0xD800) << 10) +
+				           (t->ucode - 0xDC00);
+				t->uhigh = 0;
+			}
+			else if (!flush_surrogate(t))
+			{
+				rv = fail(t, "Out of memory");
+				break;
+			}
+
+			if (t->ucode >= 0xD800 && t->ucode <= 0xDBFF)
+				t->uhigh = t->ucode;
+			else if (t->ucode >= 0xDC00 && t->ucode <= 0xDFFF)
+				t->ucode = 0xFFFD;
+
+			if (!t->uhigh && !append_utf8(t, t->ucode))
+				rv = fail(t, "Out of memory");
+
+			break;
+
+		case S_NUMBER:
+			for (run = p; p < end; p++)
+				if (!is_digit(*p) && (!*p || !strchr("+-.eE", *p)))
+					break;
+
+			if (p > run && !append(t, run, p - run))
+			{
+				rv = fail(t, "Out of memory");
+				break;
+			}
+
+			if (p < end)
+				rv = finish_number(t);
+
+			break;
+
+		case S_LITERAL:
+			p++;
+
+			if (c != t->lit[t->lpos++])
+			{
+				rv = fail(t, "Unexpected character");
+				break;
+			}
+
+			if (t->lit[t->lpos])
+				break;
+
+			value_done(t);
+			rv = emit(t, (t->lit[0] == 't') ? JP_EV_TRUE :
+			             (t->lit[0] == 'f') ? JP_EV_FALSE : JP_EV_NULL);
+			break;
+
+		case S_DONE:
+			p++;
+
+			if (!is_space(c))
+				rv = fail(t, "Trailing data after value");
+
+			break;
+
+		default:
+			return -1;
+		}
+	}
+
+	t->off += p - buf;
+
+	return rv;
+}
+
+int
+jp_tokenizer_end(struct jp_tokenizer *t)
+{
+	int rv;
+
+	/* a top level number is only terminated by the end of input */
+	if (t->state == S_NUMBER && t->depth == 0)
+	{
+		rv = finish_number(t);
+
+		if (rv)
+			return rv;
+	}
+
+	if (t->state == S_ERROR)
+		return -1;
+
+	if (t->state != S_DONE)
+		return fail(t, "Unexpected end of data");
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __TOKENIZER_H_
+#define __TOKENIZER_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+enum jp_event {
+	JP_EV_OBJECT_BEGIN,
+	JP_EV_OBJECT_END,
+	JP_EV_ARRAY_BEGIN,
+	JP_EV_ARRAY_END,
+	JP_EV_KEY,
+	JP_EV_STRING,
+	JP_EV_NUMBER,
+	JP_EV_TRUE,
+	JP_EV_FALSE,
+	JP_EV_NULL,
+};
+
+/*
+ * Receives each parse event. Keys, strings and numbers pass their decoded
+ * text, which is only valid during the call. Returning non-zero stops the
+ * tokenizer and is passed back to the caller of jp_tokenizer_feed().
+ */
+typedef int (*jp_event_cb_t)(int event, const char *buf, size_t len,
+                             void *priv);
+
+/*
+ * Incremental JSON tokenizer. Input may be split at any byte, memory use
+ * is one byte per nesting level plus the longest key or scalar.
+ */
+struct jp_tokenizer {
+	int state;
+	bool key;
+	const char *lit;
+	int lpos;
+	int ucount;
+	unsigned int ucode;
+	unsigned int uhigh;
+
+	char *stack;
+	int depth, adepth;
+
+	char *buf;
+	size_t len, size;
+
+	size_t off;
+	const char *error;
+
+	jp_event_cb_t cb;
+	void *priv;
+};
+
+void jp_tokenizer_init(struct jp_tokenizer *t, jp_event_cb_t cb, void *priv);
+void jp_tokenizer_reset(struct jp_tokenizer *t);
+void jp_tokenizer_free(struct jp_tokenizer *t);
+
+/*
+ * Returns 0 when the input was consumed, -1 on malformed input with
+ * t->error and t->off describing the problem, or the non-zero value a
+ * callback returned to stop early.
+ */
+int jp_tokenizer_feed(struct jp_tokenizer *t, const char *buf, size_t len);
+
+/* signals the end of input, fails unless exactly one value was seen */
+int jp_tokenizer_end(struct jp_tokenizer *t);
+
+#endif /* __TOKENIZER_H_ */